@@ -0,0 +1,85 @@
+#include "atlas.hpp"
+
+#include <cassert>
+
+SkylinePacker::SkylinePacker(int width, int height):
+    pageWidth(width), pageHeight(height)
+{
+    assert(width > 0 && height > 0);
+    reset();
+}
+
+void SkylinePacker::reset()
+{
+    skyline.clear();
+    skyline.push_back(Segment{0, 0, pageWidth});
+    usedArea = 0;
+}
+
+float SkylinePacker::occupancy() const
+{
+    return static_cast<float>(usedArea) / (static_cast<float>(pageWidth)*pageHeight);
+}
+
+int SkylinePacker::fit(int i, int width, int height) const
+{
+    if (skyline[i].x + width > pageWidth)
+        return -1;
+    int y = 0;
+    for (int remaining = width; remaining > 0; i++) {
+        if (skyline[i].y > y)
+            y = skyline[i].y;
+        if (y + height > pageHeight)
+            return -1;
+        remaining -= skyline[i].width;
+    }
+    return y;
+}
+
+bool SkylinePacker::insert(int width, int height, int& x, int& y)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+
+    // Lowest top edge wins; on a tie the narrower segment, which wastes less
+    int best = -1, bestTop = 0, bestWidth = 0;
+    for (int i = 0; i < static_cast<int>(skyline.size()); i++) {
+        const int top = fit(i, width, height);
+        if (top < 0)
+            continue;
+        if (best < 0 || top + height < bestTop || (top + height == bestTop && skyline[i].width < bestWidth)) {
+            best = i;
+            bestTop = top + height;
+            bestWidth = skyline[i].width;
+        }
+    }
+    if (best < 0)
+        return false;
+    x = skyline[best].x;
+    y = bestTop - height;
+
+    // The rectangle's top becomes a segment, and hides what it covers of
+    // the segments after it
+    skyline.insert(skyline.begin() + best, Segment{x, bestTop, width});
+    for (std::size_t i = best + 1; i < skyline.size(); ) {
+        const int covered = x + width - skyline[i].x;
+        if (covered <= 0)
+            break;
+        if (covered < skyline[i].width) {
+            skyline[i].x += covered;
+            skyline[i].width -= covered;
+            break;
+        }
+        skyline.erase(skyline.begin() + i);
+    }
+    // Neighbours at the same height are one segment
+    for (std::size_t i = 0; i + 1 < skyline.size(); ) {
+        if (skyline[i].y == skyline[i+1].y) {
+            skyline[i].width += skyline[i+1].width;
+            skyline.erase(skyline.begin() + i + 1);
+        } else
+            i++;
+    }
+    usedArea += static_cast<long long>(width)*height;
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef __ATLAS_HPP__
+#define __ATLAS_HPP__
+
+#include <vector>
+
+// Skyline bottom-left rectangle packer (Jylänki, "A Thousand Ways to Pack the
+// Bin"). Only the top edge of everything placed so far is kept, as a list of
+// horizontal segments; a new rectangle goes where its top ends up lowest.
+// Rectangles are placed one at a time and never move, so images can be added
+// to an atlas whenever they load. Space under an overhang is lost, which
+// costs little when the sizes are similar.
+class SkylinePacker {
+public:
+    SkylinePacker(int width, int height);
+
+    // Finds room for a width x height rectangle and returns its top-left
+    // corner, false if it doesn't fit anywhere
+    bool insert(int width, int height, int& x, int& y);
+    // Forgets every rectangle
+    void reset();
+
+    int width() const { return pageWidth; }
+    int height() const { return pageHeight; }
+    // Fraction of the page covered by rectangles
+    float occupancy() const;
+
+private:
+    struct Segment {
+        int x, y, width;
+    };
+
+    // Lowest y a rectangle of the given width can sit at when its left edge
+    // is at segment i's, -1 if it runs off the page
+    int fit(int i, int width, int height) const;
+
+    int pageWidth, pageHeight;
+    long long usedArea;
+    std::vector<Segment> skyline; // left to right, covering the whole width
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "commands.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+static u64 makeKey(int pass, ShaderID shader, TextureID texture, MeshID mesh)
+{
+    return (static_cast<u64>(pass)        << 56) |
+           (static_cast<u64>(shader + 1)  << 44) |
+           (static_cast<u64>(texture + 1) << 24) |
+            static_cast<u64>(mesh);
+}
+
+void CommandBuffer::setTarget(int pass, unsigned int framebuffer)
+{
+    assert(pass >= 0 && pass < COMMAND_MAX_PASSES);
+    this->pass = pass;
+    this->framebuffer = framebuffer;
+}
+
+void CommandBuffer::clear(float r, float g, float b, float a)
+{
+    RenderCommand command = RenderCommand();
+    command.key = makeKey(pass, -1, -1, 0);
+    command.type = CommandType::Clear;
+    command.framebuffer = framebuffer;
+    command.shader = -1;
+    std::fill(command.textures, command.textures + COMMAND_TEXTURE_UNITS, -1);
+    command.mesh = -1;
+    command.clearColor[0] = r;
+    command.clearColor[1] = g;
+    command.clearColor[2] = b;
+    command.clearColor[3] = a;
+    commands.push_back(command);
+}
+
+void CommandBuffer::setShader(ShaderID shader)
+{
+    assert(shader >= 0 && shader < COMMAND_MAX_SHADERS);
+    this->shader = shader;
+    pendingUniforms.clear();
+    pendingValues.clear();
+    pendingChanged = true;
+}
+
+void CommandBuffer::setTexture(int unit, TextureID id)
+{
+    assert(unit >= 0 && unit < COMMAND_TEXTURE_UNITS);
+    assert(id >= 0 && id < COMMAND_MAX_TEXTURES);
+    textures[unit] = id;
+}
+
+u32 CommandBuffer::uniformNameId(const std::string& name)
+{
+    const auto found = uniformNameIds.find(name);
+    if (found != uniformNameIds.end())
+        return found->second;
+    uniformNames.push_back(name);
+    uniformNameIds[name] = uniformNames.size()-1;
+    return uniformNames.size()-1;
+}
+
+void CommandBuffer::setUniform(const std::string& name, UniformType type, int count, int intValue, const float* value, int numFloats)
+{
+    assert(shader >= 0);
+    const u32 nameId = uniformNameId(name);
+    CommandUniform* uniform = nullptr;
+    for (CommandUniform& u: pendingUniforms) {
+        if (u.nameId == nameId) {
+            uniform = &u;
+            break;
+        }
+    }
+    if (uniform == nullptr) {
+        pendingUniforms.push_back(CommandUniform());
+        uniform = &pendingUniforms.back();
+        uniform->nameId = nameId;
+        uniform->count = 0;
+    }
+    pendingChanged = true;
+
+    // Overwrite in place when the size matches, the usual case for per-draw values
+    if (uniform->type != type || uniform->count != count) {
+        uniform->valueOffset = pendingValues.size();
+        pendingValues.resize(pendingValues.size() + numFloats);
+    }
+    uniform->type = type;
+    uniform->count = count;
+    uniform->intValue = intValue;
+    std::copy(value, value + numFloats, pendingValues.begin() + uniform->valueOffset);
+}
+
+void CommandBuffer::setUniform1i(const std::string& name, int value)
+{
+    setUniform(name, UniformType::Int1, 1, value, nullptr, 0);
+}
+
+void CommandBuffer::setUniform1f(const std::string& name, float value)
+{
+    setUniform(name, UniformType::Float1, 1, 0, &value, 1);
+}
+
+void CommandBuffer::setUniform2fv(const std::string& name, int count, const float* value)
+{
+    setUniform(name, UniformType::Float2, count, 0, value, 2*count);
+}
+
+void CommandBuffer::setUniform3fv(const std::string& name, int count, const float* value)
+{
+    setUniform(name, UniformType::Float3, count, 0, value, 3*count);
+}
+
+void CommandBuffer::setUniform4fv(const std::string& name, int count, const float* value)
+{
+    setUniform(name, UniformType::Float4, count, 0, value, 4*count);
+}
+
+void CommandBuffer::setUniform4x4fv(const std::string& name, int count, const float* value)
+{
+    setUniform(name, UniformType::Matrix4, count, 0, value, 16*count);
+}
+
+RenderCommand& CommandBuffer::addDraw(CommandType type, MeshID id)
+{
+    assert(shader >= 0);
+    assert(id >= 0 && id < COMMAND_MAX_MESHES);
+
+    RenderCommand command = RenderCommand();
+    command.key = makeKey(pass, shader, textures[0], id);
+    command.type = type;
+    command.framebuffer = framebuffer;
+    command.shader = shader;
+    std::copy(textures, textures + COMMAND_TEXTURE_UNITS, command.textures);
+    command.mesh = id;
+
+    // Snapshot the uniforms, rebased onto this buffer's value array, unless
+    // nothing changed since the last one
+    if (pendingChanged) {
+        snapshotBegin = uniforms.size();
+        const u32 base = values.size();
+        values.insert(values.end(), pendingValues.begin(), pendingValues.end());
+        for (const CommandUniform& uniform: pendingUniforms) {
+            uniforms.push_back(uniform);
+            uniforms.back().valueOffset += base;
+        }
+        snapshotEnd = uniforms.size();
+        pendingChanged = false;
+    }
+    command.uniformBegin = snapshotBegin;
+    command.uniformEnd = snapshotEnd;
+
+    commands.push_back(command);
+    return commands.back();
+}
+
+void CommandBuffer::drawMesh(MeshID id)
+{
+    addDraw(CommandType::Draw, id);
+}
+
+void CommandBuffer::drawMeshInstanced(MeshID id, int numInstances, const float* instanceData, int floatsPerInstance)
+{
+    assert(numInstances >= 0);
+    assert(floatsPerInstance >= 1 && floatsPerInstance <= 16);
+    if (numInstances == 0)
+        return;
+
+    RenderCommand& command = addDraw(CommandType::DrawInstanced, id);
+    command.numInstances = numInstances;
+    command.floatsPerInstance = floatsPerInstance;
+    command.instanceOffset = values.size();
+    values.insert(values.end(), instanceData, instanceData + numInstances*floatsPerInstance);
+}
+
+void CommandBuffer::append(const CommandBuffer& other)
+{
+    const u32 uniformBase = uniforms.size();
+    const u32 valueBase = values.size();
+
+    commands.reserve(commands.size() + other.commands.size());
+    for (RenderCommand command: other.commands) {
+        command.uniformBegin += uniformBase;
+        command.uniformEnd += uniformBase;
+        command.instanceOffset += valueBase;
+        commands.push_back(command);
+    }
+    nameRemap.resize(other.uniformNames.size());
+    for (std::size_t i = 0; i < other.uniformNames.size(); i++)
+        nameRemap[i] = uniformNameId(other.uniformNames[i]);
+    uniforms.reserve(uniforms.size() + other.uniforms.size());
+    for (const CommandUniform& uniform: other.uniforms) {
+        uniforms.push_back(uniform);
+        uniforms.back().nameId = nameRemap[uniform.nameId];
+        uniforms.back().valueOffset += valueBase;
+    }
+    values.insert(values.end(), other.values.begin(), other.values.end());
+}
+
+void CommandBuffer::reset()
+{
+    // clear() keeps the capacity, so a buffer reused every frame stops allocating
+    commands.clear();
+    uniforms.clear();
+    values.clear();
+
+    pass = 0;
+    framebuffer = 0;
+    shader = -1;
+    std::fill(textures, textures + COMMAND_TEXTURE_UNITS, -1);
+    pendingUniforms.clear();
+    pendingValues.clear();
+    pendingChanged = true;
+    snapshotBegin = 0;
+    snapshotEnd = 0;
+}
+
+void CommandBuffer::remapTextures(const std::vector<TextureID>& remap)
+{
+    const u64 textureBits = static_cast<u64>(COMMAND_MAX_TEXTURES) << 24;
+    for (RenderCommand& command: commands) {
+        for (int unit = 0; unit < COMMAND_TEXTURE_UNITS; unit++) {
+            if (command.textures[unit] >= 0)
+                command.textures[unit] = remap[command.textures[unit]];
+        }
+        if (command.type != CommandType::Clear)
+            command.key = (command.key & ~textureBits) | (static_cast<u64>(command.textures[0] + 1) << 24);
+    }
+}
+
+void CommandBuffer::sort(std::vector<u32>& order) const
+{
+    // LSD radix sort, one byte per pass. Bytes that are the same in every
+    // key (unused passes, high mesh bits...) are skipped, which usually
+    // leaves only three or four passes.
+    const u32 n = commands.size();
+    std::vector<u64> keys(n), keysTmp(n);
+    std::vector<u32> orderTmp(n);
+    order.resize(n);
+    for (u32 i = 0; i < n; i++) {
+        keys[i] = commands[i].key;
+        order[i] = i;
+    }
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        u32 histogram[256] = {0};
+        for (u32 i = 0; i < n; i++)
+            histogram[(keys[i] >> shift) & 0xff]++;
+        if (n == 0 || histogram[(keys[0] >> shift) & 0xff] == n)
+            continue;
+
+        u32 sum = 0;
+        for (int b = 0; b < 256; b++) {
+            const u32 count = histogram[b];
+            histogram[b] = sum;
+            sum += count;
+        }
+        for (u32 i = 0; i < n; i++) {
+            const u32 dst = histogram[(keys[i] >> shift) & 0xff]++;
+            keysTmp[dst] = keys[i];
+            orderTmp[dst] = order[i];
+        }
+        keys.swap(keysTmp);
+        order.swap(orderTmp);
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef __COMMANDS_HPP__
+#define __COMMANDS_HPP__
+
+#include "common.hpp"
+#include "renderer.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Deferred draw recording. A CommandBuffer only stores what to draw, it never
+// touches GL, so any thread can fill its own buffer while the GL thread is
+// busy. Buffers are handed to Renderer::submit, and Renderer::flush sorts
+// everything submitted that frame by sort key and executes it.
+//
+// Sort key layout, most significant bits first:
+//   pass (8) | shader+1 (12) | texture on unit 0, +1 (20) | mesh (24)
+// Passes run in ascending order. Within a pass, clears come first (their key
+// has no shader), then draws grouped by shader, texture and mesh. The sort is
+// stable, draws with equal keys keep their submission order.
+const int COMMAND_MAX_PASSES = 1 << 8;
+const int COMMAND_MAX_SHADERS = (1 << 12) - 1;
+const int COMMAND_MAX_TEXTURES = (1 << 20) - 1;
+const int COMMAND_MAX_MESHES = 1 << 24;
+const int COMMAND_TEXTURE_UNITS = 8;
+
+enum class CommandType {
+    Clear,
+    Draw,
+    DrawInstanced
+};
+
+enum class UniformType {
+    Int1,
+    Float1,
+    Float2,
+    Float3,
+    Float4,
+    Matrix4
+};
+
+struct CommandUniform {
+    u32 nameId;      // into CommandBuffer::uniformNames
+    UniformType type;
+    int count;
+    int intValue;    // Int1
+    u32 valueOffset; // everything else, into CommandBuffer::values
+};
+
+struct RenderCommand {
+    u64 key;
+    CommandType type;
+    unsigned int framebuffer;
+    ShaderID shader;
+    TextureID textures[COMMAND_TEXTURE_UNITS]; // -1 leaves the unit alone
+    MeshID mesh;
+    int numInstances;
+    int floatsPerInstance;
+    u32 instanceOffset;  // into CommandBuffer::values
+    u32 uniformBegin;    // [uniformBegin, uniformEnd) of CommandBuffer::uniforms
+    u32 uniformEnd;
+    float clearColor[4];
+};
+
+class CommandBuffer {
+public:
+    CommandBuffer() { reset(); }
+
+    // Everything recorded afterwards goes to this pass and framebuffer
+    // (0 = the default framebuffer). Pass and framebuffer start out as 0.
+    void setTarget(int pass, unsigned int framebuffer);
+    // Clears color and depth of the current target before its pass draws
+    void clear(float r, float g, float b, float a);
+
+    // Same meaning as the Renderer calls of the same name. Uniforms stick
+    // until the next setShader; each draw sees a snapshot of all of them, so
+    // reordering the draws can't change what they see. Draws with no
+    // uniform set in between share one snapshot.
+    void setShader(ShaderID shader);
+    void setTexture(int unit, TextureID id);
+    void setUniform1i(const std::string& name, int value);
+    void setUniform1f(const std::string& name, float value);
+    void setUniform2fv(const std::string& name, int count, const float* value);
+    void setUniform3fv(const std::string& name, int count, const float* value);
+    void setUniform4fv(const std::string& name, int count, const float* value);
+    void setUniform4x4fv(const std::string& name, int count, const float* value);
+
+    void drawMesh(MeshID id);
+    // instanceData is copied, see Renderer::drawMeshInstanced for the layout
+    void drawMeshInstanced(MeshID id, int numInstances, const float* instanceData, int floatsPerInstance);
+
+    // Appends the commands of other, as if they had been recorded here
+    void append(const CommandBuffer& other);
+    // Drops all commands and returns to the initial state
+    void reset();
+
+    bool empty() const { return commands.empty(); }
+    int size() const { return commands.size(); }
+
+    // Fills order with command indices sorted by key (stable LSD radix sort)
+    void sort(std::vector<u32>& order) const;
+    // Replaces every texture id t of the recorded draws with remap[t] and
+    // sorts them by the new one, so textures sharing a GL texture (atlas
+    // images) group and bind as one
+    void remapTextures(const std::vector<TextureID>& remap);
+
+private:
+    friend class Renderer;
+
+    void setUniform(const std::string& name, UniformType type, int count, int intValue, const float* value, int numFloats);
+    RenderCommand& addDraw(CommandType type, MeshID id);
+    u32 uniformNameId(const std::string& name);
+
+    std::vector<RenderCommand> commands;
+    std::vector<CommandUniform> uniforms; // the snapshots, one after another
+    std::vector<float> values;
+    // Every uniform name this buffer has seen; kept by reset, so a buffer
+    // reused every frame only ever allocates for names it hasn't seen yet
+    std::vector<std::string> uniformNames;
+    std::unordered_map<std::string, u32> uniformNameIds;
+    std::vector<u32> nameRemap; // append's, other's ids to ours
+
+    // Recording state
+    int pass;
+    unsigned int framebuffer;
+    ShaderID shader;
+    TextureID textures[COMMAND_TEXTURE_UNITS];
+    std::vector<CommandUniform> pendingUniforms;
+    std::vector<float> pendingValues;
+    bool pendingChanged; // since the last snapshot, which is snapshotBegin..End
+    u32 snapshotBegin;
+    u32 snapshotEnd;
+};
+
+#endif
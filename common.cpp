@@ -2,25 +2,143 @@
 
 #include <iostream>
 #include <fstream>
+#include <utility>
 #include <cassert>
+#include <cstring>
+
+#ifndef EMSCRIPTEN
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 ByteBuffer getFileContents(const std::string& filename)
 {
     /// Returns the contents of the entire file.
-    std::ifstream in(filename, std::ios::in | std::ios::binary);
-    if (in)
-    {
-        ByteBuffer contents;
-        in.seekg(0, std::ios::end);
-        contents.resize(in.tellg());
-        in.seekg(0, std::ios::beg);
-        in.read(&contents[0], contents.size());
-        in.close();
-        return contents;
+    // Copied straight out of the mapping, without the zero fill and the
+    // stream's own buffering
+    const MappedFile file(filename);
+    if (file.isOpen())
+        return file.view().str();
+    // MappedFile has already said what went wrong
+    assert(false);
+    return ByteBuffer();
+}
+
+u64 hashBytes(ByteView data, u64 seed)
+{
+    const u64 m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    const u8* p = data.data();
+    const std::size_t n = data.size();
+    u64 h = seed ^ (n * m);
+    for (std::size_t i = 0; i + 8 <= n; i += 8) {
+        u64 k;
+        std::memcpy(&k, p + i, 8); // unaligned, little-endian everywhere we run
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    const std::size_t tail = n & ~static_cast<std::size_t>(7);
+    if (tail != n) {
+        for (std::size_t i = tail; i < n; i++)
+            h ^= static_cast<u64>(p[i]) << (8*(i - tail));
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+MappedFile::MappedFile(const std::string& filename)
+{
+#ifndef EMSCRIPTEN
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Failed to open " << filename << "!" << std::endl;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::cout << "Failed to stat " << filename << "!" << std::endl;
+        ::close(fd);
+        return;
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    if (length == 0) {
+        // mmap refuses empty ranges, an empty file is still a valid (empty) view
+        ::close(fd);
+        bytes = reinterpret_cast<const u8*>(fallback.data());
+        return;
+    }
+    void* ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        std::cout << "Failed to map " << filename << "!" << std::endl;
+        length = 0;
+        return;
     }
-    else {
+    // Consumers (GL uploads, decoders) walk the file front to back
+    madvise(ptr, length, MADV_SEQUENTIAL);
+    bytes = static_cast<const u8*>(ptr);
+    mapped = true;
+#else
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    if (!in) {
         std::cout << "Failed to read " << filename << "!" << std::endl;
-        assert(false);
-        return ByteBuffer();
+        return;
     }
+    in.seekg(0, std::ios::end);
+    fallback.resize(in.tellg());
+    in.seekg(0, std::ios::beg);
+    in.read(&fallback[0], fallback.size());
+    bytes = reinterpret_cast<const u8*>(fallback.data());
+    length = fallback.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other)
+{
+    if (this == &other)
+        return *this;
+    close();
+    mapped = other.mapped;
+    length = other.length;
+    fallback = std::move(other.fallback);
+    // A moved std::string may relocate its (small) storage
+    if (other.bytes == nullptr)
+        bytes = nullptr;
+    else
+        bytes = mapped ? other.bytes : reinterpret_cast<const u8*>(fallback.data());
+    other.bytes = nullptr;
+    other.length = 0;
+    other.mapped = false;
+    return *this;
+}
+
+void MappedFile::close()
+{
+#ifndef EMSCRIPTEN
+    if (mapped)
+        munmap(const_cast<u8*>(bytes), length);
+#endif
+    bytes = nullptr;
+    length = 0;
+    mapped = false;
+    fallback.clear();
 }
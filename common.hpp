@@ -3,13 +3,16 @@
 
 #include <string>
 #include <cstdint>
+#include <cstddef>
 
 typedef std::uint8_t  u8;
 typedef std::uint16_t u16;
 typedef std::uint32_t u32;
+typedef std::uint64_t u64;
 static_assert(sizeof(u8)  == 1, "sizeof u8");
 static_assert(sizeof(u16) == 2, "sizeof u16");
 static_assert(sizeof(u32) == 4, "sizeof u32");
+static_assert(sizeof(u64) == 8, "sizeof u64");
 
 const float PI = 3.14159265f;
 
@@ -21,6 +24,60 @@ const float PI = 3.14159265f;
 // std::string is convenient to parse with stringstream
 typedef std::string ByteBuffer;
 
+// Returns a copy of the whole file. Where read-only access is enough, a
+// MappedFile and its view() avoid the copy.
 ByteBuffer getFileContents(const std::string& filename);
 
+// Read-only bytes owned by someone else (a ByteBuffer, a MappedFile...),
+// only valid as long as they are. Functions that just read their input take
+// one, so callers can pass a ByteBuffer or a mapped file alike.
+class ByteView {
+public:
+    ByteView() {}
+    ByteView(const void* data, std::size_t size) : bytes(static_cast<const u8*>(data)), length(size) {}
+    ByteView(const ByteBuffer& buffer) : ByteView(buffer.data(), buffer.size()) {}
+
+    const u8* data() const { return bytes; }
+    const char* chars() const { return reinterpret_cast<const char*>(bytes); }
+    std::size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    ByteBuffer str() const { return ByteBuffer(chars(), length); }
+
+private:
+    const u8* bytes = nullptr;
+    std::size_t length = 0;
+};
+
+// 64-bit MurmurHash2 (MurmurHash64A) of the bytes, for telling identical
+// contents apart quickly. Not cryptographic.
+u64 hashBytes(ByteView data, u64 seed = 0);
+
+// Read-only view of an entire file. Natively the file is mmap'ed, so the
+// pages come straight from the OS file cache and no heap copy is made.
+// Elsewhere (Emscripten) the contents are read into a ByteBuffer instead.
+class MappedFile {
+public:
+    MappedFile() {}
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return bytes != nullptr; }
+    const u8* data() const { return bytes; }
+    std::size_t size() const { return length; }
+    ByteView view() const { return ByteView(bytes, length); }
+
+private:
+    void close();
+
+    const u8* bytes = nullptr;
+    std::size_t length = 0;
+    bool mapped = false;
+    ByteBuffer fallback;
+};
+
 #endif
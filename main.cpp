@@ -209,6 +209,9 @@ bool App::setup()
 
 void App::drawFrame()
 {
+    // Finish async texture loads without stalling the frame
+    renderer->processUploads(4.f);
+
     const vec2 invCanvasSize(1.f / canvasWidth,
                              1.f / canvasHeight);
 
@@ -256,6 +259,8 @@ void App::drawFrame()
     glDrawArrays(GL_TRIANGLES, 0, 3);
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
+
+    renderer->endFrame();
 }
 
 void App::onKey(int key, int action)
@@ -0,0 +1,395 @@
+#include "mipmaps.hpp"
+#include "workers.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIPMAPS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Bands of fewer rows aren't worth handing to another thread
+static const int MIN_BAND_ROWS = 16;
+
+// Kaiser filter support (in destination pixels either side) and shape
+static const double KAISER_RADIUS = 2.0;
+static const double KAISER_ALPHA = 4.0;
+
+int mipLevelCount(int width, int height)
+{
+    int levels = 1;
+    while (width > 1 || height > 1) {
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        levels++;
+    }
+    return levels;
+}
+
+std::size_t mipLevelOffset(int width, int height, int channels, int level)
+{
+    std::size_t offset = 0;
+    for (int i = 0; i < level; i++) {
+        offset += static_cast<std::size_t>(width)*height*channels;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return offset;
+}
+
+std::size_t mipChainSize(int width, int height, int channels)
+{
+    return mipLevelOffset(width, height, channels, mipLevelCount(width, height));
+}
+
+struct Level {
+    u8* pixels;
+    int width, height;
+};
+
+// sRGB <-> linear light. The integer side is 16-bit fixed point, fine
+// enough for every 8-bit value to come back unchanged.
+struct SrgbTables {
+    u16 toLinear[256];
+    float toLinearFloat[256];
+    float identityFloat[256]; // plain value/255, for alpha and non-sRGB data
+    u8 fromLinear[65536];
+
+    SrgbTables()
+    {
+        for (int i = 0; i < 256; i++) {
+            const double linear = decode(i / 255.0);
+            toLinearFloat[i] = static_cast<float>(linear);
+            toLinear[i] = static_cast<u16>(linear*65535.0 + 0.5);
+            identityFloat[i] = i / 255.0f;
+        }
+        // Round in sRGB: step up where the next value's midpoint decodes to
+        int value = 0;
+        double threshold = decode(0.5 / 255.0)*65535.0;
+        for (int linear = 0; linear < 65536; linear++) {
+            while (value < 255 && linear >= threshold) {
+                value++;
+                threshold = value < 255 ? decode((value + 0.5) / 255.0)*65535.0 : 65536.0;
+            }
+            fromLinear[linear] = static_cast<u8>(value);
+        }
+    }
+
+    static double decode(double v)
+    {
+        return v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+    }
+};
+
+static const SrgbTables& srgbTables()
+{
+    static const SrgbTables tables;
+    return tables;
+}
+
+static bool isAlpha(int channel, int channels)
+{
+    return (channels == 2 && channel == 1) || (channels == 4 && channel == 3);
+}
+
+// How many source rows (or columns) a destination one averages: 2, 3 for
+// the last one when the source is odd, 1 when the source is 1 already
+static int boxExtent(int src, int dst, int i)
+{
+    if (src == 1)
+        return 1;
+    return (i == dst - 1 && src % 2 != 0) ? 3 : 2;
+}
+
+// count destination pixels, each averaging two pixels of row a and two of row b
+static void boxRow2x2(u8* dst, const u8* a, const u8* b, int count, int channels)
+{
+    const int bytes = count*channels;
+    int i = 0;
+#ifdef MIPMAPS_SSE2
+    // 32 source bytes of each row make 16 destination bytes. Rows are summed
+    // in 16 bits, then neighbours by the pixel size: pairs of 16-bit lanes
+    // for 1 channel, 32-bit ones for 2, 64-bit ones for 4. RGB stays scalar.
+    if (channels == 1 || channels == 2 || channels == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i two = _mm_set1_epi16(2);
+        for (; i + 16 <= bytes; i += 16) {
+            __m128i halves[2];
+            for (int h = 0; h < 2; h++) {
+                const __m128i ra = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + 2*i + 16*h));
+                const __m128i rb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + 2*i + 16*h));
+                const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(ra, zero), _mm_unpacklo_epi8(rb, zero));
+                const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(ra, zero), _mm_unpackhi_epi8(rb, zero));
+                __m128i sum;
+                if (channels == 1)
+                    sum = _mm_packs_epi32(_mm_madd_epi16(lo, one), _mm_madd_epi16(hi, one));
+                else if (channels == 2) {
+                    const __m128i l = _mm_add_epi32(_mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 3, 1)));
+                    const __m128i r = _mm_add_epi32(_mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 3, 1)));
+                    sum = _mm_unpacklo_epi64(l, r);
+                }
+                else
+                    sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+                halves[h] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(halves[0], halves[1]));
+        }
+    }
+#endif
+    for (int p = i / channels; p < count; p++) {
+        for (int c = 0; c < channels; c++) {
+            const int s = 2*p*channels + c;
+            dst[p*channels + c] = static_cast<u8>((a[s] + a[s + channels] + b[s] + b[s + channels] + 2) >> 2);
+        }
+    }
+}
+
+// boxRow2x2 averaging colors in linear light
+static void boxRow2x2Srgb(u8* dst, const u8* a, const u8* b, int count, int channels, const SrgbTables& tables)
+{
+    for (int p = 0; p < count; p++) {
+        for (int c = 0; c < channels; c++) {
+            const int s = 2*p*channels + c;
+            if (isAlpha(c, channels))
+                dst[p*channels + c] = static_cast<u8>((a[s] + a[s + channels] + b[s] + b[s + channels] + 2) >> 2);
+            else {
+                const u32 sum = tables.toLinear[a[s]] + tables.toLinear[a[s + channels]] + tables.toLinear[b[s]] + tables.toLinear[b[s + channels]];
+                dst[p*channels + c] = tables.fromLinear[(sum + 2) >> 2];
+            }
+        }
+    }
+}
+
+// Any destination pixel, any extent, optionally averaging in linear light
+static void boxPixel(const Level& src, const Level& dst, int channels, bool srgb, int x, int y)
+{
+    const SrgbTables& tables = srgbTables();
+    const int cols = boxExtent(src.width, dst.width, x);
+    const int rows = boxExtent(src.height, dst.height, y);
+    const int n = cols*rows;
+    for (int c = 0; c < channels; c++) {
+        const bool linear = srgb && !isAlpha(c, channels);
+        u32 sum = 0;
+        for (int j = 0; j < rows; j++) {
+            const u8* p = src.pixels + (static_cast<std::size_t>(2*y + j)*src.width + 2*x)*channels + c;
+            for (int i = 0; i < cols; i++)
+                sum += linear ? tables.toLinear[p[i*channels]] : p[i*channels];
+        }
+        const u32 average = (sum + n/2) / n;
+        dst.pixels[(static_cast<std::size_t>(y)*dst.width + x)*channels + c] = linear ? tables.fromLinear[average] : static_cast<u8>(average);
+    }
+}
+
+static void boxBand(const Level& src, const Level& dst, int channels, bool srgb, int y0, int y1)
+{
+    // Whole 2x2 blocks go through boxRow2x2, the odd edges pixel by pixel
+    const int pairs = src.width % 2 == 0 ? dst.width : dst.width - 1;
+    for (int y = y0; y < y1; y++) {
+        int x = 0;
+        if (boxExtent(src.height, dst.height, y) == 2) {
+            const u8* a = src.pixels + static_cast<std::size_t>(2*y)*src.width*channels;
+            u8* out = dst.pixels + static_cast<std::size_t>(y)*dst.width*channels;
+            if (srgb)
+                boxRow2x2Srgb(out, a, a + src.width*channels, pairs, channels, srgbTables());
+            else
+                boxRow2x2(out, a, a + src.width*channels, pairs, channels);
+            x = pairs;
+        }
+        for (; x < dst.width; x++)
+            boxPixel(src, dst, channels, srgb, x, y);
+    }
+}
+
+// Filter taps along one axis, the same number for every destination sample
+// so they index as index[i*count + k]. Source indices are clamped at the
+// edges, repeating the edge pixel.
+struct AxisTaps {
+    int count;
+    std::vector<int> index;
+    std::vector<float> weight;
+};
+
+static double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2*k)) * (x / (2*k));
+        sum += term;
+        if (term < sum*1e-12)
+            break;
+    }
+    return sum;
+}
+
+// t in destination pixels
+static double kaiser(double t)
+{
+    if (std::fabs(t) >= KAISER_RADIUS)
+        return 0.0;
+    const double pi = 3.14159265358979323846;
+    const double sinc = t == 0.0 ? 1.0 : std::sin(pi*t) / (pi*t);
+    const double r = t / KAISER_RADIUS;
+    return sinc * besselI0(KAISER_ALPHA*std::sqrt(1.0 - r*r)) / besselI0(KAISER_ALPHA);
+}
+
+static void buildTaps(int src, int dst, AxisTaps& taps)
+{
+    // Source pixel j is at j + 0.5; take those strictly inside the support
+    const double scale = static_cast<double>(src) / dst;
+    const double reach = KAISER_RADIUS*scale;
+    taps.count = 0;
+    for (int i = 0; i < dst; i++) {
+        const double center = (i + 0.5)*scale;
+        const int first = static_cast<int>(std::floor(center - reach - 0.5)) + 1;
+        const int last = static_cast<int>(std::ceil(center + reach - 0.5)) - 1;
+        taps.count = std::max(taps.count, last - first + 1);
+    }
+    taps.index.resize(static_cast<std::size_t>(dst)*taps.count);
+    taps.weight.resize(taps.index.size());
+    for (int i = 0; i < dst; i++) {
+        const double center = (i + 0.5)*scale;
+        const int first = static_cast<int>(std::floor(center - reach - 0.5)) + 1;
+        double total = 0.0;
+        for (int k = 0; k < taps.count; k++) {
+            const int j = first + k;
+            const double w = kaiser((j + 0.5 - center) / scale);
+            taps.index[i*taps.count + k] = std::min(std::max(j, 0), src - 1);
+            taps.weight[i*taps.count + k] = static_cast<float>(w);
+            total += w;
+        }
+        for (int k = 0; k < taps.count; k++)
+            taps.weight[i*taps.count + k] = static_cast<float>(taps.weight[i*taps.count + k] / total);
+    }
+}
+
+// One source row filtered horizontally, from floats, C channels
+template <int C>
+static void kaiserRow(float* out, const float* in, int width, const AxisTaps& tx)
+{
+    const int* index = tx.index.data();
+    const float* weight = tx.weight.data();
+#ifdef MIPMAPS_SSE2
+    if (C == 4) {
+        for (int x = 0; x < width; x++, index += tx.count, weight += tx.count) {
+            __m128 sum = _mm_setzero_ps();
+            for (int t = 0; t < tx.count; t++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weight[t]), _mm_loadu_ps(in + index[t]*4)));
+            _mm_storeu_ps(out + x*4, sum);
+        }
+        return;
+    }
+#endif
+    for (int x = 0; x < width; x++, index += tx.count, weight += tx.count) {
+        float sum[C] = {};
+        for (int t = 0; t < tx.count; t++) {
+            const float* p = in + index[t]*C;
+            for (int c = 0; c < C; c++)
+                sum[c] += weight[t]*p[c];
+        }
+        for (int c = 0; c < C; c++)
+            out[x*C + c] = sum[c];
+    }
+}
+
+static void kaiserBand(const Level& src, const Level& dst, int channels, bool srgb, const AxisTaps& tx, const AxisTaps& ty, int y0, int y1)
+{
+    const SrgbTables& tables = srgbTables();
+    const float* toFloat[4];
+    for (int c = 0; c < channels; c++)
+        toFloat[c] = srgb && !isAlpha(c, channels) ? tables.toLinearFloat : tables.identityFloat;
+
+    // Source rows filtered horizontally, each is needed by several
+    // destination rows. The rows one destination row reads are consecutive,
+    // so a ring of ty.count of them never evicts one still in use.
+    const int rowFloats = dst.width*channels;
+    std::vector<float> ring(static_cast<std::size_t>(ty.count)*rowFloats);
+    std::vector<int> ringRow(ty.count, -1);
+    std::vector<float> input(static_cast<std::size_t>(src.width)*channels);
+    std::vector<float> sum(rowFloats);
+
+    for (int y = y0; y < y1; y++) {
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        for (int k = 0; k < ty.count; k++) {
+            const float wy = ty.weight[y*ty.count + k];
+            if (wy == 0.0f)
+                continue;
+            const int row = ty.index[y*ty.count + k];
+            float* filtered = &ring[static_cast<std::size_t>(row % ty.count)*rowFloats];
+            if (ringRow[row % ty.count] != row) {
+                const u8* p = src.pixels + static_cast<std::size_t>(row)*src.width*channels;
+                for (int i = 0; i < src.width*channels; i++)
+                    input[i] = toFloat[i % channels][p[i]];
+                switch (channels) {
+                    case 1: kaiserRow<1>(filtered, input.data(), dst.width, tx); break;
+                    case 2: kaiserRow<2>(filtered, input.data(), dst.width, tx); break;
+                    case 3: kaiserRow<3>(filtered, input.data(), dst.width, tx); break;
+                    case 4: kaiserRow<4>(filtered, input.data(), dst.width, tx); break;
+                }
+                ringRow[row % ty.count] = row;
+            }
+            int i = 0;
+#ifdef MIPMAPS_SSE2
+            const __m128 w = _mm_set1_ps(wy);
+            for (; i + 4 <= rowFloats; i += 4)
+                _mm_storeu_ps(&sum[i], _mm_add_ps(_mm_loadu_ps(&sum[i]), _mm_mul_ps(w, _mm_loadu_ps(filtered + i))));
+#endif
+            for (; i < rowFloats; i++)
+                sum[i] += wy*filtered[i];
+        }
+
+        u8* out = dst.pixels + static_cast<std::size_t>(y)*rowFloats;
+        for (int c = 0; c < channels; c++) {
+            if (srgb && !isAlpha(c, channels)) {
+                for (int i = c; i < rowFloats; i += channels) {
+                    const int linear = static_cast<int>(sum[i]*65535.0f + 0.5f);
+                    out[i] = tables.fromLinear[std::min(std::max(linear, 0), 65535)];
+                }
+            }
+            else {
+                for (int i = c; i < rowFloats; i += channels) {
+                    const int value = static_cast<int>(sum[i]*255.0f + 0.5f);
+                    out[i] = static_cast<u8>(std::min(std::max(value, 0), 255));
+                }
+            }
+        }
+    }
+}
+
+void buildMipChain(u8* chain, int width, int height, int channels, const MipOptions& options, WorkerPool* workers)
+{
+    assert(channels >= 1 && channels <= 4);
+    if (options.filter == MipFilter::None)
+        return;
+
+    const int levels = mipLevelCount(width, height);
+    const int maxBands = workers != nullptr ? (workers->numThreads() + 1)*4 : 1;
+    Level src = {chain, width, height};
+    AxisTaps tx, ty;
+    for (int level = 1; level < levels; level++) {
+        const Level dst = {src.pixels + static_cast<std::size_t>(src.width)*src.height*channels,
+                           std::max(1, src.width / 2), std::max(1, src.height / 2)};
+        if (options.filter == MipFilter::Kaiser) {
+            buildTaps(src.width, dst.width, tx);
+            buildTaps(src.height, dst.height, ty);
+        }
+
+        const int bands = std::max(1, std::min(maxBands, dst.height / MIN_BAND_ROWS));
+        auto band = [&](int b) {
+            const int y0 = dst.height*b / bands;
+            const int y1 = dst.height*(b + 1) / bands;
+            if (options.filter == MipFilter::Kaiser)
+                kaiserBand(src, dst, channels, options.srgb, tx, ty, y0, y1);
+            else
+                boxBand(src, dst, channels, options.srgb, y0, y1);
+        };
+        if (bands > 1)
+            workers->parallelFor(bands, band);
+        else
+            band(0);
+        src = dst;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __MIPMAPS_HPP__
+#define __MIPMAPS_HPP__
+
+#include "common.hpp"
+
+class WorkerPool;
+
+enum class MipFilter {
+    None,   // level 0 only
+    Box,    // average of each 2x2 block (3 wide on odd edges), SIMD
+    Kaiser  // Kaiser-windowed sinc, 8 taps: sharper, with barely any ringing
+};
+
+struct MipOptions {
+    MipFilter filter = MipFilter::None;
+    // Average colors in linear light, as a GPU does when it samples an sRGB
+    // texture; without it dark detail swallows bright detail as the image
+    // shrinks. Alpha (2nd channel of 2, 4th of 4) is always linear. Leave it
+    // off for data that isn't color, like normal maps.
+    bool srgb = false;
+};
+
+// A mip chain of 8-bit pixels is stored level after level, level 0 first,
+// each tightly packed, sized max(1, width >> level) x max(1, height >> level)
+// down to 1x1 as GL expects.
+int mipLevelCount(int width, int height);
+std::size_t mipLevelOffset(int width, int height, int channels, int level);
+std::size_t mipChainSize(int width, int height, int channels);
+
+// Builds levels 1.. of chain from level 0, which is at its start, in place.
+// chain must hold mipChainSize bytes. Every level is split into bands of
+// rows that run on workers (may be nullptr), one level after another.
+void buildMipChain(u8* chain, int width, int height, int channels, const MipOptions& options, WorkerPool* workers);
+
+#endif
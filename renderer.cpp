@@ -1,4 +1,7 @@
 #include "renderer.hpp"
+#include "workers.hpp"
+#include "commands.hpp"
+#include "mipmaps.hpp"
 
 #include <GL/glew.h>
 #include <GL/glfw.h>
@@ -8,16 +11,29 @@
 #define STBI_HEADER_FILE_ONLY
 #include "stb_image.cpp"
 
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+using namespace glm;
+
 #include <iostream>
 #include <sstream>
 #include <unordered_map>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
 
 struct Mesh {
     GLuint vbid;
     GLuint ibid;
     GLsizei numIndices;
+    std::size_t bytes = 0; // both buffers, 0 while evicted
+    u64 lastUsed = 0;      // Renderer::frame of the last draw
+    std::string filename;  // loaded again from here after an eviction, empty for batches
+    bool evicted = false;
 };
 
 struct Shader {
@@ -25,9 +41,72 @@ struct Shader {
     std::unordered_map<std::string, GLint> uniforms;
 };
 
+// GL formats for a texture, and how many channels stb_image has to produce
+struct TextureFormat {
+    int numChannels;
+    PixelType type;
+    GLenum glInternal;
+    GLenum glInput;
+    GLenum glType;
+};
+
 struct Texture {
     GLuint id;
     int width, height;
+    bool ready; // false while an async load shows the placeholder
+    bool loading = false; // a decode job for it is in flight
+    int refs = 1; // see Renderer::removeTexture
+    // Atlas images, and async loads that turned out to be a copy of a
+    // texture already uploaded, show owner's GL texture and hold a reference
+    // on it; id is then the same as owner's. rect is the part an atlas image
+    // covers, see Renderer::getTextureRect.
+    TextureID owner = -1;
+    float rect[4] = {0.0f, 0.0f, 1.0f, 1.0f};
+    // Its entries in Renderer::textureCache and contentCache
+    std::vector<std::string> cacheKeys;
+    u64 contentKey = 0;
+    bool contentCached = false;
+    // See Renderer::setMemoryBudget. Only textures with a filename can be
+    // evicted, they're loaded again from it with the same arguments
+    // (compressed ones from their basename).
+    std::size_t bytes = 0; // all levels, 0 while evicted or shared
+    u64 lastUsed = 0;
+    bool evicted = false;
+    std::string filename;
+    bool compressed = false;
+    TextureFormat format;
+    u64 formatKey = 0;
+    MipOptions mips;
+};
+
+#ifdef EMSCRIPTEN
+// WebGL 1 only knows the OES_texture_half_float value
+const GLenum HALF_FLOAT_TYPE = 0x8D61; // GL_HALF_FLOAT_OES
+#else
+const GLenum HALF_FLOAT_TYPE = GL_HALF_FLOAT;
+#endif
+
+// A decode job, waiting for processUploads once it's done. They're recycled
+// through Renderer::freeDecodedTextures, and pixels only ever grows, so after
+// a while decoding reuses buffers instead of allocating them.
+struct DecodedTexture {
+    TextureID id;
+    TextureFormat format;
+    u64 contentKey;
+    int width, height;
+    int levels;
+    bool ok; // false if decoding failed
+    std::vector<u8> pixels;
+};
+
+// A GIF playing on a texture, see addAnimatedTexture. The file stays mapped
+// for as long, the frame iterator reads straight out of it.
+struct AnimatedTexture {
+    TextureID id;
+    MappedFile file;
+    stbi_gif_frames* frames = nullptr;
+    int width, height;
+    float remaining; // seconds left on the frame showing
 };
 
 void checkGLError(const char* file, int line)
@@ -49,10 +128,196 @@ void checkGLError(const char* file, int line)
     assert(false);
 }
 
-Renderer::Renderer() {}
+// Lets stb_image spread a single large decode over the worker pool
+static void stbiParallelFor(void* user, int count, void (*body)(void*, int), void* context)
+{
+    static_cast<WorkerPool*>(user)->parallelFor(count, [body, context](int i) { body(context, i); });
+}
+
+// stb_image's scratch memory: one block per thread, allocations are bumped
+// off it and it rewinds once everything taken from it has been freed, which
+// is when a decode finishes. Anything that doesn't fit comes from malloc, and
+// the block grows to cover it the next time it's empty, so decoding images
+// of similar sizes soon stops touching the heap. Frees may come from another
+// thread than the one that allocated, hence the atomic count.
+struct DecodeArena {
+    u8* block = nullptr;
+    std::size_t capacity = 0;
+    std::size_t used = 0;
+    std::size_t wanted = 0; // everything asked for since the last rewind
+    std::atomic<int> live{0};
+    bool bypass = false;    // see ArenaBypass
+
+    ~DecodeArena() { std::free(block); }
+};
+
+// In front of every allocation, so that free and realloc find their arena
+struct alignas(16) ArenaHeader {
+    DecodeArena* arena; // nullptr if it came from malloc
+    std::size_t size;
+};
+
+static thread_local DecodeArena decodeArena;
+
+static std::size_t arenaFootprint(std::size_t size)
+{
+    return sizeof(ArenaHeader) + ((size + 15) & ~static_cast<std::size_t>(15));
+}
+
+static void* arenaAlloc(void*, std::size_t size)
+{
+    DecodeArena& arena = decodeArena;
+    if (arena.live.load(std::memory_order_acquire) == 0) {
+        if (arena.wanted > arena.capacity) {
+            std::free(arena.block);
+            arena.block = static_cast<u8*>(std::malloc(arena.wanted));
+            arena.capacity = arena.block != nullptr ? arena.wanted : 0;
+        }
+        arena.used = 0;
+        arena.wanted = 0;
+    }
+
+    const std::size_t footprint = arenaFootprint(size);
+    arena.wanted += footprint;
+    ArenaHeader* header;
+    if (!arena.bypass && footprint <= arena.capacity - arena.used) {
+        header = reinterpret_cast<ArenaHeader*>(arena.block + arena.used);
+        header->arena = &arena;
+        arena.used += footprint;
+        arena.live.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        header = static_cast<ArenaHeader*>(std::malloc(footprint));
+        if (header == nullptr)
+            return nullptr;
+        header->arena = nullptr;
+    }
+    header->size = size;
+    return header + 1;
+}
+
+// Keeps allocations that outlive a load (an animation's frame iterator) out
+// of the block while it's in scope, they would stop it from ever rewinding
+struct ArenaBypass {
+    ArenaBypass() { decodeArena.bypass = true; }
+    ~ArenaBypass() { decodeArena.bypass = false; }
+};
+
+static void arenaFree(void*, void* p)
+{
+    if (p == nullptr)
+        return;
+    ArenaHeader* header = static_cast<ArenaHeader*>(p) - 1;
+    if (header->arena != nullptr)
+        header->arena->live.fetch_sub(1, std::memory_order_release);
+    else
+        std::free(header);
+}
+
+static void* arenaRealloc(void* user, void* p, std::size_t size)
+{
+    if (p == nullptr)
+        return arenaAlloc(user, size);
+
+    // The last allocation of this thread's block grows in place, which is
+    // what inflating into a doubling buffer keeps asking for
+    ArenaHeader* header = static_cast<ArenaHeader*>(p) - 1;
+    DecodeArena& arena = decodeArena;
+    const std::size_t footprint = arenaFootprint(header->size);
+    if (header->arena == &arena && reinterpret_cast<u8*>(header) + footprint == arena.block + arena.used) {
+        const std::size_t grown = arenaFootprint(size);
+        if (grown <= footprint || grown - footprint <= arena.capacity - arena.used) {
+            if (grown > footprint) {
+                arena.used += grown - footprint;
+                arena.wanted += grown - footprint;
+            }
+            header->size = size;
+            return p;
+        }
+    }
+
+    void* q = arenaAlloc(user, size);
+    if (q == nullptr)
+        return nullptr;
+    std::memcpy(q, p, std::min(size, header->size));
+    arenaFree(user, p);
+    return q;
+}
+
+// Whole names only: WEBGL_compressed_texture_etc is the start of WEBGL_compressed_texture_etc1
+static bool hasExtension(const char* name)
+{
+    const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+    if (extensions == nullptr)
+        return false;
+    const std::size_t length = std::strlen(name);
+    for (const char* p = extensions; (p = std::strstr(p, name)) != nullptr; p += length) {
+        if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+Renderer::Renderer()
+{
+    workers = new WorkerPool;
+    stbi_install_parallel_for(stbiParallelFor, workers);
+    stbi_allocator allocator = {arenaAlloc, arenaRealloc, arenaFree, nullptr};
+    stbi_install_allocator(&allocator);
+    queue = new CommandBuffer;
+    executing = new CommandBuffer;
+
+#ifndef EMSCRIPTEN
+    instancingSupported = GLEW_ARB_instanced_arrays;
+    s3tcSupported = GLEW_EXT_texture_compression_s3tc;
+    etc1Supported = hasExtension("GL_OES_compressed_ETC1_RGB8_texture");
+    etc2Supported = GLEW_ARB_ES3_compatibility;
+#else
+    const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+    instancingSupported = extensions != nullptr && std::strstr(extensions, "ANGLE_instanced_arrays") != nullptr;
+    s3tcSupported = hasExtension("WEBGL_compressed_texture_s3tc") || hasExtension("WEBKIT_WEBGL_compressed_texture_s3tc");
+    etc1Supported = hasExtension("WEBGL_compressed_texture_etc1");
+    etc2Supported = hasExtension("WEBGL_compressed_texture_etc");
+#endif
+    std::cout << "Hardware instancing: " << (instancingSupported ? "yes" : "no") << std::endl;
+    std::cout << "Texture compression:" << (s3tcSupported ? " DXT" : "") << (etc1Supported ? " ETC1" : "")
+              << (etc2Supported ? " ETC2" : "") << std::endl;
+
+    // Mid-grey stand-in for textures that are still loading
+    const u8 grey[4] = {128, 128, 128, 255};
+    glGenTextures(1, &placeholderTexture);
+    glBindTexture(GL_TEXTURE_2D, placeholderTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
 
 Renderer::~Renderer()
 {
+    // Waits for the decode jobs still in flight. Loads that already started
+    // keep using the pool until then, new ones go back to a single thread.
+    stbi_install_parallel_for(nullptr, nullptr);
+    delete workers;
+    // What stb_image still holds came from arenaAlloc and has to go back
+    // through arenaFree, before the allocator is uninstalled
+    for (DecodedTexture* decoded: decodedTextures)
+        delete decoded;
+    for (DecodedTexture* decoded: freeDecodedTextures)
+        delete decoded;
+    for (AnimatedTexture* animation: animations) {
+        stbi_gif_frames_close(animation->frames);
+        delete animation;
+    }
+    stbi_install_allocator(nullptr);
+    delete queue;
+    delete executing;
+
+    glDeleteTextures(1, &placeholderTexture);
+
+    if (instanceVB != 0)
+        glDeleteBuffers(1, &instanceVB);
+
     for (Shader* shader: shaders) {
         delete shader;
     }
@@ -66,15 +331,18 @@ Renderer::~Renderer()
     }
 }
 
-ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::string& fsSource)
+ShaderID Renderer::addShaderFromSource(ByteView vsSource, ByteView fsSource)
 {
     assert(vsSource.size() > 0 && fsSource.size() > 0);
     GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
     GLuint ids[2];
     for (int i = 0; i < 2; i++) {
         ids[i] = glCreateShader(types[i]);
-        const char* ptr = (i == 0) ? &vsSource[0] : &fsSource[0];
-        glShaderSource(ids[i], 1, &ptr, nullptr);
+        // Sources aren't null-terminated (mapped files), so pass the length
+        const ByteView& source = (i == 0) ? vsSource : fsSource;
+        const char* ptr = source.chars();
+        const GLint length = source.size();
+        glShaderSource(ids[i], 1, &ptr, &length);
         glCompileShader(ids[i]);
         GLint status = 0;
         glGetShaderiv(ids[i], GL_COMPILE_STATUS, &status);
@@ -92,10 +360,8 @@ ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::s
     std::vector<std::string> uniforms;
     for (int i = 0; i < 2; i++) {
         std::stringstream ss;
-        if (i == 0)
-            ss << vsSource;
-        else
-            ss << fsSource;
+        const ByteView& source = (i == 0) ? vsSource : fsSource;
+        ss.write(source.chars(), source.size());
         ss.seekp(0);
         std::string token;
         ss >> token;
@@ -136,21 +402,47 @@ ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::s
         }
     }
 
-    shaders.push_back(shader);
-    return shaders.size()-1;
+    if (freeShaderIds.empty()) {
+        shaders.push_back(shader);
+        return shaders.size()-1;
+    }
+    const ShaderID id = freeShaderIds.back();
+    freeShaderIds.pop_back();
+    shaders[id] = shader;
+    return id;
+}
+
+void Renderer::removeShader(ShaderID id)
+{
+    assert(id >= 0 && id < shaders.size() && shaders[id] != nullptr);
+    // The shader objects go with the program, nothing else links them
+    GLuint attached[2];
+    GLsizei count = 0;
+    glGetAttachedShaders(shaders[id]->id, 2, &count, attached);
+    for (GLsizei i = 0; i < count; i++)
+        glDeleteShader(attached[i]);
+    glDeleteProgram(shaders[id]->id);
+    if (currentShader == id) {
+        glUseProgram(0);
+        currentShader = -1;
+    }
+    delete shaders[id];
+    shaders[id] = nullptr;
+    freeShaderIds.push_back(id);
 }
 
 ShaderID Renderer::addShader(const std::string& vsFilename, const std::string& fsFilename)
 {
     std::cout << "Uploading shader " << vsFilename << " + " << fsFilename << std::endl;
-    ByteBuffer vsSource = getFileContents(vsFilename);
-    ByteBuffer fsSource = getFileContents(fsFilename);
-    return addShaderFromSource(vsSource, fsSource);
+    const MappedFile vsSource(vsFilename);
+    const MappedFile fsSource(fsFilename);
+    assert(vsSource.isOpen() && fsSource.isOpen());
+    return addShaderFromSource(vsSource.view(), fsSource.view());
 }
 
 void Renderer::setShader(ShaderID shader)
 {
-    assert(shader >= 0 && shader < shaders.size());
+    assert(shader >= 0 && shader < shaders.size() && shaders[shader] != nullptr);
     glUseProgram(shaders[shader]->id);
     currentShader = shader;
 }
@@ -200,46 +492,326 @@ void Renderer::setUniform2fv(const std::string& name, int count, const float* va
 void Renderer::setTexture(int unit, TextureID id)
 {
     assert(unit >= 0);
-    assert(id >= 0 && id < textures.size());
-    Texture* texture = textures[id];
+    assert(id >= 0 && id < textures.size() && textures[id] != nullptr);
+    // Up front, as a compressed texture coming back binds while it uploads
     glActiveTexture(GL_TEXTURE0+unit);
+    textures[id]->lastUsed = frame;
+    if (textures[id]->owner >= 0)
+        id = textures[id]->owner;
+    Texture* texture = textures[id];
+    texture->lastUsed = frame;
+    if (texture->evicted && !texture->loading) {
+        // Streamed back in the way it was first loaded
+        if (!texture->compressed)
+            queueDecode(id);
+        else {
+            if (loadCompressedTexture(texture, texture->filename))
+                trackMemory(texture->bytes, 0);
+            texture->evicted = false;
+            texture->ready = true;
+        }
+    }
     glBindTexture(GL_TEXTURE_2D, texture->id);
 }
 
-MeshID Renderer::addMesh(const std::string& filename)
+// Vertex and index data of a mesh file. Version 1 data points straight into
+// the mapped file, version 2 data into the staging buffer it was inflated to.
+struct MeshData {
+    MappedFile file;
+    std::vector<u8> staging;
+    const Vertex* vertices = nullptr;
+    const Index* indices = nullptr;
+    u32 numVertices = 0;
+    u32 numIndices = 0;
+};
+
+static bool readMeshV2(const std::string& filename, WorkerPool& workers, MeshData& data)
 {
-    std::cout << "Uploading mesh " << filename << std::endl;
-    ByteBuffer buffer = getFileContents(filename);
+    const MappedFile& file = data.file;
+    MeshFileHeader header;
+    if (file.size() < sizeof(header)) {
+        std::cout << "Corrupt mesh " << filename << ": truncated header!" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    std::cout << "numVertices: " << header.numVertices << std::endl;
+    std::cout << "numIndices: " << header.numIndices << std::endl;
+    std::cout << "numChunks: " << header.numChunks << std::endl;
+    if (header.version != MESH_FILE_VERSION) {
+        std::cout << "Unsupported mesh version " << header.version << " in " << filename << "!" << std::endl;
+        return false;
+    }
+
+    const std::uint64_t tableEnd = sizeof(header) + static_cast<std::uint64_t>(header.numChunks)*sizeof(MeshChunk);
+    if (tableEnd > file.size()) {
+        std::cout << "Corrupt mesh " << filename << ": truncated chunk table!" << std::endl;
+        return false;
+    }
+    std::vector<MeshChunk> chunks(header.numChunks);
+    if (header.numChunks > 0)
+        std::memcpy(&chunks[0], file.data() + sizeof(header), chunks.size()*sizeof(MeshChunk));
+
+    // Both streams are inflated straight into one staging buffer,
+    // vertices first, which is then handed to glBufferData.
+    const std::uint64_t streamSize[2] = {
+        static_cast<std::uint64_t>(header.numVertices)*sizeof(Vertex),
+        static_cast<std::uint64_t>(header.numIndices)*sizeof(Index)
+    };
+    if (streamSize[0] + streamSize[1] > 0x7fffffff) {
+        std::cout << "Corrupt mesh " << filename << ": too large!" << std::endl;
+        return false;
+    }
+
+    // Chunks must tile each stream in order, without gaps or overlaps
+    std::uint64_t covered[2] = {0, 0};
+    for (const MeshChunk& chunk: chunks) {
+        const bool ok = chunk.stream <= MESH_STREAM_INDICES &&
+                        chunk.codec <= MESH_CODEC_ZLIB &&
+                        chunk.rawOffset == covered[chunk.stream] &&
+                        chunk.rawOffset + static_cast<std::uint64_t>(chunk.rawSize) <= streamSize[chunk.stream] &&
+                        chunk.fileOffset >= tableEnd &&
+                        chunk.fileOffset + static_cast<std::uint64_t>(chunk.fileSize) <= file.size() &&
+                        (chunk.codec != MESH_CODEC_STORED || chunk.fileSize == chunk.rawSize);
+        if (!ok) {
+            std::cout << "Corrupt mesh " << filename << ": bad chunk table!" << std::endl;
+            return false;
+        }
+        covered[chunk.stream] += chunk.rawSize;
+    }
+    if (covered[0] != streamSize[0] || covered[1] != streamSize[1]) {
+        std::cout << "Corrupt mesh " << filename << ": chunks don't cover the mesh!" << std::endl;
+        return false;
+    }
+
+    std::vector<u8>& staging = data.staging;
+    staging.resize(streamSize[0] + streamSize[1]);
+    std::vector<char> chunkOk(chunks.size(), 0);
+    workers.parallelFor(chunks.size(), [&](int i) {
+        const MeshChunk& chunk = chunks[i];
+        const std::size_t base = (chunk.stream == MESH_STREAM_VERTICES) ? 0 : streamSize[0];
+        char* dst = reinterpret_cast<char*>(&staging[0] + base + chunk.rawOffset);
+        const char* src = reinterpret_cast<const char*>(file.data() + chunk.fileOffset);
+        if (chunk.codec == MESH_CODEC_STORED) {
+            std::memcpy(dst, src, chunk.rawSize);
+            chunkOk[i] = 1;
+        }
+        else {
+            const int n = stbi_zlib_decode_buffer(dst, chunk.rawSize, src, chunk.fileSize);
+            chunkOk[i] = (n == static_cast<int>(chunk.rawSize));
+        }
+    });
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+        if (!chunkOk[i]) {
+            std::cout << "Corrupt mesh " << filename << ": chunk " << i << " failed to inflate!" << std::endl;
+            return false;
+        }
+    }
+
+    if (!staging.empty()) {
+        data.vertices = reinterpret_cast<const Vertex*>(&staging[0]);
+        data.indices  = reinterpret_cast<const Index*>(&staging[0] + streamSize[0]);
+    }
+    data.numVertices = header.numVertices;
+    data.numIndices = header.numIndices;
+    return true;
+}
+
+static bool readMesh(const std::string& filename, WorkerPool& workers, MeshData& data)
+{
+    // See renderer.hpp for both mesh file layouts.
+    // Returns false (after logging why) if the file is missing or malformed.
+    data.file = MappedFile(filename);
+    const MappedFile& file = data.file;
+    if (!file.isOpen() || file.size() < 2*sizeof(int)) {
+        std::cout << "Failed to load mesh " << filename << "!" << std::endl;
+        return false;
+    }
+
+    u32 magic;
+    std::memcpy(&magic, file.data(), sizeof(magic));
+    if (magic == MESH_FILE_MAGIC)
+        return readMeshV2(filename, workers, data);
+
     int numVertices, numIndices;
-    numVertices = *reinterpret_cast<int*>(&buffer[0]);
-    numIndices  = *reinterpret_cast<int*>(&buffer[sizeof(int)]);
+    std::memcpy(&numVertices, file.data(),               sizeof(int));
+    std::memcpy(&numIndices,  file.data() + sizeof(int), sizeof(int));
     std::cout << "numVertices: " << numVertices << std::endl;
     std::cout << "numIndices: " << numIndices << std::endl;
 
-    Mesh* mesh = new Mesh;
+    const std::size_t vpos = 2*sizeof(int);
+    const std::size_t ipos = vpos + static_cast<std::size_t>(numVertices)*sizeof(Vertex);
+    const std::uint64_t expected = static_cast<std::uint64_t>(vpos) +
+                                   static_cast<std::uint64_t>(numVertices)*sizeof(Vertex) +
+                                   static_cast<std::uint64_t>(numIndices)*sizeof(Index);
+    if (numVertices < 0 || numIndices < 0 || expected > file.size()) {
+        std::cout << "Corrupt mesh " << filename << ": header claims " << expected
+                  << " bytes, file has " << file.size() << "!" << std::endl;
+        return false;
+    }
+
+    data.vertices = reinterpret_cast<const Vertex*>(file.data() + vpos);
+    data.indices  = reinterpret_cast<const Index*>(file.data() + ipos);
+    data.numVertices = numVertices;
+    data.numIndices = numIndices;
+    return true;
+}
+
+static void uploadMesh(Mesh* mesh, const Vertex* vertices, u32 numVertices, const Index* indices, u32 numIndices)
+{
     mesh->numIndices = numIndices;
-    int vpos = 2*sizeof(int);
-    int ipos = 2*sizeof(int)+numVertices*sizeof(Vertex);
+    mesh->bytes = static_cast<std::size_t>(numVertices)*sizeof(Vertex) + static_cast<std::size_t>(numIndices)*sizeof(Index);
 
     glGenBuffers(1, &mesh->vbid);
     glBindBuffer(GL_ARRAY_BUFFER, mesh->vbid);
-    glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(Vertex), &buffer[vpos], GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(Vertex), vertices, GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
     glGenBuffers(1, &mesh->ibid);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(Index), &buffer[ipos], GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(Index), indices, GL_STATIC_DRAW);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
 
-    meshes.push_back(mesh);
-    return meshes.size()-1;
+// Puts mesh in the first free slot, ids of removed meshes are reused
+static MeshID storeMesh(std::vector<Mesh*>& meshes, std::vector<MeshID>& freeIds, Mesh* mesh)
+{
+    if (freeIds.empty()) {
+        meshes.push_back(mesh);
+        return meshes.size()-1;
+    }
+    const MeshID id = freeIds.back();
+    freeIds.pop_back();
+    meshes[id] = mesh;
+    return id;
 }
 
-void Renderer::drawMesh(MeshID id)
+MeshID Renderer::addMesh(const std::string& filename)
+{
+    std::cout << "Uploading mesh " << filename << std::endl;
+    MeshData data;
+    if (!readMesh(filename, *workers, data)) {
+        assert(false);
+        return -1;
+    }
+
+    Mesh* mesh = new Mesh;
+    uploadMesh(mesh, data.vertices, data.numVertices, data.indices, data.numIndices);
+    mesh->filename = filename;
+    mesh->lastUsed = frame;
+    trackMemory(0, mesh->bytes);
+    return storeMesh(meshes, freeMeshIds, mesh);
+}
+
+MeshID Renderer::addMeshBatch(const std::vector<MeshInstance>& instances)
+{
+    // Every instance is transformed on the CPU and appended to one shared
+    // vertex/index buffer pair, so the whole batch is a single draw call.
+    std::cout << "Uploading mesh batch of " << instances.size() << " instances" << std::endl;
+    std::unordered_map<std::string, MeshData> sources;
+    std::uint64_t totalVertices = 0, totalIndices = 0;
+    for (const MeshInstance& instance: instances) {
+        MeshData& data = sources[instance.filename];
+        if (!data.file.isOpen() && !readMesh(instance.filename, *workers, data)) {
+            assert(false);
+            return -1;
+        }
+        totalVertices += data.numVertices;
+        totalIndices += data.numIndices;
+    }
+    if (totalVertices > 0xffffffffu || (totalVertices + totalIndices) * sizeof(Vertex) > 0x7fffffff) {
+        std::cout << "Mesh batch is too large!" << std::endl;
+        assert(false);
+        return -1;
+    }
+
+    std::vector<Vertex> vertices(totalVertices);
+    std::vector<Index> indices(totalIndices);
+    u32 baseVertex = 0, baseIndex = 0;
+    for (const MeshInstance& instance: instances) {
+        const MeshData& data = sources[instance.filename];
+        const mat4 model = make_mat4(instance.transform);
+        // Normals need the inverse transpose to survive non-uniform scaling
+        const mat3 normalMatrix = transpose(inverse(mat3(model)));
+        const mat3 tangentMatrix(model);
+        for (u32 i = 0; i < data.numVertices; i++) {
+            const Vertex& in = data.vertices[i];
+            Vertex& out = vertices[baseVertex + i];
+            const vec4 p = model * vec4(in.px, in.py, in.pz, 1.f);
+            const vec3 n = normalize(normalMatrix * vec3(in.nx, in.ny, in.nz));
+            const vec3 t = normalize(tangentMatrix * vec3(in.tx, in.ty, in.tz));
+            const vec3 b = normalize(tangentMatrix * vec3(in.bx, in.by, in.bz));
+            out.px = p.x; out.py = p.y; out.pz = p.z;
+            out.nx = n.x; out.ny = n.y; out.nz = n.z;
+            out.tx = t.x; out.ty = t.y; out.tz = t.z;
+            out.bx = b.x; out.by = b.y; out.bz = b.z;
+            out.u = in.u; out.v = in.v;
+        }
+        for (u32 i = 0; i < data.numIndices; i++) {
+            indices[baseIndex + i] = data.indices[i] + baseVertex;
+        }
+        baseVertex += data.numVertices;
+        baseIndex += data.numIndices;
+    }
+
+    Mesh* mesh = new Mesh;
+    uploadMesh(mesh, vertices.empty() ? nullptr : &vertices[0], totalVertices,
+               indices.empty() ? nullptr : &indices[0], totalIndices);
+    mesh->lastUsed = frame;
+    trackMemory(0, mesh->bytes);
+    return storeMesh(meshes, freeMeshIds, mesh);
+}
+
+void Renderer::removeMesh(MeshID id)
 {
-    assert(id >= 0 && id < meshes.size());
+    assert(id >= 0 && id < meshes.size() && meshes[id] != nullptr);
+    Mesh* mesh = meshes[id];
+    if (!mesh->evicted) {
+        glDeleteBuffers(1, &mesh->vbid);
+        glDeleteBuffers(1, &mesh->ibid);
+        trackMemory(0, -static_cast<std::ptrdiff_t>(mesh->bytes));
+    }
+    delete mesh;
+    meshes[id] = nullptr;
+    freeMeshIds.push_back(id);
+}
 
+// Marks the mesh as used this frame, after loading it again if it was evicted
+Mesh* Renderer::useMesh(MeshID id)
+{
+    assert(id >= 0 && id < meshes.size() && meshes[id] != nullptr);
     Mesh* mesh = meshes[id];
+    mesh->lastUsed = frame;
+    if (mesh->evicted) {
+        std::cout << "Reloading mesh " << mesh->filename << std::endl;
+        MeshData data;
+        if (readMesh(mesh->filename, *workers, data))
+            uploadMesh(mesh, data.vertices, data.numVertices, data.indices, data.numIndices);
+        else {
+            // Gone from disk: draw nothing rather than retry every frame
+            assert(false);
+            uploadMesh(mesh, nullptr, 0, nullptr, 0);
+        }
+        mesh->evicted = false;
+        trackMemory(0, mesh->bytes);
+    }
+    return mesh;
+}
+
+void Renderer::evictMesh(Mesh* mesh)
+{
+    std::cout << "Evicting mesh " << mesh->filename << std::endl;
+    glDeleteBuffers(1, &mesh->vbid);
+    glDeleteBuffers(1, &mesh->ibid);
+    mesh->vbid = 0;
+    mesh->ibid = 0;
+    trackMemory(0, -static_cast<std::ptrdiff_t>(mesh->bytes));
+    mesh->bytes = 0;
+    mesh->evicted = true;
+    memory.evictedMeshes++;
+}
+
+static void bindMeshAttributes(Mesh* mesh)
+{
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
     glBindBuffer(GL_ARRAY_BUFFER,         mesh->vbid);
     glEnableVertexAttribArray(0);
@@ -252,8 +824,10 @@ void Renderer::drawMesh(MeshID id)
     glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(6*sizeof(float)));
     glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(9*sizeof(float)));
     glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(12*sizeof(float)));
-    //glDrawElements(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_SHORT, 0);
-    glDrawElements(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_INT, 0);
+}
+
+static void unbindMeshAttributes()
+{
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
     glDisableVertexAttribArray(2);
@@ -261,7 +835,381 @@ void Renderer::drawMesh(MeshID id)
     glDisableVertexAttribArray(4);
 }
 
-TextureID Renderer::addTexture(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type)
+void Renderer::drawMesh(MeshID id)
+{
+    Mesh* mesh = useMesh(id);
+    bindMeshAttributes(mesh);
+    //glDrawElements(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_SHORT, 0);
+    glDrawElements(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_INT, 0);
+    unbindMeshAttributes();
+}
+
+void Renderer::drawMeshInstanced(MeshID id, int numInstances, const float* instanceData, int floatsPerInstance)
+{
+    // Instance attributes follow the five Vertex attributes, packed four
+    // floats per attribute: locations 5, 6, 7 and 8 for a full mat4.
+    assert(floatsPerInstance >= 1 && floatsPerInstance <= 4*MAX_INSTANCE_ATTRIBUTES);
+    assert(numInstances >= 0);
+    if (numInstances == 0)
+        return;
+
+    Mesh* mesh = useMesh(id);
+    bindMeshAttributes(mesh);
+    drawInstances(mesh->numIndices, numInstances, instanceData, floatsPerInstance);
+    unbindMeshAttributes();
+}
+
+void Renderer::drawInstances(int numIndices, int numInstances, const float* instanceData, int floatsPerInstance)
+{
+    // Expects the mesh attributes to be bound already
+    const int numAttributes = (floatsPerInstance + 3) / 4;
+    if (instancingSupported) {
+        if (instanceVB == 0)
+            glGenBuffers(1, &instanceVB);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVB);
+        // Orphan the previous contents, the GPU may still be reading them
+        const std::size_t bytes = numInstances * floatsPerInstance * sizeof(float);
+        glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        trackMemory(0, static_cast<std::ptrdiff_t>(bytes) - static_cast<std::ptrdiff_t>(instanceVBBytes));
+        instanceVBBytes = bytes;
+        glBufferSubData(GL_ARRAY_BUFFER, 0, numInstances * floatsPerInstance * sizeof(float), instanceData);
+        for (int i = 0; i < numAttributes; i++) {
+            const GLuint location = FIRST_INSTANCE_ATTRIBUTE + i;
+            const int size = std::min(4, floatsPerInstance - 4*i);
+            glEnableVertexAttribArray(location);
+            glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, floatsPerInstance * sizeof(float),
+                                  reinterpret_cast<GLvoid*>(4*i*sizeof(float)));
+            glVertexAttribDivisorARB(location, 1);
+        }
+        glDrawElementsInstancedARB(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0, numInstances);
+        for (int i = 0; i < numAttributes; i++) {
+            const GLuint location = FIRST_INSTANCE_ATTRIBUTE + i;
+            glVertexAttribDivisorARB(location, 0);
+            glDisableVertexAttribArray(location);
+        }
+    }
+    else {
+        // No instancing: feed each instance through constant vertex attributes.
+        // One draw per instance, static content should go through addMeshBatch instead.
+        for (int instance = 0; instance < numInstances; instance++) {
+            const float* values = instanceData + instance * floatsPerInstance;
+            for (int i = 0; i < numAttributes; i++) {
+                const GLuint location = FIRST_INSTANCE_ATTRIBUTE + i;
+                float attribute[4] = {0.f, 0.f, 0.f, 1.f};
+                const int size = std::min(4, floatsPerInstance - 4*i);
+                std::copy(values + 4*i, values + 4*i + size, attribute);
+                glVertexAttrib4fv(location, attribute);
+            }
+            glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0);
+        }
+    }
+}
+
+void Renderer::submit(CommandBuffer& buffer)
+{
+#ifndef EMSCRIPTEN
+    std::lock_guard<std::mutex> lock(queueMutex);
+#endif
+    queue->append(buffer);
+    buffer.reset();
+}
+
+static void applyUniform(Shader* shader, const std::string& name, const CommandUniform& uniform, const float* values)
+{
+    assert(shader->uniforms.find(name) != shader->uniforms.end());
+    const GLint location = shader->uniforms[name];
+    const float* value = values + uniform.valueOffset;
+    switch (uniform.type) {
+        case UniformType::Int1:    glUniform1i(location, uniform.intValue); break;
+        case UniformType::Float1:  glUniform1f(location, value[0]); break;
+        case UniformType::Float2:  glUniform2fv(location, uniform.count, value); break;
+        case UniformType::Float3:  glUniform3fv(location, uniform.count, value); break;
+        case UniformType::Float4:  glUniform4fv(location, uniform.count, value); break;
+        case UniformType::Matrix4: glUniformMatrix4fv(location, uniform.count, GL_FALSE, value); break;
+    }
+}
+
+void Renderer::flush()
+{
+    // Swap the queue out first, other threads can keep submitting meanwhile
+    {
+#ifndef EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(queueMutex);
+#endif
+        std::swap(queue, executing);
+    }
+    if (executing->empty())
+        return;
+
+    // Textures showing another one's GL texture (atlas images, duplicates)
+    // sort and bind as that one
+    textureBinds.resize(textures.size());
+    for (std::size_t i = 0; i < textures.size(); i++)
+        textureBinds[i] = textures[i] != nullptr && textures[i]->owner >= 0 ? textures[i]->owner : i;
+    executing->remapTextures(textureBinds);
+    executing->sort(order);
+
+    // -1 means unknown, so the first command sets everything
+    GLint boundFramebuffer = -1;
+    ShaderID boundShader = -1;
+    TextureID boundTextures[COMMAND_TEXTURE_UNITS];
+    std::fill(boundTextures, boundTextures + COMMAND_TEXTURE_UNITS, -1);
+    MeshID boundMesh = -1;
+    // Draws recorded with no uniform change in between share a snapshot
+    u32 appliedBegin = 0, appliedEnd = 0;
+
+    const float* values = executing->values.empty() ? nullptr : &executing->values[0];
+    for (u32 index: order) {
+        const RenderCommand& command = executing->commands[index];
+
+        if (boundFramebuffer != static_cast<GLint>(command.framebuffer)) {
+            glBindFramebuffer(GL_FRAMEBUFFER, command.framebuffer);
+            boundFramebuffer = command.framebuffer;
+        }
+
+        if (command.type == CommandType::Clear) {
+            glClearColor(command.clearColor[0], command.clearColor[1], command.clearColor[2], command.clearColor[3]);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            continue;
+        }
+
+        if (boundShader != command.shader) {
+            setShader(command.shader);
+            boundShader = command.shader;
+        }
+        for (int unit = 0; unit < COMMAND_TEXTURE_UNITS; unit++) {
+            const TextureID id = command.textures[unit];
+            if (id >= 0 && boundTextures[unit] != id) {
+                setTexture(unit, id);
+                boundTextures[unit] = id;
+            }
+        }
+        Mesh* mesh = useMesh(command.mesh);
+        if (boundMesh != command.mesh) {
+            bindMeshAttributes(mesh);
+            boundMesh = command.mesh;
+        }
+
+        if (command.uniformBegin != appliedBegin || command.uniformEnd != appliedEnd) {
+            Shader* shader = shaders[command.shader];
+            for (u32 i = command.uniformBegin; i < command.uniformEnd; i++)
+                applyUniform(shader, executing->uniformNames[executing->uniforms[i].nameId], executing->uniforms[i], values);
+            appliedBegin = command.uniformBegin;
+            appliedEnd = command.uniformEnd;
+        }
+
+        if (command.type == CommandType::Draw)
+            glDrawElements(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_INT, 0);
+        else
+            drawInstances(mesh->numIndices, command.numInstances, values + command.instanceOffset, command.floatsPerInstance);
+    }
+
+    if (boundMesh >= 0)
+        unbindMeshAttributes();
+    if (boundFramebuffer != 0)
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    executing->reset();
+}
+
+static TextureFormat getTextureFormat(PixelFormat internal, PixelFormat input, PixelType type)
+{
+    assert(internal == input);
+
+    TextureFormat format;
+    format.numChannels = 1;
+    if (internal == PixelFormat::R) {
+        format.numChannels = 1;
+        format.glInternal = GL_LUMINANCE;
+    }
+    else if (internal == PixelFormat::Rgb) {
+        format.numChannels = 3;
+        format.glInternal = GL_RGB;
+    }
+    else if (internal == PixelFormat::Rgba) {
+        format.numChannels = 4;
+        format.glInternal = GL_RGBA;
+    }
+    else
+        assert(false);
+
+    format.glInput = format.glInternal;
+    format.type = type;
+
+    if (type == PixelType::Float)
+        format.glType = GL_FLOAT;
+    else if (type == PixelType::Half)
+        format.glType = HALF_FLOAT_TYPE;
+    else if (type == PixelType::Ubyte)
+        format.glType = GL_UNSIGNED_BYTE;
+    else
+        assert(false);
+
+#ifndef EMSCRIPTEN
+    // An unsized internal format would store the floats as 8 bits on desktop
+    // GL. WebGL 1 has no sized formats and keeps the type it's given.
+    static const GLenum float32[] = {GL_LUMINANCE32F_ARB, GL_RGB32F, GL_RGBA32F};
+    static const GLenum float16[] = {GL_LUMINANCE16F_ARB, GL_RGB16F, GL_RGBA16F};
+    if (type == PixelType::Float)
+        format.glInternal = float32[format.numChannels == 1 ? 0 : format.numChannels - 2];
+    else if (type == PixelType::Half)
+        format.glInternal = float16[format.numChannels == 1 ? 0 : format.numChannels - 2];
+#endif
+
+    return format;
+}
+
+static std::size_t bytesPerChannel(PixelType type)
+{
+    return type == PixelType::Float ? 4 : type == PixelType::Half ? 2 : 1;
+}
+
+// How many mip levels to build and upload. WebGL 1 can only mipmap
+// power-of-two textures, the others keep level 0 alone.
+static int textureLevels(const MipOptions& mips, const TextureFormat& format, int width, int height)
+{
+    if (mips.filter == MipFilter::None)
+        return 1;
+    assert(format.type == PixelType::Ubyte); // the mip builder works on 8-bit pixels
+#ifdef EMSCRIPTEN
+    if ((width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+        return 1;
+#endif
+    return mipLevelCount(width, height);
+}
+
+// Decodes into pixels, followed by the rest of the mip chain if there is
+// one. pixels is only grown when the image doesn't fit, so passing the same
+// buffer again and again soon stops allocating.
+static bool decodeTexture(const std::string& filename, const MappedFile& file, const TextureFormat& format, const MipOptions& mips,
+                          WorkerPool* workers, int& width, int& height, int& levels, std::vector<u8>& pixels)
+{
+    // Delegate all the hard work to the fantastic stb_image.
+    // It's reentrant, so worker threads decode concurrently. Decoding from
+    // memory lets it split JPEGs with restart intervals across the pool too.
+    if (!file.isOpen()) {
+        std::cout << "Failed to load texture " << filename << ": can't open file!" << std::endl;
+        return false;
+    }
+    int n;
+    bool ok = stbi_info_from_memory(file.data(), file.size(), &width, &height, &n) != 0;
+    if (ok) {
+        levels = textureLevels(mips, format, width, height);
+        const std::size_t size = static_cast<std::size_t>(width)*height*format.numChannels*bytesPerChannel(format.type);
+        const std::size_t chainSize = levels > 1 ? mipChainSize(width, height, format.numChannels) : size;
+        if (pixels.size() < chainSize)
+            pixels.resize(chainSize);
+        if (format.type == PixelType::Ubyte)
+            ok = stbi_load_into_from_memory(file.data(), file.size(), pixels.data(), pixels.size(), &width, &height, &n, format.numChannels) != 0;
+        else {
+            // The float loaders have no _into variant; their result lives in
+            // the decode arena, so the copy doesn't allocate either
+            void* data = format.type == PixelType::Float ?
+                static_cast<void*>(stbi_loadf_from_memory(file.data(), file.size(), &width, &height, &n, format.numChannels)) :
+                static_cast<void*>(stbi_loadh_from_memory(file.data(), file.size(), &width, &height, &n, format.numChannels));
+            ok = data != nullptr && static_cast<std::size_t>(width)*height*format.numChannels*bytesPerChannel(format.type) == size;
+            if (ok)
+                std::memcpy(pixels.data(), data, size);
+            stbi_image_free(data);
+        }
+    }
+    if (!ok) {
+        std::cout << "Failed to load texture " << filename << ": " << stbi_failure_reason() << "!" << std::endl;
+        return false;
+    }
+    // Radiance files are always RGB, the float loaders pad them as asked
+    assert(format.type != PixelType::Ubyte || n == format.numChannels);
+    if (levels > 1)
+        buildMipChain(pixels.data(), width, height, format.numChannels, mips, workers);
+    return true;
+}
+
+// Uploads levels mip levels, stored back to back from data as mipmaps.hpp describes
+static GLuint uploadTexture(const TextureFormat& format, int width, int height, int levels, const void* data)
+{
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    // stb_image rows are tightly packed, which isn't 4-byte aligned for RGB
+    // bytes or halves with odd widths
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const u8* level = static_cast<const u8*>(data);
+    for (int i = 0; i < levels; i++) {
+        glTexImage2D(GL_TEXTURE_2D, i, format.glInternal, width, height, 0, format.glInput, format.glType, level);
+        level += static_cast<std::size_t>(width)*height*format.numChannels*bytesPerChannel(format.type);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return id;
+}
+
+// What uploadTexture's levels take, as the data handed to GL; drivers may
+// pad RGB to RGBA, so it's only a lower bound
+static std::size_t textureBytes(const TextureFormat& format, int width, int height, int levels)
+{
+    const std::size_t size = static_cast<std::size_t>(width)*height*format.numChannels*bytesPerChannel(format.type);
+    return levels > 1 ? mipChainSize(width, height, format.numChannels) * bytesPerChannel(format.type) : size;
+}
+
+// Everything besides the file that decides what addTexture uploads
+static u64 textureFormatKey(PixelFormat internal, PixelFormat input, PixelType type, const MipOptions& mips)
+{
+    return static_cast<u64>(internal) | static_cast<u64>(input) << 8 | static_cast<u64>(type) << 16 |
+           static_cast<u64>(mips.filter) << 24 | static_cast<u64>(mips.srgb) << 32;
+}
+
+static std::string textureCacheKey(const std::string& filename, u64 formatKey)
+{
+    return filename + '|' + std::to_string(formatKey);
+}
+
+// Equal content keys only make a match likely, two different files can
+// hash the same; the bytes decide
+static bool sameContents(ByteView data, const std::string& filename)
+{
+    const MappedFile file(filename);
+    return file.isOpen() && file.size() == data.size() && std::memcmp(file.data(), data.data(), data.size()) == 0;
+}
+
+// The texture already loaded for key, with one more reference, or -1
+TextureID Renderer::findCachedTexture(const std::string& key)
+{
+    const auto cached = textureCache.find(key);
+    if (cached == textureCache.end())
+        return -1;
+    textures[cached->second]->refs++;
+    return cached->second;
+}
+
+// A texture that failed to load stays grey, like a failed async load. It's
+// in neither cache, so loading the file again tries again.
+TextureID Renderer::storePlaceholderTexture()
+{
+    Texture* tex = new Texture;
+    tex->id = placeholderTexture;
+    tex->width = 1;
+    tex->height = 1;
+    tex->ready = true;
+    return storeTexture(tex);
+}
+
+// Puts tex in the first free slot, ids of removed textures are reused
+TextureID Renderer::storeTexture(Texture* tex)
+{
+    if (freeTextureIds.empty()) {
+        textures.push_back(tex);
+        return textures.size()-1;
+    }
+    const TextureID id = freeTextureIds.back();
+    freeTextureIds.pop_back();
+    textures[id] = tex;
+    return id;
+}
+
+TextureID Renderer::addTexture(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type, const MipOptions& mips)
 {
     // Supported HDR image formats:
     // - Greg Ward's Radiance "shared exponent" HDR image format (RGBE)
@@ -276,56 +1224,602 @@ TextureID Renderer::addTexture(const std::string& filename, PixelFormat internal
     // Can ANGLE maybe do what the D3D9 version did and use DXGI_FORMAT_R32G32B32A32_FLOAT and
     // put padding in the alpha channel? It seems a shame to lose GL_RGBA/GL_FLOAT because
     // GL_RGB/GL_FLOAT isn't available.
-    std::cout << "Uploading texture " << filename << std::endl;
+    const u64 formatKey = textureFormatKey(internal, input, type, mips);
+    const std::string cacheKey = textureCacheKey(filename, formatKey);
+    const TextureID cached = findCachedTexture(cacheKey);
+    if (cached >= 0)
+        return cached;
 
-    assert(internal == input);
+    std::cout << "Uploading texture " << filename << std::endl;
 
-    int numChannels = 1;
-    GLenum glInternal;
-    GLenum glInput;
-    if (internal == PixelFormat::R) {
-        numChannels = 1;
-        glInternal = GL_LUMINANCE;
+    // The same bytes under another name can share the texture without being
+    // decoded again
+    MappedFile file(filename);
+    const u64 contentKey = hashBytes(file.view(), formatKey);
+    const auto same = contentCache.find(contentKey);
+    if (file.isOpen() && same != contentCache.end() && sameContents(file.view(), textures[same->second]->filename)) {
+        std::cout << filename << " is a copy of a texture already loaded" << std::endl;
+        textures[same->second]->refs++;
+        textures[same->second]->cacheKeys.push_back(cacheKey);
+        textureCache[cacheKey] = same->second;
+        return same->second;
     }
-    else if (internal == PixelFormat::Rgb) {
-        numChannels = 3;
-        glInternal = GL_RGB;
+
+    const TextureFormat format = getTextureFormat(internal, input, type);
+    int width, height, levels;
+    if (!decodeTexture(filename, file, format, mips, workers, width, height, levels, stagingPixels)) {
+        assert(false);
+        return storePlaceholderTexture();
     }
-    else if (internal == PixelFormat::Rgba) {
-        numChannels = 4;
-        glInternal = GL_RGBA;
+
+    Texture* tex = new Texture;
+    tex->id = uploadTexture(format, width, height, levels, stagingPixels.data());
+    tex->width = width;
+    tex->height = height;
+    tex->ready = true;
+    tex->bytes = textureBytes(format, width, height, levels);
+    tex->lastUsed = frame;
+    tex->filename = filename;
+    tex->format = format;
+    tex->formatKey = formatKey;
+    tex->mips = mips;
+    trackMemory(tex->bytes, 0);
+    const TextureID id = storeTexture(tex);
+    tex->cacheKeys.push_back(cacheKey);
+    textureCache[cacheKey] = id;
+    tex->contentKey = contentKey;
+    if (same == contentCache.end()) {
+        tex->contentCached = true;
+        contentCache[contentKey] = id;
     }
-    else
-        assert(false);
+    return id;
+}
 
-    glInput = glInternal;
+TextureID Renderer::addTextureAsync(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type, const MipOptions& mips)
+{
+    const u64 formatKey = textureFormatKey(internal, input, type, mips);
+    const std::string cacheKey = textureCacheKey(filename, formatKey);
+    const TextureID cached = findCachedTexture(cacheKey);
+    if (cached >= 0)
+        return cached;
 
-    GLenum glType;
-    if (type == PixelType::Float)
-        glType = GL_FLOAT;
-    else if (type == PixelType::Ubyte)
-        glType = GL_UNSIGNED_BYTE;
-    else
-        assert(false);
+    std::cout << "Queueing texture " << filename << std::endl;
 
-    // Delegate all the hard work to the fantastic stb_image
-    int width, height, n;
-    u8* data = stbi_load(filename.c_str(), &width, &height, &n, numChannels);
-    if (data == nullptr) {
-        std::cout << stbi_failure_reason() << std::endl;
-        assert(false);
+    Texture* tex = new Texture;
+    tex->id = placeholderTexture;
+    tex->width = 1;
+    tex->height = 1;
+    tex->ready = false;
+    tex->lastUsed = frame;
+    tex->filename = filename;
+    tex->format = getTextureFormat(internal, input, type);
+    tex->formatKey = formatKey;
+    tex->mips = mips;
+    const TextureID id = storeTexture(tex);
+    tex->cacheKeys.push_back(cacheKey);
+    textureCache[cacheKey] = id;
+    queueDecode(id);
+    return id;
+}
+
+// Decodes texture id from its file on a worker, for processUploads to upload
+void Renderer::queueDecode(TextureID id)
+{
+    Texture* tex = textures[id];
+    tex->loading = true;
+    const std::string filename = tex->filename;
+    const TextureFormat format = tex->format;
+    const u64 formatKey = tex->formatKey;
+    const MipOptions mips = tex->mips;
+    workers->submit([this, id, filename, format, formatKey, mips]() {
+        DecodedTexture* decoded = nullptr;
+        {
+#ifndef EMSCRIPTEN
+            std::lock_guard<std::mutex> lock(decodedMutex);
+#endif
+            if (!freeDecodedTextures.empty()) {
+                decoded = freeDecodedTextures.back();
+                freeDecodedTextures.pop_back();
+            }
+        }
+        if (decoded == nullptr)
+            decoded = new DecodedTexture;
+        decoded->id = id;
+        decoded->format = format;
+        // processUploads only shares textures already on the GPU, so a copy
+        // of a texture still loading decodes anyway
+        const MappedFile file(filename);
+        decoded->contentKey = hashBytes(file.view(), formatKey);
+        decoded->ok = decodeTexture(filename, file, format, mips, workers, decoded->width, decoded->height, decoded->levels, decoded->pixels);
+#ifndef EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(decodedMutex);
+#endif
+        decodedTextures.push_back(decoded);
+    });
+}
+
+// Bytes of one mip level in a block-compressed format, 0 for formats we don't read
+static std::size_t compressedLevelSize(u32 format, int width, int height)
+{
+    const std::size_t blocks = static_cast<std::size_t>((width + 3) / 4) * ((height + 3) / 4);
+    switch (format) {
+    case KTX_FORMAT_DXT1:
+    case KTX_FORMAT_ETC1:
+    case KTX_FORMAT_ETC2_RGB:
+        return blocks*8;
+    case KTX_FORMAT_DXT5:
+    case KTX_FORMAT_ETC2_RGBA:
+        return blocks*16;
+    default:
+        return 0;
     }
-    assert(n == numChannels);
+}
 
-    Texture* tex = new Texture;
-    glGenTextures(1, &tex->id);
-    glBindTexture(GL_TEXTURE_2D, tex->id);
-    glTexImage2D(GL_TEXTURE_2D, 0, glInternal, width, height, 0, glInput, glType, data);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+// Uploads every mip level of a KTX file straight from file, after checking
+// all of it. accepted are the formats the caller can sample; ETC1 data is
+// also valid ETC2, so without etc1Supported it goes up as ETC2 RGB.
+// Returns 0 for anything else.
+static GLuint uploadCompressedTexture(ByteView file, const u32 accepted[2], bool etc1Supported,
+                                      int& width, int& height, std::size_t& bytes)
+{
+    KtxHeader header;
+    if (file.size() < sizeof(header))
+        return 0;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.identifier, KTX_IDENTIFIER, sizeof(header.identifier)) != 0 ||
+        header.endianness != KTX_ENDIANNESS || header.glType != 0 ||
+        (header.glInternalFormat != accepted[0] && header.glInternalFormat != accepted[1]) ||
+        header.pixelWidth == 0 || header.pixelHeight == 0 || header.pixelWidth > 32768 || header.pixelHeight > 32768 ||
+        header.pixelDepth != 0 || header.numberOfArrayElements != 0 || header.numberOfFaces != 1)
+        return 0;
+    width = header.pixelWidth;
+    height = header.pixelHeight;
+    const int fullChain = mipLevelCount(width, height);
+    if (header.numberOfMipmapLevels > static_cast<u32>(fullChain))
+        return 0;
+    // 0 asks the loader to generate mipmaps, which compressed formats can't
+    const int levels = std::max<int>(header.numberOfMipmapLevels, 1);
+
+    const u8* levelData[32];
+    u32 levelSize[32];
+    std::uint64_t offset = sizeof(header) + static_cast<std::uint64_t>(header.bytesOfKeyValueData);
+    for (int i = 0; i < levels; i++) {
+        u32 size;
+        if (offset + sizeof(size) > file.size())
+            return 0;
+        std::memcpy(&size, file.data() + offset, sizeof(size));
+        offset += sizeof(size);
+        if (size != compressedLevelSize(header.glInternalFormat, std::max(1, width >> i), std::max(1, height >> i)) ||
+            offset + size > file.size())
+            return 0;
+        levelData[i] = file.data() + offset;
+        levelSize[i] = size;
+        offset += (size + 3) & ~3u;
+    }
+
+    const GLenum format = header.glInternalFormat == KTX_FORMAT_ETC1 && !etc1Supported ?
+        KTX_FORMAT_ETC2_RGB : header.glInternalFormat;
+    bytes = 0;
+    for (int i = 0; i < levels; i++)
+        bytes += levelSize[i];
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    for (int i = 0; i < levels; i++)
+        glCompressedTexImage2D(GL_TEXTURE_2D, i, format, std::max(1, width >> i), std::max(1, height >> i), 0, levelSize[i], levelData[i]);
+    // Part of a chain would leave the texture incomplete, and GLES 2 has no
+    // GL_TEXTURE_MAX_LEVEL to cut it short
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels == fullChain ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    stbi_image_free(data);
-    textures.push_back(tex);
-    return textures.size()-1;
+    return id;
+}
+
+TextureID Renderer::addCompressedTexture(const std::string& basename)
+{
+    // Like a failed async load, a texture that can't be loaded stays grey
+    Texture* tex = new Texture;
+    tex->id = placeholderTexture;
+    tex->width = 1;
+    tex->height = 1;
+    tex->ready = true;
+    tex->lastUsed = frame;
+    tex->filename = basename;
+    tex->compressed = true;
+    if (loadCompressedTexture(tex, basename))
+        trackMemory(tex->bytes, 0);
+    return storeTexture(tex);
+}
+
+// Uploads the first variant of basename the GPU supports into tex, false
+// if there is none or it's broken
+bool Renderer::loadCompressedTexture(Texture* tex, const std::string& basename)
+{
+    struct Variant {
+        const char* suffix;
+        bool supported;
+        u32 formats[2]; // without and with alpha
+    };
+    const Variant variants[] = {
+        {".dxt.ktx",  s3tcSupported,                  {KTX_FORMAT_DXT1, KTX_FORMAT_DXT5}},
+        {".etc2.ktx", etc2Supported,                  {KTX_FORMAT_ETC2_RGB, KTX_FORMAT_ETC2_RGBA}},
+        {".etc1.ktx", etc1Supported || etc2Supported, {KTX_FORMAT_ETC1, KTX_FORMAT_ETC1}}
+    };
+
+    for (const Variant& variant: variants) {
+        if (!variant.supported)
+            continue;
+        const std::string filename = basename + variant.suffix;
+        MappedFile file(filename);
+        if (!file.isOpen())
+            continue;
+        std::cout << "Uploading compressed texture " << filename << std::endl;
+        int width = 0, height = 0;
+        std::size_t bytes = 0;
+        const GLuint id = uploadCompressedTexture(file.view(), variant.formats, etc1Supported, width, height, bytes);
+        if (id == 0) {
+            std::cout << "Failed to load compressed texture " << filename << "!" << std::endl;
+            assert(false);
+            return false;
+        }
+        tex->id = id;
+        tex->width = width;
+        tex->height = height;
+        tex->bytes = bytes;
+        return true;
+    }
+    std::cout << "No compressed texture " << basename << " in a format this GPU supports!" << std::endl;
+    assert(false);
+    return false;
+}
+
+TextureID Renderer::addAtlasTexture(const std::string& filename)
+{
+    std::cout << "Adding atlas texture " << filename << std::endl;
+
+    const TextureFormat format = getTextureFormat(PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
+    int width, height, levels;
+    const MappedFile file(filename);
+    if (!decodeTexture(filename, file, format, MipOptions(), workers, width, height, levels, stagingPixels)) {
+        // Takes no room in any page
+        assert(false);
+        return storePlaceholderTexture();
+    }
+
+    Texture* tex = new Texture;
+    tex->width = width;
+    tex->height = height;
+    tex->ready = true;
+    const int paddedWidth = width + 2*ATLAS_BORDER, paddedHeight = height + 2*ATLAS_BORDER;
+    if (paddedWidth > ATLAS_PAGE_SIZE || paddedHeight > ATLAS_PAGE_SIZE) {
+        tex->id = uploadTexture(format, width, height, 1, stagingPixels.data());
+        tex->bytes = textureBytes(format, width, height, 1);
+        trackMemory(tex->bytes, 0);
+        return storeTexture(tex);
+    }
+
+    // Pages fill up in order, a new one opens only when the image fits none
+    int x = 0, y = 0;
+    std::size_t page = 0;
+    while (page < atlasPages.size() && !atlasPages[page].packer.insert(paddedWidth, paddedHeight, x, y))
+        page++;
+    if (page == atlasPages.size()) {
+        Texture* pageTex = new Texture;
+        glGenTextures(1, &pageTex->id);
+        glBindTexture(GL_TEXTURE_2D, pageTex->id);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        pageTex->width = ATLAS_PAGE_SIZE;
+        pageTex->height = ATLAS_PAGE_SIZE;
+        pageTex->ready = true;
+        pageTex->refs = 0; // one per image, the page goes with the last
+        pageTex->bytes = textureBytes(format, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, 1);
+        trackMemory(pageTex->bytes, 0);
+        atlasPages.push_back(AtlasPage{storeTexture(pageTex), SkylinePacker(ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE)});
+        atlasPages.back().packer.insert(paddedWidth, paddedHeight, x, y);
+        std::cout << "Opened atlas page " << atlasPages.size() << std::endl;
+    }
+
+    // The border repeats the outermost pixels, as clamping would
+    atlasPixels.resize(static_cast<std::size_t>(paddedWidth)*paddedHeight*4);
+    for (int row = 0; row < paddedHeight; row++) {
+        const int sourceRow = std::min(std::max(row - ATLAS_BORDER, 0), height - 1);
+        const u8* source = stagingPixels.data() + static_cast<std::size_t>(sourceRow)*width*4;
+        u8* dest = atlasPixels.data() + static_cast<std::size_t>(row)*paddedWidth*4;
+        for (int i = 0; i < ATLAS_BORDER; i++) {
+            std::memcpy(dest + i*4, source, 4);
+            std::memcpy(dest + (ATLAS_BORDER + width + i)*4, source + (width - 1)*4, 4);
+        }
+        std::memcpy(dest + ATLAS_BORDER*4, source, width*4);
+    }
+    Texture* pageTex = textures[atlasPages[page].id];
+    glBindTexture(GL_TEXTURE_2D, pageTex->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, paddedWidth, paddedHeight, GL_RGBA, GL_UNSIGNED_BYTE, atlasPixels.data());
+
+    tex->id = pageTex->id;
+    tex->owner = atlasPages[page].id;
+    pageTex->refs++;
+    tex->rect[0] = static_cast<float>(x + ATLAS_BORDER) / ATLAS_PAGE_SIZE;
+    tex->rect[1] = static_cast<float>(y + ATLAS_BORDER) / ATLAS_PAGE_SIZE;
+    tex->rect[2] = static_cast<float>(width) / ATLAS_PAGE_SIZE;
+    tex->rect[3] = static_cast<float>(height) / ATLAS_PAGE_SIZE;
+    return storeTexture(tex);
+}
+
+void Renderer::getTextureRect(TextureID id, float rect[4]) const
+{
+    assert(id >= 0 && id < textures.size() && textures[id] != nullptr);
+    std::copy(textures[id]->rect, textures[id]->rect + 4, rect);
+}
+
+// GIF delays are in hundredths of a second. Like browsers, treat the tiny
+// ones many files carry as the default a tenth of a second.
+static float frameSeconds(int delayMs)
+{
+    return (delayMs <= 10 ? 100 : delayMs) / 1000.0f;
+}
+
+TextureID Renderer::addAnimatedTexture(const std::string& filename)
+{
+    std::cout << "Uploading animated texture " << filename << std::endl;
+
+    AnimatedTexture* animation = new AnimatedTexture;
+    animation->file = MappedFile(filename);
+    const stbi_uc* pixels = nullptr;
+    int delayMs = 0;
+    {
+        ArenaBypass bypass;
+        if (animation->file.isOpen())
+            animation->frames = stbi_gif_frames_open_from_memory(animation->file.data(), animation->file.size(), &animation->width, &animation->height, 4);
+        if (animation->frames == nullptr || stbi_gif_frames_next(animation->frames, &pixels, &delayMs) != 1) {
+            std::cout << "Failed to load animated texture " << filename << ": " << stbi_failure_reason() << "!" << std::endl;
+            assert(false);
+            stbi_gif_frames_close(animation->frames);
+            delete animation;
+            return storePlaceholderTexture();
+        }
+    }
+
+    const TextureFormat format = getTextureFormat(PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
+    Texture* tex = new Texture;
+    tex->id = uploadTexture(format, animation->width, animation->height, 1, pixels);
+    tex->width = animation->width;
+    tex->height = animation->height;
+    tex->ready = true;
+    tex->bytes = textureBytes(format, animation->width, animation->height, 1);
+    trackMemory(tex->bytes, 0);
+    animation->id = storeTexture(tex);
+    animation->remaining = frameSeconds(delayMs);
+    animations.push_back(animation);
+    return animation->id;
+}
+
+void Renderer::updateAnimations(float elapsedSeconds)
+{
+    ArenaBypass bypass;
+    for (AnimatedTexture* animation: animations) {
+        if (animation->frames == nullptr)
+            continue;
+
+        // Every frame that came due has to be decoded, each is drawn over
+        // the one before, but only the last one is uploaded
+        animation->remaining -= elapsedSeconds;
+        const stbi_uc* pixels = nullptr;
+        while (animation->remaining <= 0.0f) {
+            int delayMs = 0;
+            int result = stbi_gif_frames_next(animation->frames, &pixels, &delayMs);
+            if (result == 0 && stbi_gif_frames_rewind(animation->frames))
+                result = stbi_gif_frames_next(animation->frames, &pixels, &delayMs);
+            if (result != 1) {
+                // Corrupt further in: stop on the last good frame
+                std::cout << "Animated texture stopped: " << stbi_failure_reason() << "!" << std::endl;
+                stbi_gif_frames_close(animation->frames);
+                animation->frames = nullptr;
+                pixels = nullptr;
+                break;
+            }
+            animation->remaining += frameSeconds(delayMs);
+        }
+        if (pixels == nullptr)
+            continue;
+
+        glBindTexture(GL_TEXTURE_2D, textures[animation->id]->id);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, animation->width, animation->height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+}
+
+void Renderer::removeTexture(TextureID id)
+{
+    assert(id >= 0 && id < textures.size() && textures[id] != nullptr);
+    Texture* tex = textures[id];
+    assert(tex->refs > 0);
+    if (--tex->refs > 0)
+        return;
+
+    // Nothing can find it from here on
+    for (const std::string& key: tex->cacheKeys)
+        textureCache.erase(key);
+    tex->cacheKeys.clear();
+    if (tex->contentCached)
+        contentCache.erase(tex->contentKey);
+    tex->contentCached = false;
+    // A decode still in flight comes back to processUploads, which frees it
+    if (tex->loading)
+        return;
+    destroyTexture(id);
+}
+
+void Renderer::destroyTexture(TextureID id)
+{
+    Texture* tex = textures[id];
+    if (tex->owner >= 0)
+        removeTexture(tex->owner);
+    else if (tex->id != placeholderTexture)
+        glDeleteTextures(1, &tex->id);
+    trackMemory(-static_cast<std::ptrdiff_t>(tex->bytes), 0);
+
+    for (std::size_t i = 0; i < atlasPages.size(); i++) {
+        if (atlasPages[i].id == id) {
+            atlasPages.erase(atlasPages.begin() + i);
+            break;
+        }
+    }
+    for (std::size_t i = 0; i < animations.size(); i++) {
+        if (animations[i]->id == id) {
+            stbi_gif_frames_close(animations[i]->frames);
+            delete animations[i];
+            animations.erase(animations.begin() + i);
+            break;
+        }
+    }
+
+    delete tex;
+    textures[id] = nullptr;
+    freeTextureIds.push_back(id);
+}
+
+bool Renderer::isTextureReady(TextureID id) const
+{
+    assert(id >= 0 && id < textures.size() && textures[id] != nullptr);
+    const Texture* tex = textures[id];
+    return tex->ready && (tex->owner < 0 || textures[tex->owner]->ready);
+}
+
+void Renderer::processUploads(float budgetMs)
+{
+    // Always uploads at least one texture, so a tiny budget still makes progress
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    while (true) {
+        DecodedTexture* decoded;
+        {
+#ifndef EMSCRIPTEN
+            std::lock_guard<std::mutex> lock(decodedMutex);
+#endif
+            if (decodedTextures.empty())
+                return;
+            decoded = decodedTextures.front();
+            decodedTextures.pop_front();
+        }
+
+        // A texture that failed to decode keeps the placeholder for good,
+        // one removed while it was decoding can go now
+        Texture* tex = textures[decoded->id];
+        tex->loading = false;
+        const auto same = contentCache.find(decoded->contentKey);
+        if (tex->refs == 0)
+            destroyTexture(decoded->id);
+        else {
+            // An evicted texture coming back may have copies pointing at it,
+            // so it takes its GL texture back rather than sharing another
+            if (decoded->ok && same != contentCache.end() && !tex->evicted &&
+                sameContents(MappedFile(tex->filename).view(), textures[same->second]->filename)) {
+                // The same file under another name, already on the GPU
+                Texture* original = textures[same->second];
+                original->refs++;
+                tex->owner = same->second;
+                tex->id = original->id;
+                tex->width = original->width;
+                tex->height = original->height;
+            } else if (decoded->ok) {
+                tex->id = uploadTexture(decoded->format, decoded->width, decoded->height, decoded->levels, decoded->pixels.data());
+                tex->width = decoded->width;
+                tex->height = decoded->height;
+                tex->bytes = textureBytes(decoded->format, decoded->width, decoded->height, decoded->levels);
+                trackMemory(tex->bytes, 0);
+                tex->contentKey = decoded->contentKey;
+                if (same == contentCache.end()) {
+                    tex->contentCached = true;
+                    contentCache[decoded->contentKey] = decoded->id;
+                }
+            }
+            tex->evicted = false;
+            tex->ready = true;
+        }
+        {
+#ifndef EMSCRIPTEN
+            std::lock_guard<std::mutex> lock(decodedMutex);
+#endif
+            freeDecodedTextures.push_back(decoded);
+        }
+
+        const std::chrono::duration<float, std::milli> elapsed = Clock::now() - start;
+        if (elapsed.count() >= budgetMs)
+            return;
+    }
+}
+
+void Renderer::evictTexture(Texture* tex)
+{
+    std::cout << "Evicting texture " << tex->filename << std::endl;
+    glDeleteTextures(1, &tex->id);
+    tex->id = placeholderTexture;
+    trackMemory(-static_cast<std::ptrdiff_t>(tex->bytes), 0);
+    tex->bytes = 0;
+    tex->evicted = true;
+    tex->ready = false;
+    // Nothing new may share it until it's back
+    if (tex->contentCached)
+        contentCache.erase(tex->contentKey);
+    tex->contentCached = false;
+    memory.evictedTextures++;
+}
+
+void Renderer::trackMemory(std::ptrdiff_t textureDelta, std::ptrdiff_t bufferDelta)
+{
+    memory.textureBytes += textureDelta;
+    memory.bufferBytes += bufferDelta;
+    memory.peakBytes = std::max(memory.peakBytes, memory.textureBytes + memory.bufferBytes);
+}
+
+void Renderer::setMemoryBudget(std::size_t budgetBytes)
+{
+    memoryBudget = budgetBytes;
+}
+
+MemoryStats Renderer::getMemoryStats() const
+{
+    MemoryStats stats = memory;
+    stats.budgetBytes = memoryBudget;
+    return stats;
+}
+
+void Renderer::endFrame()
+{
+    if (memoryBudget > 0 && memory.textureBytes + memory.bufferBytes > memoryBudget) {
+        // Least recently used first; a texture or a mesh is either, the
+        // other pointer is nullptr
+        struct Candidate {
+            u64 lastUsed;
+            Texture* texture;
+            Mesh* mesh;
+        };
+        std::vector<Candidate> candidates;
+        for (Texture* tex: textures) {
+            if (tex != nullptr && !tex->filename.empty() && tex->owner < 0 && tex->ready && !tex->evicted &&
+                tex->bytes > 0 && tex->lastUsed < frame)
+                candidates.push_back(Candidate{tex->lastUsed, tex, nullptr});
+        }
+        for (Mesh* mesh: meshes) {
+            if (mesh != nullptr && !mesh->filename.empty() && !mesh->evicted && mesh->lastUsed < frame)
+                candidates.push_back(Candidate{mesh->lastUsed, nullptr, mesh});
+        }
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         [](const Candidate& a, const Candidate& b) { return a.lastUsed < b.lastUsed; });
+        for (const Candidate& candidate: candidates) {
+            if (memory.textureBytes + memory.bufferBytes <= memoryBudget)
+                break;
+            if (candidate.texture != nullptr)
+                evictTexture(candidate.texture);
+            else
+                evictMesh(candidate.mesh);
+        }
+    }
+    frame++;
 }
@@ -2,9 +2,18 @@
 #define __RENDERER_HPP__
 
 #include "common.hpp"
+#include "mipmaps.hpp"
+#include "atlas.hpp"
 
 #include <string>
 #include <vector>
+#include <cstddef>
+#include <deque>
+#include <unordered_map>
+
+#ifndef EMSCRIPTEN
+#include <mutex>
+#endif
 
 struct Vertex {
     float px,py,pz;
@@ -17,6 +26,79 @@ struct Vertex {
 //typedef u16 Index;
 typedef u32 Index;
 
+// Mesh files come in two flavours:
+// - version 1, a raw dump: int numVertices, int numIndices, Vertex[], Index[]
+// - version 2, a MeshFileHeader followed by numChunks MeshChunks and their payloads.
+//   The vertex and index streams are cut into chunks that are compressed
+//   independently (zlib), so they can be inflated in parallel.
+// tools/meshpack.cpp converts version 1 files to version 2.
+const u32 MESH_FILE_MAGIC   = 0x3248534d; // "MSH2"
+const u32 MESH_FILE_VERSION = 2;
+
+enum MeshStream {
+    MESH_STREAM_VERTICES = 0,
+    MESH_STREAM_INDICES  = 1
+};
+
+enum MeshCodec {
+    MESH_CODEC_STORED = 0,
+    MESH_CODEC_ZLIB   = 1
+};
+
+struct MeshFileHeader {
+    u32 magic;
+    u32 version;
+    u32 numVertices;
+    u32 numIndices;
+    u32 numChunks;
+};
+
+struct MeshChunk {
+    u32 stream;     // MeshStream
+    u32 codec;      // MeshCodec
+    u32 rawOffset;  // byte offset within its stream
+    u32 rawSize;
+    u32 fileOffset; // byte offset of the payload from the start of the file
+    u32 fileSize;
+};
+static_assert(sizeof(MeshFileHeader) == 5*4, "MeshFileHeader is written as-is");
+static_assert(sizeof(MeshChunk) == 6*4, "MeshChunk is written as-is");
+
+// Block-compressed textures are KTX 1 files (khronos.org/opengles/sdk/tools/KTX):
+// a KtxHeader, bytesOfKeyValueData bytes to skip, then for every mip level,
+// level 0 first, a u32 byte count followed by that level's blocks, rows of
+// 4x4 pixel blocks from the top. tools/texcompress.cpp writes them.
+// Only little-endian 2D files in one of the KtxFormats are read.
+const u8  KTX_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+const u32 KTX_ENDIANNESS     = 0x04030201;
+
+// glInternalFormat values, the GL enums of the compressed formats
+enum KtxFormat {
+    KTX_FORMAT_DXT1      = 0x83F0, // COMPRESSED_RGB_S3TC_DXT1_EXT, 8 bytes a block
+    KTX_FORMAT_DXT5      = 0x83F3, // COMPRESSED_RGBA_S3TC_DXT5_EXT, 16 bytes
+    KTX_FORMAT_ETC1      = 0x8D64, // ETC1_RGB8_OES, 8 bytes
+    KTX_FORMAT_ETC2_RGB  = 0x9274, // COMPRESSED_RGB8_ETC2, 8 bytes
+    KTX_FORMAT_ETC2_RGBA = 0x9278  // COMPRESSED_RGBA8_ETC2_EAC, 16 bytes
+};
+
+struct KtxHeader {
+    u8 identifier[12];
+    u32 endianness;
+    u32 glType;                // 0 for compressed formats
+    u32 glTypeSize;            // 1
+    u32 glFormat;              // 0
+    u32 glInternalFormat;      // KtxFormat
+    u32 glBaseInternalFormat;  // GL_RGB or GL_RGBA
+    u32 pixelWidth;
+    u32 pixelHeight;
+    u32 pixelDepth;            // 0
+    u32 numberOfArrayElements; // 0
+    u32 numberOfFaces;         // 1
+    u32 numberOfMipmapLevels;
+    u32 bytesOfKeyValueData;
+};
+static_assert(sizeof(KtxHeader) == 12 + 13*4, "KtxHeader is written as-is");
+
 #define CGLE checkGLError(__FILE__, __LINE__)
 void checkGLError(const char* file, int line);
 
@@ -25,8 +107,18 @@ typedef int ShaderID;
 typedef int MeshID;
 
 struct Texture;
+struct DecodedTexture;
+struct AnimatedTexture;
 struct Shader;
 struct Mesh;
+class WorkerPool;
+class CommandBuffer;
+
+// One copy of a mesh file in a static batch, see Renderer::addMeshBatch
+struct MeshInstance {
+    std::string filename;
+    float transform[16]; // column-major, same as setUniform4x4fv
+};
 
 enum class PixelFormat {
     R,
@@ -34,9 +126,25 @@ enum class PixelFormat {
     Rgba
 };
 
+// Float and Half decode through stb_image's HDR path, so Radiance files keep
+// their range and 8-bit images come out linear (gamma 2.2 removed). Half
+// packs to 16-bit floats before upload, half the memory and bandwidth of
+// Float; WebGL needs OES_texture_half_float or OES_texture_float for them.
 enum class PixelType {
     Ubyte,
-    Float
+    Float,
+    Half
+};
+
+// GPU memory the Renderer has allocated, counted at the nominal size of
+// every texture level and buffer; drivers add padding and alignment on top
+struct MemoryStats {
+    std::size_t textureBytes; // resident textures, the placeholder aside
+    std::size_t bufferBytes;  // vertex, index and instance buffers
+    std::size_t peakBytes;    // the highest textureBytes + bufferBytes so far
+    std::size_t budgetBytes;  // see setMemoryBudget, 0 for none
+    int evictedTextures;      // evictions so far, a resource can count more than once
+    int evictedMeshes;
 };
 
 class Renderer {
@@ -44,10 +152,71 @@ public:
     Renderer();
     ~Renderer();
 
-    TextureID addTexture(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type);
+    // With a mip filter (Ubyte only) the whole chain is built on the CPU,
+    // split over the worker pool, and uploaded together with level 0.
+    // Loading the same file with the same arguments again returns the same
+    // id, and so does a file with the same contents under another name.
+    TextureID addTexture(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type,
+                         const MipOptions& mips = MipOptions());
+    // Returns right away and decodes on a worker thread. Until processUploads
+    // has uploaded the result, the texture is a 1x1 grey placeholder.
+    // Shares textures like addTexture, except that a copy under another
+    // name gets an id of its own; it still decodes, but once it's found to
+    // match a texture on the GPU it uses that one.
+    TextureID addTextureAsync(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type,
+                              const MipOptions& mips = MipOptions());
+    bool isTextureReady(TextureID id) const;
+    // Packs an image (RGBA, no mipmaps) into a shared atlas page, opening a
+    // new page when none has room; images too big for a page get a texture
+    // of their own. The id works like any other, but setTexture binds the
+    // whole page: sample it through getTextureRect. Draws using images of
+    // the same page sort together and skip the rebind.
+    TextureID addAtlasTexture(const std::string& filename);
+    // Where id lies inside the GL texture it binds, as a UV offset and
+    // scale: sample at rect.xy + uv*rect.zw. (0, 0, 1, 1) unless id is an
+    // atlas image.
+    void getTextureRect(TextureID id, float rect[4]) const;
+    // Every add* call that returned id holds a reference on it; this drops
+    // one. The last frees the texture (an async load as soon as its decode
+    // is done) and id may be handed out again.
+    void removeTexture(TextureID id);
+    // Block-compressed texture from the KTX files tools/texcompress writes
+    // next to each other: basename.dxt.ktx, basename.etc2.ktx and
+    // basename.etc1.ktx are tried in that order, skipping formats the GPU
+    // can't sample. The blocks are uploaded straight from the mapped file.
+    TextureID addCompressedTexture(const std::string& basename);
+    // Animated GIF: the first frame shows right away and updateAnimations
+    // moves it along, decoding each frame when it comes due, so memory is a
+    // frame rather than the whole animation. Loops forever.
+    TextureID addAnimatedTexture(const std::string& filename);
+    // Advances every animated texture by elapsedSeconds, call once per frame
+    void updateAnimations(float elapsedSeconds);
+    // Uploads decoded textures until budgetMs is used up, call once per frame
+    void processUploads(float budgetMs);
     ShaderID addShader(const std::string& vsFilename, const std::string& fsFilename);
-    ShaderID addShaderFromSource(const std::string& vsSource, const std::string& fsSource);
+    ShaderID addShaderFromSource(ByteView vsSource, ByteView fsSource);
+    // Frees the program; id may be handed out again
+    void removeShader(ShaderID id);
     MeshID addMesh(const std::string& filename);
+    // Bakes transformed copies of the given meshes into one static mesh.
+    // Works everywhere, useful when hardware instancing isn't available.
+    MeshID addMeshBatch(const std::vector<MeshInstance>& instances);
+    // Frees the buffers; id may be handed out again
+    void removeMesh(MeshID id);
+
+    // Once textures and meshes take more than budgetBytes, endFrame evicts
+    // the ones unused for the most frames until they fit again. An evicted
+    // resource keeps its id and is loaded from its file again the next time
+    // it's used: a texture asynchronously, showing the placeholder meanwhile
+    // (compressed ones right away), a mesh right away. Resources without a
+    // file of their own (atlas pages, animated textures, mesh batches) are
+    // never evicted, nor is anything used in the current frame. 0, the
+    // default, means no budget.
+    void setMemoryBudget(std::size_t budgetBytes);
+    MemoryStats getMemoryStats() const;
+    // Call once per frame after drawing: advances the clock that tells cold
+    // resources from warm ones and applies the memory budget
+    void endFrame();
 
     void setShader(ShaderID shader);
     void setUniform1i(const std::string& name, int value);
@@ -60,13 +229,86 @@ public:
     void setTexture(int unit, TextureID id);
 
     void drawMesh(MeshID id);
+    // Draws numInstances copies with one call (ANGLE/ARB_instanced_arrays).
+    // instanceData holds floatsPerInstance (1..16) floats per instance, fed to
+    // the shader as vec4 attributes starting at location 5; declare them after
+    // the five per-vertex attributes. Without instancing support this falls
+    // back to one draw call per instance.
+    void drawMeshInstanced(MeshID id, int numInstances, const float* instanceData, int floatsPerInstance);
+
+    // Queues the commands recorded in buffer for the next flush and resets
+    // the buffer. Safe to call from any thread.
+    void submit(CommandBuffer& buffer);
+    // Sorts everything submitted since the last flush and executes it,
+    // skipping framebuffer, shader, texture and mesh changes that would be
+    // redundant. GL thread only.
+    void flush();
 
 private:
-    std::vector<Texture*> textures;
-    std::vector<Shader*> shaders;
-    std::vector<Mesh*> meshes;
+    void drawInstances(int numIndices, int numInstances, const float* instanceData, int floatsPerInstance);
+    TextureID findCachedTexture(const std::string& key);
+    TextureID storeTexture(Texture* tex);
+    TextureID storePlaceholderTexture();
+    void destroyTexture(TextureID id);
+    void queueDecode(TextureID id);
+    bool loadCompressedTexture(Texture* tex, const std::string& basename);
+    void evictTexture(Texture* tex);
+    Mesh* useMesh(MeshID id);
+    void evictMesh(Mesh* mesh);
+    void trackMemory(std::ptrdiff_t textureDelta, std::ptrdiff_t bufferDelta);
+
+    static const int FIRST_INSTANCE_ATTRIBUTE = 5;
+    static const int MAX_INSTANCE_ATTRIBUTES = 4;
+    // Atlas pages are square; every image gets a border of copied edge
+    // pixels so bilinear filtering never reads its neighbours
+    static const int ATLAS_PAGE_SIZE = 1024;
+    static const int ATLAS_BORDER = 1;
 
-    ShaderID currentShader;
+    WorkerPool* workers;
+
+    bool instancingSupported = false;
+    bool s3tcSupported = false;
+    bool etc1Supported = false;
+    bool etc2Supported = false;
+    unsigned int instanceVB = 0;
+
+    std::vector<Texture*> textures; // nullptr where one was removed
+    std::vector<TextureID> freeTextureIds;
+    std::unordered_map<std::string, TextureID> textureCache; // filename and arguments
+    std::unordered_map<u64, TextureID> contentCache;        // file contents and arguments, uploaded textures only
+    unsigned int placeholderTexture = 0;
+    std::deque<DecodedTexture*> decodedTextures;
+    std::vector<DecodedTexture*> freeDecodedTextures; // uploaded, kept for their buffers
+    std::vector<u8> stagingPixels; // addTexture decodes here, GL thread only
+    std::vector<AnimatedTexture*> animations;
+    struct AtlasPage {
+        TextureID id;
+        SkylinePacker packer;
+    };
+    std::vector<AtlasPage> atlasPages;
+    std::vector<u8> atlasPixels;         // an image with its border, GL thread only
+    std::vector<TextureID> textureBinds; // textures as flush binds them
+#ifndef EMSCRIPTEN
+    std::mutex decodedMutex;
+#endif
+    std::vector<Shader*> shaders; // nullptr where one was removed
+    std::vector<ShaderID> freeShaderIds;
+    std::vector<Mesh*> meshes;    // nullptr where one was removed
+    std::vector<MeshID> freeMeshIds;
+
+    u64 frame = 1; // endFrame calls so far, plus one
+    std::size_t memoryBudget = 0;
+    MemoryStats memory = MemoryStats();
+    std::size_t instanceVBBytes = 0;
+
+    ShaderID currentShader = -1;
+
+    CommandBuffer* queue;
+    CommandBuffer* executing;
+    std::vector<u32> order;
+#ifndef EMSCRIPTEN
+    std::mutex queueMutex;
+#endif
 };
 
 #endif
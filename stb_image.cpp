@@ -20,6 +20,7 @@
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
       - overridable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      - SSE2/SSSE3 PNG unfiltering for RGB/RGBA (also with STBI_SIMD)
 
    Latest revisions:
       1.33 (2011-07-14) minor fixes suggested by Dave Moore
@@ -71,7 +72,7 @@
 //    - non-HDR formats support 8-bit samples only (jpeg, png)
 //    - no delayed line count (jpeg) -- IJG doesn't support either
 //    - no 1-bit BMP
-//    - GIF always returns *comp=4
+//    - GIF always returns *comp=4; stbi_load gives the first frame only
 //
 // Basic usage (see HDR discussion below):
 //    int x,y,n;
@@ -160,6 +161,10 @@
 //     stbi_ldr_to_hdr_scale(1.0f);
 //     stbi_ldr_to_hdr_gamma(2.2f);
 //
+// stbi_loadh returns the same as 16-bit half floats, ready for a
+// GL_HALF_FLOAT texture. Radiance files decode their scanlines on the
+// stbi_install_parallel_for workers when loaded from memory.
+//
 // Finally, given a filename (or an open file or memory block--see header
 // file for details) containing image data, you can query for the "most
 // appropriate" interface to use (that is, whether the image is HDR or
@@ -169,6 +174,28 @@
 //
 // ===========================================================================
 //
+// Loading by filename
+//
+// stbi_load(filename) and the other functions taking a filename map the file
+// into memory and decode it like stbi_load_from_memory: no copying through
+// a stdio buffer and far fewer system calls, and the decoders that split
+// work over stbi_install_parallel_for (which needs a memory source) get to.
+// Files that can't be mapped (empty, 2GB or more, not a regular file) are
+// read through stdio as before. Define STBI_NO_MMAP to always use stdio.
+//
+// ===========================================================================
+//
+// Memory
+//
+// Every buffer a load allocates, including the image it returns, goes
+// through stbi_install_allocator, so scratch memory can come from an arena
+// that rewinds between loads. To put the pixels somewhere of your own, size
+// the destination with stbi_info_from_memory and decode with
+// stbi_load_into_from_memory: with an arena installed, loading a stream of
+// images that way reaches a steady state with no heap allocations at all.
+//
+// ===========================================================================
+//
 // I/O callbacks
 //
 // I/O callbacks allow you to read from arbitrary sources, like packaged
@@ -189,6 +216,8 @@
 #include <stdio.h>
 #endif
 
+#include <stddef.h> // size_t
+
 #define STBI_VERSION 1
 
 enum
@@ -233,6 +262,55 @@ typedef struct
 
 extern stbi_uc *stbi_load_from_callbacks  (stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp);
 
+// decode into a buffer of the caller's (a mapped pixel buffer, a reused
+// staging area...) instead of returning a new one. Size it from
+// stbi_info_from_memory: x*y*(req_comp ? req_comp : comp) bytes. Returns 1
+// on success, 0 on failure, including when out_size is too small.
+extern int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, size_t out_size, int *x, int *y, int *comp, int req_comp);
+
+// JPEG only: decode at 1/scale of the stored size, for scale 1, 2, 4 or 8.
+// Each 8x8 block is rebuilt from its lowest-frequency coefficients at the
+// reduced size, so this costs a fraction of a full decode plus a resize, in
+// both time and memory. The result is ceil(width/scale) x ceil(height/scale);
+// anything that isn't a JPEG fails.
+extern stbi_uc *stbi_jpeg_load_scaled_from_memory(stbi_uc const *buffer, int len, int scale, int *x, int *y, int *comp, int req_comp);
+#ifndef STBI_NO_STDIO
+extern stbi_uc *stbi_jpeg_load_scaled            (char const *filename,     int scale, int *x, int *y, int *comp, int req_comp);
+#endif
+
+// PNG only: decode row by row instead of into one buffer. begin (may be
+// NULL) gets the size and the channels in the file, with a tRNS color key
+// counted as alpha; then row gets every row, top to bottom, with req_comp
+// channels (comp if req_comp is 0). The pixels are only valid during the call. Returning 0
+// from either stops decoding. Input is read as it's needed and memory use
+// is the 32KB inflate window plus a few rows, whatever the image size.
+// Interlaced PNGs aren't supported, their rows aren't stored in order.
+// Returns 1 once every row has been delivered, 0 on failure.
+typedef struct
+{
+   int      (*begin) (void *user,int x,int y,int comp);
+   int      (*row)   (void *user,int y,stbi_uc const *pixels);
+} stbi_png_row_callbacks;
+
+extern int stbi_png_load_rows_from_memory   (stbi_uc const *buffer, int len, stbi_png_row_callbacks const *rows, void *user, int req_comp);
+extern int stbi_png_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *clbk_user, stbi_png_row_callbacks const *rows, void *user, int req_comp);
+#ifndef STBI_NO_STDIO
+extern int stbi_png_load_rows               (char const *filename,     stbi_png_row_callbacks const *rows, void *user, int req_comp);
+#endif
+
+// GIF only: decode an animation a frame at a time. Each frame is drawn over
+// the last one as the file says, disposal included, on a single canvas, so
+// memory is a frame or two however long the animation is. buffer has to
+// stay valid until close. next gives the frame, x*y pixels of req_comp
+// channels (4 if 0) valid until the next call, and how long to show it;
+// it returns 1, 0 after the last frame or -1 if the file is corrupt.
+// rewind goes back to the first frame, for looping.
+typedef struct stbi_gif_frames stbi_gif_frames;
+extern stbi_gif_frames *stbi_gif_frames_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int req_comp);
+extern int  stbi_gif_frames_next  (stbi_gif_frames *frames, stbi_uc const **pixels, int *delay_ms);
+extern int  stbi_gif_frames_rewind(stbi_gif_frames *frames);
+extern void stbi_gif_frames_close (stbi_gif_frames *frames);
+
 #ifndef STBI_NO_HDR
    extern float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 
@@ -243,6 +321,17 @@ extern stbi_uc *stbi_load_from_callbacks  (stbi_io_callbacks const *clbk, void *
    
    extern float *stbi_loadf_from_callbacks  (stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp);
 
+   // the same as stbi_loadf, but as 16-bit IEEE half floats (GL_HALF_FLOAT),
+   // half the memory and upload size. Radiance files are converted straight
+   // to halves a row at a time; other formats go through stbi_loadf first.
+   // Free the result with stbi_image_free.
+   extern unsigned short *stbi_loadh_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+   extern unsigned short *stbi_loadh_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp);
+   #ifndef STBI_NO_STDIO
+   extern unsigned short *stbi_loadh               (char const *filename,   int *x, int *y, int *comp, int req_comp);
+   extern unsigned short *stbi_loadh_from_file     (FILE *f,                int *x, int *y, int *comp, int req_comp);
+   #endif
+
    extern void   stbi_hdr_to_ldr_gamma(float gamma);
    extern void   stbi_hdr_to_ldr_scale(float scale);
 
@@ -260,10 +349,10 @@ extern int      stbi_is_hdr_from_file(FILE *f);
 
 
 // get a VERY brief reason for failure
-// NOT THREADSAFE
+// the reason is kept per thread, so ask on the thread that did the load
 extern const char *stbi_failure_reason  (void); 
 
-// free the loaded image -- this is just free()
+// free the loaded image -- this is just free(), or the installed allocator's
 extern void     stbi_image_free      (void *retval_from_stbi_load);
 
 // get image dimensions & components without fully decoding
@@ -278,6 +367,11 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 
 
 
+// THREAD SAFETY: loads on different threads don't share any mutable state.
+// The settings below (and stbi_hdr_to_ldr_*, stbi_ldr_to_hdr_*, stbi_install_*)
+// are global; each load takes a copy when it starts, so they must not be
+// changed while a load may be starting on another thread.
+
 // for image formats that explicitly notate that they have premultiplied alpha,
 // we just return the colors as stored in the file. set this flag to force
 // unpremultiplication. results are undefined if the unpremultiply overflow.
@@ -287,6 +381,30 @@ extern void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply
 // or just pass them through "as-is"
 extern void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
+// let decoders split work across threads: 'func' has to run body(context, 0)
+// .. body(context, count-1), in any order and on any threads, and return once
+// all of them are done. JPEG uses it to decode restart intervals (memory
+// sources only) and to color convert. NULL, the default, does everything on
+// the calling thread.
+typedef void (*stbi_parallel_for)(void *user, int count, void (*body)(void *context, int index), void *context);
+extern void stbi_install_parallel_for(stbi_parallel_for func, void *user);
+
+// route every allocation the decoders make -- scratch buffers and the images
+// they return -- through 'alloc', 'realloc' and 'free' (each gets 'user'
+// first), e.g. to put them in an arena that is rewound once a load is done.
+// NULL, the default, uses the C library. Parallel decodes allocate on the
+// worker threads, so the functions must be thread-safe. Unlike the settings
+// above this isn't copied per load: install it before loading anything, and
+// don't change it while a load or an image it returned is still alive.
+typedef struct
+{
+   void *(*alloc)  (void *user, size_t size);
+   void *(*realloc)(void *user, void *p, size_t size);
+   void  (*free)   (void *user, void *p);
+   void  *user;
+} stbi_allocator;
+extern void stbi_install_allocator(stbi_allocator const *allocator);
+
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -299,6 +417,8 @@ extern int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const cha
 
 
 // define faster low-level operations (typically SIMD support)
+// with STBI_SIMD defined, SSE2/AVX2 (x86) or NEON (ARM) versions of both are
+// installed at startup when the CPU has them; installing your own replaces them
 #ifdef STBI_SIMD
 typedef void (*stbi_idct_8x8)(stbi_uc *out, int out_stride, short data[64], unsigned short *dequantize);
 // compute an integer IDCT on "input"
@@ -341,6 +461,26 @@ extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #include <memory.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <limits.h>
+
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP)
+   #if defined(_WIN32)
+      #define STBI_MMAP_WIN32
+      #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+      #endif
+      #ifndef NOMINMAX
+      #define NOMINMAX
+      #endif
+      #include <windows.h>
+   #elif (defined(__unix__) || defined(__APPLE__)) && !defined(EMSCRIPTEN)
+      #define STBI_MMAP_POSIX
+      #include <sys/mman.h>
+      #include <sys/stat.h>
+      #include <fcntl.h>
+      #include <unistd.h>
+   #endif
+#endif
 
 #ifndef _MSC_VER
    #ifdef __cplusplus
@@ -352,6 +492,66 @@ extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
    #define stbi_inline __forceinline
 #endif
 
+#ifdef STBI_SIMD
+// SIMD kernels for the IDCT and YCbCr hooks. Each one is compiled for its
+// own instruction set (no -m flags needed) and picked at startup from what
+// the CPU supports; they produce exactly the same output as the C versions.
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && !defined(EMSCRIPTEN)
+   #define STBI_SIMD_X86
+   #include <immintrin.h>
+   #ifdef _MSC_VER
+      #include <intrin.h>
+      #define STBI_TARGET(isa)
+   #else
+      #include <cpuid.h>
+      #define STBI_TARGET(isa)  __attribute__((target(isa)))
+   #endif
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+   #define STBI_SIMD_NEON
+   #include <arm_neon.h>
+#endif
+
+#ifdef STBI_SIMD_X86
+enum { STBI_CPU_SSE2 = 1, STBI_CPU_AVX2 = 2, STBI_CPU_SSSE3 = 4, STBI_CPU_F16C = 8 };
+
+static int stbi_cpu_features(void)
+{
+   int features = 0;
+   #ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 1);
+   if (info[3] & (1 << 26)) features |= STBI_CPU_SSE2;
+   if (info[2] & (1 << 9))  features |= STBI_CPU_SSSE3;
+   // AVX2 and F16C also need the OS to save the ymm registers (OSXSAVE, XCR0)
+   if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+      if (info[2] & (1 << 29)) features |= STBI_CPU_F16C;
+      __cpuidex(info, 7, 0);
+      if (info[1] & (1 << 5)) features |= STBI_CPU_AVX2;
+   }
+   #else
+   __builtin_cpu_init(); // we run before main, from static initializers
+   if (__builtin_cpu_supports("sse2")) features |= STBI_CPU_SSE2;
+   if (__builtin_cpu_supports("ssse3")) features |= STBI_CPU_SSSE3;
+   if (__builtin_cpu_supports("avx2")) features |= STBI_CPU_AVX2;
+   // not every compiler knows "f16c" here, so ask cpuid; "avx" covers the OS side
+   {
+      unsigned int a, b, c, d;
+      if (__builtin_cpu_supports("avx") && __get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 29)))
+         features |= STBI_CPU_F16C;
+   }
+   #endif
+   return features;
+}
+#endif
+
+#ifdef _MSC_VER
+   #define STBI_SIMD_ALIGN(type, name)  __declspec(align(16)) type name
+#else
+   #define STBI_SIMD_ALIGN(type, name)  type name __attribute__((aligned(16)))
+#endif
+#endif // STBI_SIMD
+
 
 // implementation:
 typedef unsigned char  uint8;
@@ -360,9 +560,11 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+typedef unsigned long long uint64;
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
+typedef unsigned char validate_uint64[sizeof(uint64)==8 ? 1 : -1];
 
 #if defined(STBI_NO_STDIO) && !defined(STBI_NO_WRITE)
 #define STBI_NO_WRITE
@@ -400,8 +602,77 @@ typedef struct
 
    uint8 *img_buffer, *img_buffer_end;
    uint8 *img_buffer_original;
+
+   // copies of the global settings, taken when the context is started so
+   // that a load never reads state another thread could be changing
+   int png_partial;
+   int unpremultiply_on_load;
+   int de_iphone_flag;
+   float h2l_gamma_i, h2l_scale_i;
+   float l2h_gamma, l2h_scale;
+   stbi_parallel_for parallel_for;
+   void *parallel_user;
 } stbi;
 
+int stbi_png_partial; // a quick hack to only allow decoding some of a PNG; stbi_png_load_rows* really streams
+static int stbi_unpremultiply_on_load = 0;
+static int stbi_de_iphone_flag = 0;
+static float h2l_gamma_i=1.0f/2.2f, h2l_scale_i=1.0f;
+static float l2h_gamma=2.2f, l2h_scale=1.0f;
+static stbi_parallel_for stbi_parallel_for_installed = NULL;
+static void *stbi_parallel_user = NULL;
+
+void stbi_install_parallel_for(stbi_parallel_for func, void *user)
+{
+   stbi_parallel_for_installed = func;
+   stbi_parallel_user = user;
+}
+
+static stbi_allocator stbi_allocator_installed; // all NULL: the C library
+
+void stbi_install_allocator(stbi_allocator const *allocator)
+{
+   if (allocator)
+      stbi_allocator_installed = *allocator;
+   else
+      memset(&stbi_allocator_installed, 0, sizeof(stbi_allocator_installed));
+}
+
+static void *stbi_malloc(size_t size)
+{
+   if (stbi_allocator_installed.alloc)
+      return stbi_allocator_installed.alloc(stbi_allocator_installed.user, size);
+   return malloc(size);
+}
+
+static void *stbi_realloc(void *p, size_t size)
+{
+   if (stbi_allocator_installed.realloc)
+      return stbi_allocator_installed.realloc(stbi_allocator_installed.user, p, size);
+   return realloc(p, size);
+}
+
+static void stbi_free(void *p)
+{
+   if (stbi_allocator_installed.free)
+      stbi_allocator_installed.free(stbi_allocator_installed.user, p);
+   else
+      free(p);
+}
+
+static void start_settings(stbi *s)
+{
+   s->png_partial = stbi_png_partial;
+   s->unpremultiply_on_load = stbi_unpremultiply_on_load;
+   s->de_iphone_flag = stbi_de_iphone_flag;
+   s->h2l_gamma_i = h2l_gamma_i;
+   s->h2l_scale_i = h2l_scale_i;
+   s->l2h_gamma = l2h_gamma;
+   s->l2h_scale = l2h_scale;
+   s->parallel_for = stbi_parallel_for_installed;
+   s->parallel_user = stbi_parallel_user;
+}
+
 
 static void refill_buffer(stbi *s);
 
@@ -412,6 +683,7 @@ static void start_mem(stbi *s, uint8 const *buffer, int len)
    s->read_from_callbacks = 0;
    s->img_buffer = s->img_buffer_original = (uint8 *) buffer;
    s->img_buffer_end = (uint8 *) buffer+len;
+   start_settings(s);
 }
 
 // initialize a callback-based context
@@ -423,6 +695,7 @@ static void start_callbacks(stbi *s, stbi_io_callbacks *c, void *user)
    s->read_from_callbacks = 1;
    s->img_buffer_original = s->buffer_start;
    refill_buffer(s);
+   start_settings(s);
 }
 
 #ifndef STBI_NO_STDIO
@@ -454,6 +727,70 @@ static void start_file(stbi *s, FILE *f)
    start_callbacks(s, &stbi_stdio_callbacks, (void *) f);
 }
 
+// A read-only mapping of a whole file, for the functions taking a filename.
+// stbi_map_file returns 0 if the file can't be mapped, the caller then
+// falls back to stdio (which also reports a file that can't be opened).
+typedef struct
+{
+   stbi_uc *data;
+   int len;
+} stbi_mapping;
+
+static int stbi_map_file(stbi_mapping *m, char const *filename)
+{
+#if defined(STBI_MMAP_POSIX)
+   struct stat st;
+   void *p;
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) return 0;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX) {
+      close(fd);
+      return 0;
+   }
+   p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd); // the mapping keeps its own reference to the file
+   if (p == MAP_FAILED) return 0;
+   madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+   m->data = (stbi_uc *) p;
+   m->len = (int) st.st_size;
+   return 1;
+#elif defined(STBI_MMAP_WIN32)
+   LARGE_INTEGER size;
+   HANDLE mapping;
+   void *p = NULL;
+   HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (file == INVALID_HANDLE_VALUE) return 0;
+   if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || size.QuadPart > INT_MAX) {
+      CloseHandle(file);
+      return 0;
+   }
+   mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+   CloseHandle(file);
+   if (mapping == NULL) return 0;
+   p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   CloseHandle(mapping); // the view keeps the mapping alive
+   if (p == NULL) return 0;
+   m->data = (stbi_uc *) p;
+   m->len = (int) size.QuadPart;
+   return 1;
+#else
+   STBI_NOTUSED(m);
+   STBI_NOTUSED(filename);
+   return 0;
+#endif
+}
+
+static void stbi_unmap_file(stbi_mapping *m)
+{
+#if defined(STBI_MMAP_POSIX)
+   munmap(m->data, (size_t) m->len);
+#elif defined(STBI_MMAP_WIN32)
+   UnmapViewOfFile(m->data);
+#else
+   STBI_NOTUSED(m);
+#endif
+}
+
 //static void stop_file(stbi *s) { }
 
 #endif // !STBI_NO_STDIO
@@ -481,6 +818,8 @@ static int      stbi_psd_test(stbi *s);
 static stbi_uc *stbi_psd_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_hdr_test(stbi *s);
 static float   *stbi_hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp);
+static unsigned short *stbi_hdr_load_half(stbi *s, int *x, int *y, int *comp, int req_comp);
+static void     stbi_float_to_half(unsigned short *output, float const *input, int count);
 static int      stbi_pic_test(stbi *s);
 static stbi_uc *stbi_pic_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_gif_test(stbi *s);
@@ -488,8 +827,22 @@ static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_gif_info(stbi *s, int *x, int *y, int *comp);
 
 
-// this is not threadsafe
-static const char *failure_reason;
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #else
+      #define STBI_THREAD_LOCAL       // no TLS: failure reasons are shared, last one wins
+      #define STBI_NO_THREAD_LOCAL
+   #endif
+#endif
+
+static STBI_THREAD_LOCAL const char *failure_reason;
 
 const char *stbi_failure_reason(void)
 {
@@ -515,16 +868,17 @@ static int e(const char *str)
 #endif
 
 #define epf(x,y)   ((float *) (e(x,y)?NULL:NULL))
+#define eph(x,y)   ((unsigned short *) (e(x,y)?NULL:NULL))
 #define epuc(x,y)  ((unsigned char *) (e(x,y)?NULL:NULL))
 
 void stbi_image_free(void *retval_from_stbi_load)
 {
-   free(retval_from_stbi_load);
+   stbi_free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_HDR
-static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
-static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp);
+static float   *ldr_to_hdr(stbi *s, stbi_uc *data, int x, int y, int comp);
+static stbi_uc *hdr_to_ldr(stbi *s, float   *data, int x, int y, int comp);
 #endif
 
 static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req_comp)
@@ -539,7 +893,8 @@ static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req
    #ifndef STBI_NO_HDR
    if (stbi_hdr_test(s)) {
       float *hdr = stbi_hdr_load(s, x,y,comp,req_comp);
-      return hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      if (hdr == NULL) return NULL;
+      return hdr_to_ldr(s, hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
 
@@ -552,8 +907,15 @@ static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req
 #ifndef STBI_NO_STDIO
 unsigned char *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+   stbi_mapping m;
+   if (stbi_map_file(&m, filename)) {
+      result = stbi_load_from_memory(m.data, m.len, x,y,comp,req_comp);
+      stbi_unmap_file(&m);
+      return result;
+   }
+   f = fopen(filename, "rb");
    if (!f) return epuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -582,6 +944,25 @@ unsigned char *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *use
    return stbi_load_main(&s,x,y,comp,req_comp);
 }
 
+int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   int w,h,n;
+   size_t size;
+   stbi_uc *data = stbi_load_from_memory(buffer, len, &w, &h, &n, req_comp);
+   if (data == NULL) return 0;
+   size = (size_t) w * h * (req_comp ? req_comp : n);
+   if (size > out_size) {
+      stbi_free(data);
+      return e("buffer too small", "Output buffer too small");
+   }
+   memcpy(out, data, size);
+   stbi_free(data);
+   *x = w;
+   *y = h;
+   *comp = n;
+   return 1;
+}
+
 #ifndef STBI_NO_HDR
 
 float *stbi_loadf_main(stbi *s, int *x, int *y, int *comp, int req_comp)
@@ -593,7 +974,7 @@ float *stbi_loadf_main(stbi *s, int *x, int *y, int *comp, int req_comp)
    #endif
    data = stbi_load_main(s, x, y, comp, req_comp);
    if (data)
-      return ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
+      return ldr_to_hdr(s, data, *x, *y, req_comp ? req_comp : *comp);
    return epf("unknown image type", "Image not of any known type, or corrupt");
 }
 
@@ -614,8 +995,15 @@ float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int
 #ifndef STBI_NO_STDIO
 float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = fopen(filename, "rb");
+   FILE *f;
    float *result;
+   stbi_mapping m;
+   if (stbi_map_file(&m, filename)) {
+      result = stbi_loadf_from_memory(m.data, m.len, x,y,comp,req_comp);
+      stbi_unmap_file(&m);
+      return result;
+   }
+   f = fopen(filename, "rb");
    if (!f) return epf("can't fopen", "Unable to open file");
    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -630,6 +1018,63 @@ float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 }
 #endif // !STBI_NO_STDIO
 
+static unsigned short *stbi_loadh_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   float *data;
+   unsigned short *output;
+   size_t n;
+   if (stbi_hdr_test(s))
+      return stbi_hdr_load_half(s,x,y,comp,req_comp);
+   data = stbi_loadf_main(s,x,y,comp,req_comp);
+   if (data == NULL) return NULL;
+   n = (size_t) *x * *y * (req_comp ? req_comp : *comp);
+   output = (unsigned short *) stbi_malloc(n * sizeof(unsigned short));
+   if (output == NULL) { stbi_free(data); return eph("outofmem", "Out of memory"); }
+   stbi_float_to_half(output, data, (int) n);
+   stbi_free(data);
+   return output;
+}
+
+unsigned short *stbi_loadh_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_loadh_main(&s,x,y,comp,req_comp);
+}
+
+unsigned short *stbi_loadh_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi_loadh_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+unsigned short *stbi_loadh(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   unsigned short *result;
+   stbi_mapping m;
+   if (stbi_map_file(&m, filename)) {
+      result = stbi_loadh_from_memory(m.data, m.len, x,y,comp,req_comp);
+      stbi_unmap_file(&m);
+      return result;
+   }
+   f = fopen(filename, "rb");
+   if (!f) return eph("can't fopen", "Unable to open file");
+   result = stbi_loadh_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+unsigned short *stbi_loadh_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_file(&s,f);
+   return stbi_loadh_main(&s,x,y,comp,req_comp);
+}
+#endif // !STBI_NO_STDIO
+
 #endif // !STBI_NO_HDR
 
 // these is-hdr-or-not is defined independent of whether STBI_NO_HDR is
@@ -685,9 +1130,6 @@ extern int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void *
 }
 
 #ifndef STBI_NO_HDR
-static float h2l_gamma_i=1.0f/2.2f, h2l_scale_i=1.0f;
-static float l2h_gamma=2.2f, l2h_scale=1.0f;
-
 void   stbi_hdr_to_ldr_gamma(float gamma) { h2l_gamma_i = 1/gamma; }
 void   stbi_hdr_to_ldr_scale(float scale) { h2l_scale_i = 1/scale; }
 
@@ -713,8 +1155,11 @@ static void refill_buffer(stbi *s)
    int n = (s->io.read)(s->io_user_data,(char*)s->buffer_start,s->buflen);
    if (n == 0) {
       // at end of file, treat same as if from memory
+      // (a single 0 in our own buffer; img_buffer_end isn't set yet if the
+      // stream was empty from the start)
       s->read_from_callbacks = 0;
-      s->img_buffer = s->img_buffer_end-1;
+      s->img_buffer = s->buffer_start;
+      s->img_buffer_end = s->buffer_start+1;
       *s->img_buffer = 0;
    } else {
       s->img_buffer = s->buffer_start;
@@ -760,7 +1205,11 @@ static void skip(stbi *s, int n)
          return;
       }
    }
-   s->img_buffer += n;
+   // stop at the end, a corrupt length mustn't move us out of the buffer
+   if (n < 0 || n > s->img_buffer_end - s->img_buffer)
+      s->img_buffer = s->img_buffer_end;
+   else
+      s->img_buffer += n;
 }
 
 static int getn(stbi *s, stbi_uc *buffer, int n)
@@ -827,82 +1276,303 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+#ifdef STBI_SIMD_X86
+// SSSE3 versions of the convert_row cases below. They return how many
+// pixels they did, the C code does the rest. Channels are moved with pshufb
+// masks built from the same rules as the cases; luminance is computed for 8
+// pixels at a time in 16-bit lanes, where r*77 + g*150 + b*29 still fits, so
+// the results are exactly those of compute_y.
+typedef int (*convert_run)(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, int x);
+
+// which source channel output channel c comes from, -1 for alpha = 255
+static int convert_source(int img_n, int req_comp, int c)
+{
+   if (req_comp <= 2)
+      return c == 0 ? 0 : img_n == 2 ? 1 : -1;
+   if (c < 3)
+      return img_n <= 2 ? 0 : c;
+   return img_n == 2 || img_n == 4 ? img_n-1 : -1;
+}
+
+STBI_TARGET("ssse3") static int convert_luma_ssse3(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, int x)
+{
+   // 8 pixels from two loads, the second one 'off' bytes in
+   STBI_SIMD_ALIGN(uint8, lo[4][16]);
+   STBI_SIMD_ALIGN(uint8, hi[4][16]);
+   __m128i m_lo[4], m_hi[4], ch[4];
+   __m128i wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29);
+   int off = 8*img_n - 16, c, p, i;
+   for (c=0; c < 4; ++c) {
+      for (p=0; p < 8; ++p) {
+         int pos = p*img_n + c;
+         int first = p*img_n + img_n-1 <= 15;
+         lo[c][2*p] = first ? (uint8) pos : 0x80;
+         hi[c][2*p] = first ? 0x80 : (uint8) (pos - off);
+         lo[c][2*p+1] = hi[c][2*p+1] = 0x80;
+      }
+      m_lo[c] = _mm_load_si128((__m128i const *) lo[c]);
+      m_hi[c] = _mm_load_si128((__m128i const *) hi[c]);
+   }
+   ch[3] = _mm_set1_epi16(255);
+   for (i=0; i+8 <= x; i += 8, src += 8*img_n, dest += 8*req_comp) {
+      __m128i l0 = _mm_loadu_si128((__m128i const *) src);
+      __m128i l1 = _mm_loadu_si128((__m128i const *) (src + off));
+      __m128i y;
+      for (c=0; c < (img_n == 4 && req_comp == 2 ? 4 : 3); ++c)
+         ch[c] = _mm_or_si128(_mm_shuffle_epi8(l0, m_lo[c]), _mm_shuffle_epi8(l1, m_hi[c]));
+      y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(ch[0], wr), _mm_mullo_epi16(ch[1], wg)), _mm_mullo_epi16(ch[2], wb));
+      y = _mm_srli_epi16(y, 8);
+      if (req_comp == 2)
+         _mm_storeu_si128((__m128i *) dest, _mm_or_si128(y, _mm_slli_epi16(ch[3], 8)));
+      else
+         _mm_storel_epi64((__m128i *) dest, _mm_packus_epi16(y, y));
+   }
+   return i;
+}
+
+STBI_TARGET("ssse3") static int convert_row_ssse3(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, int x)
+{
+   // 'step' pixels per 16-byte load, written as 'chunks' 16-byte stores;
+   // bytes past the step's pixels are junk that the next step overwrites
+   STBI_SIMD_ALIGN(uint8, shuf[4][16]);
+   STBI_SIMD_ALIGN(uint8, fill[4][16]);
+   __m128i m[4], f[4];
+   int step = 16 / img_n, chunks, i, k, j;
+   if (img_n >= 3 && req_comp <= 2)
+      return convert_luma_ssse3(dest, src, img_n, req_comp, x);
+   chunks = (step*req_comp + 15) / 16;
+   if (chunks > 1 && step*req_comp % 16) {
+      // a last store that's mostly junk isn't worth it
+      --chunks;
+      step = 16*chunks / req_comp;
+   }
+   for (k=0; k < chunks; ++k) {
+      for (j=0; j < 16; ++j) {
+         int o = 16*k + j, p = o / req_comp, c = o % req_comp;
+         int from = p < step ? convert_source(img_n, req_comp, c) : -2;
+         shuf[k][j] = from >= 0 ? (uint8) (p*img_n + from) : 0x80;
+         fill[k][j] = from == -1 ? 255 : 0;
+      }
+      m[k] = _mm_load_si128((__m128i const *) shuf[k]);
+      f[k] = _mm_load_si128((__m128i const *) fill[k]);
+   }
+   for (i=0; (x-i)*img_n >= 16 && (x-i)*req_comp >= 16*chunks; i += step) {
+      __m128i v = _mm_loadu_si128((__m128i const *) (src + i*img_n));
+      for (k=0; k < chunks; ++k)
+         _mm_storeu_si128((__m128i *) (dest + i*req_comp + 16*k), _mm_or_si128(_mm_shuffle_epi8(v, m[k]), f[k]));
+   }
+   return i;
+}
+
+static convert_run convert_row_installed = (stbi_cpu_features() & STBI_CPU_SSSE3) ? convert_row_ssse3 : NULL;
+#endif // STBI_SIMD_X86
+
+// convert one scanline of x pixels; like the C loops, the SIMD ones do
+// nothing for an x that's negative as an int
+static void convert_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, int x)
+{
+   int i;
+   #ifdef STBI_SIMD_X86
+   if (convert_row_installed) {
+      int done = convert_row_installed(dest, src, img_n, req_comp, x);
+      dest += done * req_comp;
+      src += done * img_n;
+      x -= done;
+   }
+   #endif
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+   #undef COMBO
+}
+
 static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
    assert(req_comp >= 1 && req_comp <= 4);
 
-   good = (unsigned char *) malloc(req_comp * x * y);
+   // req_comp * x * y has to fit in an int, as the row offsets below assume
+   if (x && (1 << 28) / x < y) {
+      stbi_free(data);
+      return epuc("too large", "Image too large to decode");
+   }
+   good = (unsigned char *) stbi_malloc((size_t) req_comp * x * y);
    if (good == NULL) {
-      free(data);
+      stbi_free(data);
       return epuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: assert(0);
-      }
-      #undef CASE
-   }
+   for (j=0; j < (int) y; ++j)
+      convert_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x);
 
-   free(data);
+   stbi_free(data);
    return good;
 }
 
 #ifndef STBI_NO_HDR
-static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+// Both conversions go through tables built for the current gamma and scale,
+// kept per thread and only rebuilt when those change (without TLS they're
+// built for every image). ldr_to_hdr has only 256 inputs, so its table is
+// simply every result. For hdr_to_ldr the table holds the smallest float
+// that gives each 8-bit code, which is found by bisecting the float bit
+// patterns with the original pow() formula; a value's code is then the
+// number of thresholds at or below it, found from a starting code per
+// range of float bits and a short walk up. The results are the same as
+// calling pow() per channel, as long as pow is monotonic.
+typedef struct
 {
+   int valid;
+   float gamma, scale;
+   float color[256], alpha[256];
+} ldr_to_hdr_table;
+
+#define STBI_H2L_BUCKET_SHIFT  18 // float bits >> this picks a starting code
+
+typedef struct
+{
+   int valid;
+   float gamma_i, scale_i;
+   float threshold[257];         // 1..255 used, 256 is a NaN that stops the walk
+   uint8 start[1 << (31 - STBI_H2L_BUCKET_SHIFT)];
+} hdr_to_ldr_table;
+
+static void ldr_to_hdr_build(ldr_to_hdr_table *t, float gamma, float scale)
+{
+   int i;
+   for (i=0; i < 256; ++i) {
+      t->color[i] = (float) pow(i/255.0f, gamma) * scale;
+      t->alpha[i] = i/255.0f;
+   }
+   t->gamma = gamma;
+   t->scale = scale;
+   t->valid = 1;
+}
+
+static float   *ldr_to_hdr(stbi *s, stbi_uc *data, int x, int y, int comp)
+{
+   #ifdef STBI_NO_THREAD_LOCAL
+   ldr_to_hdr_table cache;
+   cache.valid = 0;
+   #else
+   static STBI_THREAD_LOCAL ldr_to_hdr_table cache;
+   #endif
    int i,k,n;
-   float *output = (float *) malloc(x * y * comp * sizeof(float));
-   if (output == NULL) { free(data); return epf("outofmem", "Out of memory"); }
+   float *output = (float *) stbi_malloc(x * y * comp * sizeof(float));
+   if (output == NULL) { stbi_free(data); return epf("outofmem", "Out of memory"); }
+   if (!cache.valid || cache.gamma != s->l2h_gamma || cache.scale != s->l2h_scale)
+      ldr_to_hdr_build(&cache, s->l2h_gamma, s->l2h_scale);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) pow(data[i*comp+k]/255.0f, l2h_gamma) * l2h_scale;
+         output[i*comp + k] = cache.color[data[i*comp+k]];
       }
-      if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+      if (k < comp) output[i*comp + k] = cache.alpha[data[i*comp+k]];
    }
-   free(data);
+   stbi_free(data);
    return output;
 }
 
 #define float2int(x)   ((int) (x))
-static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
+
+// the original per-channel formula, also used with settings that make it
+// not monotonic (gamma or scale not positive)
+static uint8 hdr_to_ldr_pow(float v, float gamma_i, float scale_i)
 {
+   float z = (float) pow(v*scale_i, gamma_i) * 255 + 0.5f;
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return (uint8) float2int(z);
+}
+
+static float hdr_float_from_bits(uint32 bits)
+{
+   float f;
+   memcpy(&f, &bits, 4);
+   return f;
+}
+
+static void hdr_to_ldr_build(hdr_to_ldr_table *t, float gamma_i, float scale_i)
+{
+   uint32 lo = 0, b;
+   int k = 1;
+   t->threshold[0] = 0;
+   for (; k < 256; ++k) {
+      // smallest non-negative float giving code k or more; +inf gives 255
+      uint32 hi = 0x7f800000;
+      while (lo < hi) {
+         uint32 mid = lo + (hi - lo) / 2;
+         if (hdr_to_ldr_pow(hdr_float_from_bits(mid), gamma_i, scale_i) >= k)
+            hi = mid;
+         else
+            lo = mid + 1;
+      }
+      t->threshold[k] = hdr_float_from_bits(lo);
+   }
+   t->threshold[256] = hdr_float_from_bits(0x7fc00000);
+   for (b=0, k=0; b < (uint32) sizeof(t->start); ++b) {
+      float v = hdr_float_from_bits(b << STBI_H2L_BUCKET_SHIFT);
+      while (k < 255 && v >= t->threshold[k+1]) ++k;
+      t->start[b] = (uint8) k;
+   }
+   t->gamma_i = gamma_i;
+   t->scale_i = scale_i;
+   t->valid = 1;
+}
+
+static stbi_inline uint8 hdr_to_ldr_code(hdr_to_ldr_table const *t, float v)
+{
+   uint32 bits;
+   int code;
+   memcpy(&bits, &v, 4);
+   if (bits > 0x7f800000) return 0; // negative or NaN; pow() gave NaN, which came out as 0
+   code = t->start[bits >> STBI_H2L_BUCKET_SHIFT];
+   while (v >= t->threshold[code+1]) ++code;
+   return (uint8) code;
+}
+
+static stbi_uc *hdr_to_ldr(stbi *s, float   *data, int x, int y, int comp)
+{
+   #ifdef STBI_NO_THREAD_LOCAL
+   hdr_to_ldr_table cache;
+   cache.valid = 0;
+   #else
+   static STBI_THREAD_LOCAL hdr_to_ldr_table cache;
+   #endif
    int i,k,n;
-   stbi_uc *output = (stbi_uc *) malloc(x * y * comp);
-   if (output == NULL) { free(data); return epuc("outofmem", "Out of memory"); }
+   int use_table = s->h2l_gamma_i > 0 && s->h2l_scale_i > 0;
+   stbi_uc *output = (stbi_uc *) stbi_malloc(x * y * comp);
+   if (output == NULL) { stbi_free(data); return epuc("outofmem", "Out of memory"); }
+   if (use_table && (!cache.valid || cache.gamma_i != s->h2l_gamma_i || cache.scale_i != s->h2l_scale_i))
+      hdr_to_ldr_build(&cache, s->h2l_gamma_i, s->h2l_scale_i);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*h2l_scale_i, h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (uint8) float2int(z);
+         if (use_table)
+            output[i*comp + k] = hdr_to_ldr_code(&cache, data[i*comp+k]);
+         else
+            output[i*comp + k] = hdr_to_ldr_pow(data[i*comp+k], s->h2l_gamma_i, s->h2l_scale_i);
       }
       if (k < comp) {
          float z = data[i*comp+k] * 255 + 0.5f;
@@ -911,7 +1581,7 @@ static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (uint8) float2int(z);
       }
    }
-   free(data);
+   stbi_free(data);
    return output;
 }
 #endif
@@ -961,10 +1631,13 @@ typedef struct
 {
    #ifdef STBI_SIMD
    unsigned short dequant2[4][64];
+   stbi_idct_8x8 idct;           // copies of the installed kernels
+   stbi_YCbCr_to_RGB_run YCbCr;
    #endif
    stbi *s;
    huffman huff_dc[4];
    huffman huff_ac[4];
+   int16 fast_ac[4][1 << FAST_BITS];
    uint8 dequant[4][64];
 
 // sizes for components, interleaved MCUs
@@ -987,13 +1660,15 @@ typedef struct
       uint8 *linebuf;
    } img_comp[4];
 
-   uint32         code_buffer; // jpeg entropy-coded buffer
+   uint64         code_buffer; // jpeg entropy-coded buffer, msb first
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
 
    int scan_n, order[4];
    int restart_interval, todo;
+
+   int scale_shift;  // log2 of the downscale factor, 0..3
 } jpeg;
 
 static int build_huffman(huffman *h, int *count)
@@ -1037,21 +1712,69 @@ static int build_huffman(huffman *h, int *count)
    return 1;
 }
 
+// build a table that decodes an AC symbol and its extra bits in one lookup:
+// for codes where huffman length + magnitude bits <= FAST_BITS, the entry is
+// (value << 8) + (run << 4) + combined length, and 0 where that doesn't fit
+static void build_fast_ac(int16 *fast_ac, huffman *h)
+{
+   int i;
+   for (i=0; i < (1 << FAST_BITS); ++i) {
+      uint8 fast = h->fast[i];
+      fast_ac[i] = 0;
+      if (fast < 255) {
+         int rs = h->values[fast];
+         int run = (rs >> 4) & 15;
+         int magbits = rs & 15;
+         int len = h->size[fast];
+
+         if (magbits && len + magbits <= FAST_BITS) {
+            // same sign extension as extend_receive
+            int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
+            int m = 1 << (magbits - 1);
+            if (k < m) k -= (1 << magbits) - 1;
+            // the value has to fit in the top 8 bits
+            if (k >= -128 && k <= 127)
+               fast_ac[i] = (int16) (k * 256 + run * 16 + (len + magbits));
+         }
+      }
+   }
+}
+
+// fill the bit buffer to more than 56 bits. Runs of data without 0xff (so
+// no stuffed bytes and no markers) are loaded up to 8 bytes at a time;
+// everything else goes through the bytewise path.
 static void grow_buffer_unsafe(jpeg *j)
 {
+   stbi *s = j->s;
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+      uint8 *p = s->img_buffer;
+      int n = (64 - j->code_bits) >> 3; // whole bytes that fit
+      uint64 w = ((uint64) p[0] << 56) | ((uint64) p[1] << 48) | ((uint64) p[2] << 40) | ((uint64) p[3] << 32) |
+                 ((uint64) p[4] << 24) | ((uint64) p[5] << 16) | ((uint64) p[6] <<  8) |  (uint64) p[7];
+      // flag bytes of ~w that are zero, i.e. 0xff bytes of w. Can also flag
+      // bytes above a real one, which only sends us down the slow path.
+      uint64 x = ~w;
+      uint64 ff = (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+      if ((ff >> (64 - 8*n)) == 0) {
+         j->code_buffer |= (w >> (64 - 8*n)) << (64 - 8*n - j->code_bits);
+         j->code_bits += 8*n;
+         s->img_buffer += n;
+         return;
+      }
+   }
    do {
-      int b = j->nomore ? 0 : get8(j->s);
+      int b = j->nomore ? 0 : get8(s);
       if (b == 0xff) {
-         int c = get8(j->s);
+         int c = get8(s);
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
 // (1 << n) - 1
@@ -1067,7 +1790,7 @@ stbi_inline static int decode(jpeg *j, huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -1084,7 +1807,7 @@ stbi_inline static int decode(jpeg *j, huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -1098,8 +1821,8 @@ stbi_inline static int decode(jpeg *j, huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & bmask[k]) + h->delta[k];
-   assert((((j->code_buffer) >> (32 - h->size[c])) & bmask[h->size[c]]) == h->code[c]);
+   c = (int) ((j->code_buffer >> (64 - k)) & bmask[k]) + h->delta[k];
+   assert((((j->code_buffer) >> (64 - h->size[c])) & bmask[h->size[c]]) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -1115,21 +1838,14 @@ stbi_inline static int extend_receive(jpeg *j, int n)
    unsigned int k;
    if (j->code_bits < n) grow_buffer_unsafe(j);
 
-   #if 1
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~bmask[n];
-   k &= bmask[n];
-   j->code_bits -= n;
-   #else
-   k = (j->code_buffer >> (32 - n)) & bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n)) & bmask[n];
    j->code_bits -= n;
    j->code_buffer <<= n;
-   #endif
    // the following test is probably a random branch that won't
    // predict well. I tried to table accelerate it but failed.
    // maybe it's compiling as a conditional move?
    if (k < m)
-      return (-1 << n) + k + 1;
+      return (int) k - (1 << n) + 1; // shifting -1 would be undefined
    else
       return k;
 }
@@ -1152,11 +1868,11 @@ static uint8 dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int b)
+static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int16 *fac, int b)
 {
    int diff,dc,k;
    int t = decode(j, hdc);
-   if (t < 0) return e("bad huffman code","Corrupt JPEG");
+   if (t < 0 || t > 16) return e("bad huffman code","Corrupt JPEG");
 
    // 0 all the ac values now so we can do it 32-bits at a time
    memset(data,0,64*sizeof(data[0]));
@@ -1169,8 +1885,19 @@ static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int
    // decode AC components, see JPEG spec
    k = 1;
    do {
-      int r,s;
-      int rs = decode(j, hac);
+      int r,s,rs;
+      if (j->code_bits < 16) grow_buffer_unsafe(j);
+      // short code with a small value: symbol and extra bits in one go
+      r = fac[j->code_buffer >> (64 - FAST_BITS)];
+      if (r && (r & 15) <= j->code_bits) {
+         k += (r >> 4) & 15; // run
+         s = r & 15;         // combined length
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+         data[dezigzag[k++]] = (short) (r >> 8);
+         continue;
+      }
+      rs = decode(j, hac);
       if (rs < 0) return e("bad huffman code","Corrupt JPEG");
       s = rs & 15;
       r = rs >> 4;
@@ -1198,7 +1925,7 @@ stbi_inline static uint8 clamp(int x)
 }
 
 #define f2f(x)  (int) (((x) * 4096 + 0.5))
-#define fsh(x)  ((x) << 12)
+#define fsh(x)  ((x) * 4096)
 
 // derived from jidctint -- DCT_ISLOW
 #define IDCT_1D(s0,s1,s2,s3,s4,s5,s6,s7)       \
@@ -1261,7 +1988,7 @@ static void idct_block(uint8 *out, int out_stride, short data[64], stbi_dequanti
          //    (1|2|3|4|5|6|7)==0          0     seconds
          //    all separate               -0.047 seconds
          //    1 && 2|3 && 4|5 && 6|7:    -0.047 seconds
-         int dcterm = d[0] * dq[0] << 2;
+         int dcterm = d[0] * dq[0] * 4;
          v[0] = v[8] = v[16] = v[24] = v[32] = v[40] = v[48] = v[56] = dcterm;
       } else {
          IDCT_1D(d[ 0]*dq[ 0],d[ 8]*dq[ 8],d[16]*dq[16],d[24]*dq[24],
@@ -1306,8 +2033,385 @@ static void idct_block(uint8 *out, int out_stride, short data[64], stbi_dequanti
    }
 }
 
+// reduced-size IDCTs for downscaled decoding. An NxN output block (N = 4, 2
+// or 1) is the N-point IDCT of the NxN lowest-frequency coefficients, using
+// the same normalization as the 8-point one, which comes out as close to the
+// average of each (8/N)x(8/N) group of full-size pixels.
+static void idct_reduced(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dq, int shift)
+{
+   if (shift == 3) {
+      // the DC term alone; identical to what idct_block gives a flat block
+      out[0] = clamp(((data[0]*dq[0] + 4) >> 3) + 128);
+   } else if (shift == 2) {
+      // the 2-point IDCT is just sum and difference
+      int a = data[0]*dq[0], b = data[1]*dq[1];
+      int c = data[8]*dq[8], d = data[9]*dq[9];
+      out[0]            = clamp(((a+b+c+d + 4) >> 3) + 128);
+      out[1]            = clamp(((a-b+c-d + 4) >> 3) + 128);
+      out[out_stride]   = clamp(((a+b-c-d + 4) >> 3) + 128);
+      out[out_stride+1] = clamp(((a-b-c+d + 4) >> 3) + 128);
+   } else {
+      int i,val[16],*v=val;
+      int e0,e1,o0,o1;
+      short *d = data;
+      uint8 *o;
+
+      // columns, keeping 2 extra bits like idct_block
+      for (i=0; i < 4; ++i, ++d, ++dq, ++v) {
+         if (d[8]==0 && d[16]==0 && d[24]==0) {
+            v[0] = v[4] = v[8] = v[12] = d[0] * dq[0] * 4;
+            continue;
+         }
+         e0 = fsh(d[0]*dq[0] + d[16]*dq[16]);
+         e1 = fsh(d[0]*dq[0] - d[16]*dq[16]);
+         o0 = d[8]*dq[8] * f2f(1.306562965f) + d[24]*dq[24] * f2f( 0.541196100f);
+         o1 = d[8]*dq[8] * f2f(0.541196100f) + d[24]*dq[24] * f2f(-1.306562965f);
+         e0 += 512; e1 += 512;
+         v[ 0] = (e0+o0) >> 10;
+         v[12] = (e0-o0) >> 10;
+         v[ 4] = (e1+o1) >> 10;
+         v[ 8] = (e1-o1) >> 10;
+      }
+
+      // rows: 1<<12 from the constants, 1<<2 from above and 1<<3 for the
+      // 2D normalization, then the +128 level shift, as in idct_block
+      for (i=0, v=val, o=out; i < 4; ++i, v+=4, o+=out_stride) {
+         e0 = fsh(v[0] + v[2]);
+         e1 = fsh(v[0] - v[2]);
+         o0 = v[1] * f2f(1.306562965f) + v[3] * f2f( 0.541196100f);
+         o1 = v[1] * f2f(0.541196100f) + v[3] * f2f(-1.306562965f);
+         e0 += 65536 + (128<<17);
+         e1 += 65536 + (128<<17);
+         o[0] = clamp((e0+o0) >> 17);
+         o[3] = clamp((e0-o0) >> 17);
+         o[1] = clamp((e1+o1) >> 17);
+         o[2] = clamp((e1-o1) >> 17);
+      }
+   }
+}
+
 #ifdef STBI_SIMD
-static stbi_idct_8x8 stbi_idct_installed = idct_block;
+// The SIMD IDCTs run the same 32-bit integer math as idct_block, with one
+// lane per column in the first pass and one lane per row in the second, so
+// every intermediate value (including wraparound on garbage input) matches.
+// V_ADD, V_SUB, V_MULC and V_SHL12 are defined per instruction set.
+#define IDCT_1D_V(s0,s1,s2,s3,s4,s5,s6,s7)                 \
+   p2 = s2;                                                \
+   p3 = s6;                                                \
+   p1 = V_MULC(V_ADD(p2,p3), f2f(0.5411961f));             \
+   t2 = V_ADD(p1, V_MULC(p3, f2f(-1.847759065f)));         \
+   t3 = V_ADD(p1, V_MULC(p2, f2f( 0.765366865f)));         \
+   p2 = s0;                                                \
+   p3 = s4;                                                \
+   t0 = V_SHL12(V_ADD(p2,p3));                             \
+   t1 = V_SHL12(V_SUB(p2,p3));                             \
+   x0 = V_ADD(t0,t3);                                      \
+   x3 = V_SUB(t0,t3);                                      \
+   x1 = V_ADD(t1,t2);                                      \
+   x2 = V_SUB(t1,t2);                                      \
+   t0 = s7;                                                \
+   t1 = s5;                                                \
+   t2 = s3;                                                \
+   t3 = s1;                                                \
+   p3 = V_ADD(t0,t2);                                      \
+   p4 = V_ADD(t1,t3);                                      \
+   p1 = V_ADD(t0,t3);                                      \
+   p2 = V_ADD(t1,t2);                                      \
+   p5 = V_MULC(V_ADD(p3,p4), f2f( 1.175875602f));          \
+   t0 = V_MULC(t0, f2f( 0.298631336f));                    \
+   t1 = V_MULC(t1, f2f( 2.053119869f));                    \
+   t2 = V_MULC(t2, f2f( 3.072711026f));                    \
+   t3 = V_MULC(t3, f2f( 1.501321110f));                    \
+   p1 = V_ADD(p5, V_MULC(p1, f2f(-0.899976223f)));         \
+   p2 = V_ADD(p5, V_MULC(p2, f2f(-2.562915447f)));         \
+   p3 = V_MULC(p3, f2f(-1.961570560f));                    \
+   p4 = V_MULC(p4, f2f(-0.390180644f));                    \
+   t3 = V_ADD(t3, V_ADD(p1,p4));                           \
+   t2 = V_ADD(t2, V_ADD(p2,p3));                           \
+   t1 = V_ADD(t1, V_ADD(p2,p4));                           \
+   t0 = V_ADD(t0, V_ADD(p1,p3));
+
+#ifdef STBI_SIMD_X86
+
+#define STBI_TRANSPOSE4_EPI32(r0,r1,r2,r3)                 \
+   {                                                       \
+      __m128i u0 = _mm_unpacklo_epi32(r0,r1);              \
+      __m128i u1 = _mm_unpacklo_epi32(r2,r3);              \
+      __m128i u2 = _mm_unpackhi_epi32(r0,r1);              \
+      __m128i u3 = _mm_unpackhi_epi32(r2,r3);              \
+      r0 = _mm_unpacklo_epi64(u0,u1);                      \
+      r1 = _mm_unpackhi_epi64(u0,u1);                      \
+      r2 = _mm_unpacklo_epi64(u2,u3);                      \
+      r3 = _mm_unpackhi_epi64(u2,u3);                      \
+   }
+
+// SSE2 has no 32-bit multiply-low; the low half of the unsigned products is the same
+STBI_TARGET("sse2") stbi_inline static __m128i mullo_sse2(__m128i a, __m128i b)
+{
+   __m128i even = _mm_mul_epu32(a, b);
+   __m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+   return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                             _mm_shuffle_epi32(odd,  _MM_SHUFFLE(0,0,2,0)));
+}
+
+#define V_ADD(a,b)   _mm_add_epi32(a,b)
+#define V_SUB(a,b)   _mm_sub_epi32(a,b)
+#define V_MULC(a,c)  mullo_sse2(a, _mm_set1_epi32(c))
+#define V_SHL12(a)   _mm_slli_epi32(a,12)
+
+STBI_TARGET("sse2") static void idct_sse2(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   __m128i v[8][2], c[8];
+   __m128i t0,t1,t2,t3,p1,p2,p3,p4,p5,x0,x1,x2,x3;
+   __m128i zero = _mm_setzero_si128();
+   __m128i rows = zero;
+   int i,h;
+
+   // columns, four at a time. d*dq is formed in 32 bits like the C code.
+   __m128i s[8][2];
+   for (i=0; i < 8; ++i) {
+      __m128i d  = _mm_loadu_si128((__m128i *) (data + i*8));
+      __m128i dq = _mm_loadu_si128((__m128i *) (dequantize + i*8));
+      s[i][0] = mullo_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(d,d), 16), _mm_unpacklo_epi16(dq,zero));
+      s[i][1] = mullo_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(d,d), 16), _mm_unpackhi_epi16(dq,zero));
+      if (i) rows = _mm_or_si128(rows, d);
+   }
+   // columns with only a DC term take idct_block's shortcut
+   rows = _mm_cmpeq_epi16(rows, zero);
+   for (h=0; h < 2; ++h) {
+      __m128i dconly = h ? _mm_unpackhi_epi16(rows,rows) : _mm_unpacklo_epi16(rows,rows);
+      __m128i dcterm = _mm_slli_epi32(s[0][h], 2);
+      __m128i bias = _mm_set1_epi32(512);
+      IDCT_1D_V(s[0][h],s[1][h],s[2][h],s[3][h],s[4][h],s[5][h],s[6][h],s[7][h])
+      x0 = V_ADD(x0,bias); x1 = V_ADD(x1,bias); x2 = V_ADD(x2,bias); x3 = V_ADD(x3,bias);
+      #define STBI_COL(r,e) v[r][h] = _mm_or_si128(_mm_and_si128(dconly, dcterm), _mm_andnot_si128(dconly, _mm_srai_epi32(e,10)))
+      STBI_COL(0, V_ADD(x0,t3));
+      STBI_COL(7, V_SUB(x0,t3));
+      STBI_COL(1, V_ADD(x1,t2));
+      STBI_COL(6, V_SUB(x1,t2));
+      STBI_COL(2, V_ADD(x2,t1));
+      STBI_COL(5, V_SUB(x2,t1));
+      STBI_COL(3, V_ADD(x3,t0));
+      STBI_COL(4, V_SUB(x3,t0));
+      #undef STBI_COL
+   }
+
+   // rows, four at a time: transpose so each lane holds one row
+   for (h=0; h < 2; ++h) {
+      __m128i bias = _mm_set1_epi32(65536 + (128<<17));
+      __m128i o[8];
+      for (i=0; i < 8; i += 4) {
+         c[i+0] = v[h*4+0][i>>2];
+         c[i+1] = v[h*4+1][i>>2];
+         c[i+2] = v[h*4+2][i>>2];
+         c[i+3] = v[h*4+3][i>>2];
+         STBI_TRANSPOSE4_EPI32(c[i+0],c[i+1],c[i+2],c[i+3])
+      }
+      IDCT_1D_V(c[0],c[1],c[2],c[3],c[4],c[5],c[6],c[7])
+      x0 = V_ADD(x0,bias); x1 = V_ADD(x1,bias); x2 = V_ADD(x2,bias); x3 = V_ADD(x3,bias);
+      o[0] = _mm_srai_epi32(V_ADD(x0,t3), 17);
+      o[7] = _mm_srai_epi32(V_SUB(x0,t3), 17);
+      o[1] = _mm_srai_epi32(V_ADD(x1,t2), 17);
+      o[6] = _mm_srai_epi32(V_SUB(x1,t2), 17);
+      o[2] = _mm_srai_epi32(V_ADD(x2,t1), 17);
+      o[5] = _mm_srai_epi32(V_SUB(x2,t1), 17);
+      o[3] = _mm_srai_epi32(V_ADD(x3,t0), 17);
+      o[4] = _mm_srai_epi32(V_SUB(x3,t0), 17);
+      // back to one register per row; the saturating packs are the clamp
+      STBI_TRANSPOSE4_EPI32(o[0],o[1],o[2],o[3])
+      STBI_TRANSPOSE4_EPI32(o[4],o[5],o[6],o[7])
+      for (i=0; i < 4; ++i) {
+         __m128i p = _mm_packs_epi32(o[i], o[i+4]);
+         _mm_storel_epi64((__m128i *) (out + (h*4+i)*out_stride), _mm_packus_epi16(p,p));
+      }
+   }
+}
+
+#undef V_ADD
+#undef V_SUB
+#undef V_MULC
+#undef V_SHL12
+
+#define V_ADD(a,b)   _mm256_add_epi32(a,b)
+#define V_SUB(a,b)   _mm256_sub_epi32(a,b)
+#define V_MULC(a,c)  _mm256_mullo_epi32(a, _mm256_set1_epi32(c))
+#define V_SHL12(a)   _mm256_slli_epi32(a,12)
+
+#define STBI_TRANSPOSE8_EPI32(r)                                                           \
+   {                                                                                       \
+      __m256i a0 = _mm256_unpacklo_epi32(r[0],r[1]), a1 = _mm256_unpackhi_epi32(r[0],r[1]); \
+      __m256i a2 = _mm256_unpacklo_epi32(r[2],r[3]), a3 = _mm256_unpackhi_epi32(r[2],r[3]); \
+      __m256i a4 = _mm256_unpacklo_epi32(r[4],r[5]), a5 = _mm256_unpackhi_epi32(r[4],r[5]); \
+      __m256i a6 = _mm256_unpacklo_epi32(r[6],r[7]), a7 = _mm256_unpackhi_epi32(r[6],r[7]); \
+      __m256i b0 = _mm256_unpacklo_epi64(a0,a2), b1 = _mm256_unpackhi_epi64(a0,a2);         \
+      __m256i b2 = _mm256_unpacklo_epi64(a1,a3), b3 = _mm256_unpackhi_epi64(a1,a3);         \
+      __m256i b4 = _mm256_unpacklo_epi64(a4,a6), b5 = _mm256_unpackhi_epi64(a4,a6);         \
+      __m256i b6 = _mm256_unpacklo_epi64(a5,a7), b7 = _mm256_unpackhi_epi64(a5,a7);         \
+      r[0] = _mm256_permute2x128_si256(b0,b4,0x20); r[4] = _mm256_permute2x128_si256(b0,b4,0x31); \
+      r[1] = _mm256_permute2x128_si256(b1,b5,0x20); r[5] = _mm256_permute2x128_si256(b1,b5,0x31); \
+      r[2] = _mm256_permute2x128_si256(b2,b6,0x20); r[6] = _mm256_permute2x128_si256(b2,b6,0x31); \
+      r[3] = _mm256_permute2x128_si256(b3,b7,0x20); r[7] = _mm256_permute2x128_si256(b3,b7,0x31); \
+   }
+
+STBI_TARGET("avx2") static void idct_avx2(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   __m256i s[8], v[8];
+   __m256i t0,t1,t2,t3,p1,p2,p3,p4,p5,x0,x1,x2,x3;
+   __m128i zero = _mm_setzero_si128();
+   __m128i rows = zero;
+   __m256i dconly, dcterm, bias;
+   int i;
+
+   // columns, all eight at once
+   for (i=0; i < 8; ++i) {
+      __m128i d  = _mm_loadu_si128((__m128i *) (data + i*8));
+      __m128i dq = _mm_loadu_si128((__m128i *) (dequantize + i*8));
+      s[i] = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(d), _mm256_cvtepu16_epi32(dq));
+      if (i) rows = _mm_or_si128(rows, d);
+   }
+   dconly = _mm256_cvtepi16_epi32(_mm_cmpeq_epi16(rows, zero));
+   dcterm = _mm256_slli_epi32(s[0], 2);
+   bias = _mm256_set1_epi32(512);
+   IDCT_1D_V(s[0],s[1],s[2],s[3],s[4],s[5],s[6],s[7])
+   x0 = V_ADD(x0,bias); x1 = V_ADD(x1,bias); x2 = V_ADD(x2,bias); x3 = V_ADD(x3,bias);
+   #define STBI_COL(r,e) v[r] = _mm256_blendv_epi8(_mm256_srai_epi32(e,10), dcterm, dconly)
+   STBI_COL(0, V_ADD(x0,t3));
+   STBI_COL(7, V_SUB(x0,t3));
+   STBI_COL(1, V_ADD(x1,t2));
+   STBI_COL(6, V_SUB(x1,t2));
+   STBI_COL(2, V_ADD(x2,t1));
+   STBI_COL(5, V_SUB(x2,t1));
+   STBI_COL(3, V_ADD(x3,t0));
+   STBI_COL(4, V_SUB(x3,t0));
+   #undef STBI_COL
+
+   // rows, all eight at once
+   STBI_TRANSPOSE8_EPI32(v)
+   bias = _mm256_set1_epi32(65536 + (128<<17));
+   IDCT_1D_V(v[0],v[1],v[2],v[3],v[4],v[5],v[6],v[7])
+   x0 = V_ADD(x0,bias); x1 = V_ADD(x1,bias); x2 = V_ADD(x2,bias); x3 = V_ADD(x3,bias);
+   s[0] = _mm256_srai_epi32(V_ADD(x0,t3), 17);
+   s[7] = _mm256_srai_epi32(V_SUB(x0,t3), 17);
+   s[1] = _mm256_srai_epi32(V_ADD(x1,t2), 17);
+   s[6] = _mm256_srai_epi32(V_SUB(x1,t2), 17);
+   s[2] = _mm256_srai_epi32(V_ADD(x2,t1), 17);
+   s[5] = _mm256_srai_epi32(V_SUB(x2,t1), 17);
+   s[3] = _mm256_srai_epi32(V_ADD(x3,t0), 17);
+   s[4] = _mm256_srai_epi32(V_SUB(x3,t0), 17);
+   STBI_TRANSPOSE8_EPI32(s)
+   for (i=0; i < 8; ++i) {
+      __m128i p = _mm_packs_epi32(_mm256_castsi256_si128(s[i]), _mm256_extracti128_si256(s[i], 1));
+      _mm_storel_epi64((__m128i *) (out + i*out_stride), _mm_packus_epi16(p,p));
+   }
+}
+
+#undef V_ADD
+#undef V_SUB
+#undef V_MULC
+#undef V_SHL12
+#endif // STBI_SIMD_X86
+
+#ifdef STBI_SIMD_NEON
+#define V_ADD(a,b)   vaddq_s32(a,b)
+#define V_SUB(a,b)   vsubq_s32(a,b)
+#define V_MULC(a,c)  vmulq_n_s32(a,c)
+#define V_SHL12(a)   vshlq_n_s32(a,12)
+
+#define STBI_TRANSPOSE4_S32(r0,r1,r2,r3)                                            \
+   {                                                                                \
+      int32x4x2_t u01 = vtrnq_s32(r0,r1);                                           \
+      int32x4x2_t u23 = vtrnq_s32(r2,r3);                                           \
+      r0 = vcombine_s32(vget_low_s32 (u01.val[0]), vget_low_s32 (u23.val[0]));      \
+      r1 = vcombine_s32(vget_low_s32 (u01.val[1]), vget_low_s32 (u23.val[1]));      \
+      r2 = vcombine_s32(vget_high_s32(u01.val[0]), vget_high_s32(u23.val[0]));      \
+      r3 = vcombine_s32(vget_high_s32(u01.val[1]), vget_high_s32(u23.val[1]));      \
+   }
+
+static void idct_neon(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   int32x4_t s[8][2], v[8][2], c[8], o[8];
+   int32x4_t t0,t1,t2,t3,p1,p2,p3,p4,p5,x0,x1,x2,x3;
+   int16x8_t rows = vdupq_n_s16(0);
+   uint16x8_t dconly16;
+   int i,h;
+
+   // columns, four at a time
+   for (i=0; i < 8; ++i) {
+      int16x8_t  d  = vld1q_s16(data + i*8);
+      uint16x8_t dq = vld1q_u16(dequantize + i*8);
+      s[i][0] = vmulq_s32(vmovl_s16(vget_low_s16 (d)), vreinterpretq_s32_u32(vmovl_u16(vget_low_u16 (dq))));
+      s[i][1] = vmulq_s32(vmovl_s16(vget_high_s16(d)), vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(dq))));
+      if (i) rows = vorrq_s16(rows, d);
+   }
+   dconly16 = vceqq_s16(rows, vdupq_n_s16(0));
+   for (h=0; h < 2; ++h) {
+      int16x4_t m = vreinterpret_s16_u16(h ? vget_high_u16(dconly16) : vget_low_u16(dconly16));
+      uint32x4_t dconly = vreinterpretq_u32_s32(vmovl_s16(m));
+      int32x4_t dcterm = vshlq_n_s32(s[0][h], 2);
+      int32x4_t bias = vdupq_n_s32(512);
+      IDCT_1D_V(s[0][h],s[1][h],s[2][h],s[3][h],s[4][h],s[5][h],s[6][h],s[7][h])
+      x0 = V_ADD(x0,bias); x1 = V_ADD(x1,bias); x2 = V_ADD(x2,bias); x3 = V_ADD(x3,bias);
+      #define STBI_COL(r,e) v[r][h] = vbslq_s32(dconly, dcterm, vshrq_n_s32(e,10))
+      STBI_COL(0, V_ADD(x0,t3));
+      STBI_COL(7, V_SUB(x0,t3));
+      STBI_COL(1, V_ADD(x1,t2));
+      STBI_COL(6, V_SUB(x1,t2));
+      STBI_COL(2, V_ADD(x2,t1));
+      STBI_COL(5, V_SUB(x2,t1));
+      STBI_COL(3, V_ADD(x3,t0));
+      STBI_COL(4, V_SUB(x3,t0));
+      #undef STBI_COL
+   }
+
+   // rows, four at a time
+   for (h=0; h < 2; ++h) {
+      int32x4_t bias = vdupq_n_s32(65536 + (128<<17));
+      for (i=0; i < 8; i += 4) {
+         c[i+0] = v[h*4+0][i>>2];
+         c[i+1] = v[h*4+1][i>>2];
+         c[i+2] = v[h*4+2][i>>2];
+         c[i+3] = v[h*4+3][i>>2];
+         STBI_TRANSPOSE4_S32(c[i+0],c[i+1],c[i+2],c[i+3])
+      }
+      IDCT_1D_V(c[0],c[1],c[2],c[3],c[4],c[5],c[6],c[7])
+      x0 = V_ADD(x0,bias); x1 = V_ADD(x1,bias); x2 = V_ADD(x2,bias); x3 = V_ADD(x3,bias);
+      o[0] = vshrq_n_s32(V_ADD(x0,t3), 17);
+      o[7] = vshrq_n_s32(V_SUB(x0,t3), 17);
+      o[1] = vshrq_n_s32(V_ADD(x1,t2), 17);
+      o[6] = vshrq_n_s32(V_SUB(x1,t2), 17);
+      o[2] = vshrq_n_s32(V_ADD(x2,t1), 17);
+      o[5] = vshrq_n_s32(V_SUB(x2,t1), 17);
+      o[3] = vshrq_n_s32(V_ADD(x3,t0), 17);
+      o[4] = vshrq_n_s32(V_SUB(x3,t0), 17);
+      STBI_TRANSPOSE4_S32(o[0],o[1],o[2],o[3])
+      STBI_TRANSPOSE4_S32(o[4],o[5],o[6],o[7])
+      for (i=0; i < 4; ++i) {
+         int16x8_t p = vcombine_s16(vqmovn_s32(o[i]), vqmovn_s32(o[i+4]));
+         vst1_u8(out + (h*4+i)*out_stride, vqmovun_s16(p));
+      }
+   }
+}
+
+#undef V_ADD
+#undef V_SUB
+#undef V_MULC
+#undef V_SHL12
+#endif // STBI_SIMD_NEON
+
+static stbi_idct_8x8 stbi_idct_select(void)
+{
+   #if defined(STBI_SIMD_X86)
+   int cpu = stbi_cpu_features();
+   if (cpu & STBI_CPU_AVX2) return idct_avx2;
+   if (cpu & STBI_CPU_SSE2) return idct_sse2;
+   #elif defined(STBI_SIMD_NEON)
+   return idct_neon;
+   #endif
+   return idct_block;
+}
+
+// picked once at startup (dynamic initialization, this file is compiled as C++)
+static stbi_idct_8x8 stbi_idct_installed = stbi_idct_select();
 
 void stbi_install_idct(stbi_idct_8x8 func)
 {
@@ -1348,78 +2452,189 @@ static void reset(jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int parse_entropy_coded_data(jpeg *z)
+// inverse DCT of one block into a component buffer, at the decode scale
+stbi_inline static void jpeg_idct(jpeg *z, uint8 *out, int out_stride, short data[64], int tq)
 {
-   reset(z);
-   if (z->scan_n == 1) {
-      int i,j;
-      #ifdef STBI_SIMD
-      __declspec(align(16))
-      #endif
-      short data[64];
-      int n = z->order[0];
-      // non-interleaved data, we just need to process one block at a time,
-      // in trivial scanline order
-      // number of blocks to do just depends on how many actual "pixels" this
-      // component has, independent of interleaved MCU blocking and such
-      int w = (z->img_comp[n].x+7) >> 3;
-      int h = (z->img_comp[n].y+7) >> 3;
-      for (j=0; j < h; ++j) {
-         for (i=0; i < w; ++i) {
-            if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-            #ifdef STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-            #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-            #endif
-            // every data block is an MCU, so countdown the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
-         }
-      }
-   } else { // interleaved!
-      int i,j,k,x,y;
-      short data[64];
-      for (j=0; j < z->img_mcu_y; ++j) {
-         for (i=0; i < z->img_mcu_x; ++i) {
-            // scan an interleaved mcu... process scan_n components in order
-            for (k=0; k < z->scan_n; ++k) {
-               int n = z->order[k];
-               // scan out an mcu's worth of this component; that's just determined
-               // by the basic H and V specified for the component
-               for (y=0; y < z->img_comp[n].v; ++y) {
-                  for (x=0; x < z->img_comp[n].h; ++x) {
-                     int x2 = (i*z->img_comp[n].h + x)*8;
-                     int y2 = (j*z->img_comp[n].v + y)*8;
-                     if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                     #ifdef STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-                     #else
-                     idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-                     #endif
-                  }
+   #ifdef STBI_SIMD
+   if (z->scale_shift)
+      idct_reduced(out, out_stride, data, z->dequant2[tq], z->scale_shift);
+   else
+      z->idct(out, out_stride, data, z->dequant2[tq]);
+   #else
+   if (z->scale_shift)
+      idct_reduced(out, out_stride, data, z->dequant[tq], z->scale_shift);
+   else
+      idct_block(out, out_stride, data, z->dequant[tq]);
+   #endif
+}
+
+// decode 'count' MCUs starting at MCU number 'first', counting down the
+// restart interval on the way. In a non-interleaved scan every data block
+// is an MCU, in trivial scanline order.
+static int decode_mcus(jpeg *z, int first, int count)
+{
+   int bs = 8 >> z->scale_shift; // output samples per block side
+   int i,j,k,x,y,w;
+   #ifdef STBI_SIMD
+   STBI_SIMD_ALIGN(short, data[64]);
+   #else
+   short data[64];
+   #endif
+   // number of blocks to do just depends on how many actual "pixels" this
+   // component has, independent of interleaved MCU blocking and such
+   if (z->scan_n == 1)
+      w = (z->img_comp[z->order[0]].x+7) >> 3;
+   else
+      w = z->img_mcu_x;
+   i = first % w;
+   j = first / w;
+   while (count-- > 0) {
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, z->fast_ac[z->img_comp[n].ha], n)) return 0;
+         jpeg_idct(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data, z->img_comp[n].tq);
+      } else { // interleaved!
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*bs;
+                  int y2 = (j*z->img_comp[n].v + y)*bs;
+                  if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, z->fast_ac[z->img_comp[n].ha], n)) return 0;
+                  jpeg_idct(z, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->img_comp[n].tq);
                }
             }
-            // after all interleaved components, that's an interleaved MCU,
-            // so now count down the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
          }
       }
+      if (++i == w) { i = 0; ++j; }
+      // after a whole MCU, count down the restart interval
+      if (--z->todo <= 0) {
+         if (z->code_bits < 24) grow_buffer_unsafe(z);
+         // if it's NOT a restart, then just bail, so we get corrupt data
+         // rather than no data
+         if (!RESTART(z->marker)) return 1;
+         reset(z);
+      }
    }
    return 1;
 }
 
+// Restart intervals split a scan into segments that are entropy coded
+// independently, so with a parallel_for installed they can be decoded
+// on several threads. This needs the whole scan in memory up front.
+#define STBI_JPEG_MAX_TASKS 64
+
+typedef struct
+{
+   jpeg *z;
+   uint8 **segment;       // first byte of each segment
+   int num_segments;
+   int per_task;
+   int total;             // MCUs in the scan
+   int ok[STBI_JPEG_MAX_TASKS];
+} jpeg_parallel;
+
+// find where each segment starts, and the marker that ends the scan.
+// Fails unless there's exactly one RSTn per interval, in sequence.
+static int find_restarts(jpeg *z, uint8 **segment, int num_segments, uint8 **scan_end)
+{
+   uint8 *p = z->s->img_buffer, *end = z->s->img_buffer_end;
+   int n = 1;
+   segment[0] = p;
+   while (p < end) {
+      int c;
+      p = (uint8 *) memchr(p, 0xff, end - p);
+      if (p == NULL) break;
+      while (p < end && *p == 0xff) ++p; // 0xff fill bytes may precede markers
+      if (p == end) break;
+      c = *p++;
+      if (c == 0) continue; // stuffed 0xff
+      if (!RESTART(c)) {
+         *scan_end = p - 2;
+         return n == num_segments;
+      }
+      if (n == num_segments || c != 0xd0 + ((n-1) & 7)) return 0;
+      segment[n++] = p;
+   }
+   return 0; // truncated, let the serial decoder deal with it
+}
+
+static void decode_segments(void *context, int task)
+{
+   jpeg_parallel *p = (jpeg_parallel *) context;
+   int k, first = task * p->per_task;
+   int last = first + p->per_task;
+   jpeg *z = (jpeg *) stbi_malloc(sizeof(*z));
+   stbi s;
+   p->ok[task] = z != NULL;
+   if (!z) return;
+   // private copies of the decoder and stream state; the component
+   // buffers are shared, but every segment writes different blocks
+   memcpy(z, p->z, sizeof(*z));
+   s = *p->z->s;
+   z->s = &s;
+   if (last > p->num_segments) last = p->num_segments;
+   for (k=first; k < last; ++k) {
+      int mcu = k * z->restart_interval;
+      int count = p->total - mcu;
+      if (count > z->restart_interval) count = z->restart_interval;
+      s.img_buffer = p->segment[k];
+      reset(z);
+      if (!decode_mcus(z, mcu, count)) { p->ok[task] = 0; break; }
+   }
+   stbi_free(z);
+}
+
+static int parse_entropy_coded_data_parallel(jpeg *z, int total)
+{
+   jpeg_parallel p;
+   uint8 *scan_end;
+   int i, num_tasks;
+   p.num_segments = (total + z->restart_interval - 1) / z->restart_interval;
+   if (p.num_segments < 2) return 0;
+   p.segment = (uint8 **) stbi_malloc(p.num_segments * sizeof(*p.segment));
+   if (!p.segment) return 0;
+   if (!find_restarts(z, p.segment, p.num_segments, &scan_end)) {
+      stbi_free(p.segment);
+      return 0;
+   }
+   p.z = z;
+   p.total = total;
+   num_tasks = p.num_segments < STBI_JPEG_MAX_TASKS ? p.num_segments : STBI_JPEG_MAX_TASKS;
+   p.per_task = (p.num_segments + num_tasks - 1) / num_tasks;
+   num_tasks = (p.num_segments + p.per_task - 1) / p.per_task;
+   z->s->parallel_for(z->s->parallel_user, num_tasks, decode_segments, &p);
+   stbi_free(p.segment);
+   for (i=0; i < num_tasks; ++i)
+      if (!p.ok[i]) return 0;
+   // continue after the scan as if we had read up to its closing marker
+   z->s->img_buffer = scan_end;
+   z->marker = MARKER_none;
+   return 1;
+}
+
+static int parse_entropy_coded_data(jpeg *z)
+{
+   int total;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      total = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      total = z->img_mcu_x * z->img_mcu_y;
+
+   // on any trouble the parallel path leaves the stream alone, and the
+   // serial decode starts over and reports it the usual way
+   if (z->s->parallel_for && z->restart_interval && !z->s->read_from_callbacks)
+      if (parse_entropy_coded_data_parallel(z, total))
+         return 1;
+
+   reset(z);
+   return decode_mcus(z, 0, total);
+}
+
 static int process_marker(jpeg *z, int m)
 {
    int L;
@@ -1476,6 +2691,8 @@ static int process_marker(jpeg *z, int m)
             }
             for (i=0; i < m; ++i)
                v[i] = get8u(z->s);
+            if (tc != 0)
+               build_fast_ac(z->fast_ac[th], z->huff_ac+th);
             L -= m;
          }
          return L==0;
@@ -1567,13 +2784,14 @@ static int process_frame_header(jpeg *z, int scan)
       // to simplify generation, we'll allocate enough memory to decode
       // the bogus oversized data from using interleaved MCUs and their
       // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
-      // discard the extra data until colorspace conversion
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+      // discard the extra data until colorspace conversion. When decoding
+      // downscaled, each block only produces (8 >> scale_shift)^2 samples.
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
+      z->img_comp[i].raw_data = stbi_malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
       if (z->img_comp[i].raw_data == NULL) {
          for(--i; i >= 0; --i) {
-            free(z->img_comp[i].raw_data);
+            stbi_free(z->img_comp[i].raw_data);
             z->img_comp[i].data = NULL;
          }
          return e("outofmem", "Out of memory");
@@ -1760,13 +2978,169 @@ static void YCbCr_to_RGB_row(uint8 *out, const uint8 *y, const uint8 *pcb, const
       out[0] = (uint8)r;
       out[1] = (uint8)g;
       out[2] = (uint8)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255; // rows may be converted out of order, so don't touch the next one
       out += step;
    }
 }
 
 #ifdef STBI_SIMD
-static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = YCbCr_to_RGB_row;
+// SIMD versions of YCbCr_to_RGB_row, eight pixels per step in 32-bit lanes
+// with the same fixed-point constants, so the results match bit for bit.
+// Leftover pixels go through the C version.
+#ifdef STBI_SIMD_X86
+STBI_TARGET("sse2") static void YCbCr_to_RGB_sse2(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi32(32768);
+   __m128i c128 = _mm_set1_epi32(128);
+   __m128i cr_r = _mm_set1_epi32(float2fixed(1.40200f));
+   __m128i cr_g = _mm_set1_epi32(float2fixed(0.71414f));
+   __m128i cb_g = _mm_set1_epi32(float2fixed(0.34414f));
+   __m128i cb_b = _mm_set1_epi32(float2fixed(1.77200f));
+   __m128i alpha = _mm_set1_epi8((char) 255);
+   int i = 0;
+   for (; i+8 <= count; i += 8) {
+      __m128i y16  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y+i)), zero);
+      __m128i cb16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcb+i)), zero);
+      __m128i cr16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcr+i)), zero);
+      __m128i r[2],g[2],b[2],r8,g8,b8,rg,ba;
+      int h;
+      for (h=0; h < 2; ++h) {
+         __m128i yv = h ? _mm_unpackhi_epi16(y16,zero)  : _mm_unpacklo_epi16(y16,zero);
+         __m128i cb = h ? _mm_unpackhi_epi16(cb16,zero) : _mm_unpacklo_epi16(cb16,zero);
+         __m128i cr = h ? _mm_unpackhi_epi16(cr16,zero) : _mm_unpacklo_epi16(cr16,zero);
+         __m128i y_fixed = _mm_add_epi32(_mm_slli_epi32(yv,16), bias);
+         cb = _mm_sub_epi32(cb, c128);
+         cr = _mm_sub_epi32(cr, c128);
+         r[h] = _mm_srai_epi32(_mm_add_epi32(y_fixed, mullo_sse2(cr,cr_r)), 16);
+         g[h] = _mm_srai_epi32(_mm_sub_epi32(_mm_sub_epi32(y_fixed, mullo_sse2(cr,cr_g)), mullo_sse2(cb,cb_g)), 16);
+         b[h] = _mm_srai_epi32(_mm_add_epi32(y_fixed, mullo_sse2(cb,cb_b)), 16);
+      }
+      // saturating packs clamp to 0..255
+      r8 = _mm_packs_epi32(r[0],r[1]); r8 = _mm_packus_epi16(r8,r8);
+      g8 = _mm_packs_epi32(g[0],g[1]); g8 = _mm_packus_epi16(g8,g8);
+      b8 = _mm_packs_epi32(b[0],b[1]); b8 = _mm_packus_epi16(b8,b8);
+      rg = _mm_unpacklo_epi8(r8,g8);
+      ba = _mm_unpacklo_epi8(b8,alpha);
+      if (step == 4) {
+         _mm_storeu_si128((__m128i *) (out+ 0), _mm_unpacklo_epi16(rg,ba));
+         _mm_storeu_si128((__m128i *) (out+16), _mm_unpackhi_epi16(rg,ba));
+      } else {
+         STBI_SIMD_ALIGN(uint8, rgba[32]);
+         int k;
+         _mm_store_si128((__m128i *) (rgba+ 0), _mm_unpacklo_epi16(rg,ba));
+         _mm_store_si128((__m128i *) (rgba+16), _mm_unpackhi_epi16(rg,ba));
+         for (k=0; k < 8; ++k) {
+            out[k*3+0] = rgba[k*4+0];
+            out[k*3+1] = rgba[k*4+1];
+            out[k*3+2] = rgba[k*4+2];
+         }
+      }
+      out += 8*step;
+   }
+   YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+STBI_TARGET("avx2") static void YCbCr_to_RGB_avx2(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step)
+{
+   __m256i bias = _mm256_set1_epi32(32768);
+   __m256i c128 = _mm256_set1_epi32(128);
+   __m256i cr_r = _mm256_set1_epi32(float2fixed(1.40200f));
+   __m256i cr_g = _mm256_set1_epi32(float2fixed(0.71414f));
+   __m256i cb_g = _mm256_set1_epi32(float2fixed(0.34414f));
+   __m256i cb_b = _mm256_set1_epi32(float2fixed(1.77200f));
+   __m128i alpha = _mm_set1_epi8((char) 255);
+   // drops every 4th byte: 4 RGBA pixels -> 12 bytes of RGB
+   __m128i rgb = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+   int i = 0;
+   for (; i+8 <= count; i += 8) {
+      __m256i yv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (y+i)));
+      __m256i cb = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (pcb+i))), c128);
+      __m256i cr = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (pcr+i))), c128);
+      __m256i y_fixed = _mm256_add_epi32(_mm256_slli_epi32(yv,16), bias);
+      __m256i r = _mm256_srai_epi32(_mm256_add_epi32(y_fixed, _mm256_mullo_epi32(cr,cr_r)), 16);
+      __m256i g = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_sub_epi32(y_fixed, _mm256_mullo_epi32(cr,cr_g)), _mm256_mullo_epi32(cb,cb_g)), 16);
+      __m256i b = _mm256_srai_epi32(_mm256_add_epi32(y_fixed, _mm256_mullo_epi32(cb,cb_b)), 16);
+      __m128i r8 = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r,1));
+      __m128i g8 = _mm_packs_epi32(_mm256_castsi256_si128(g), _mm256_extracti128_si256(g,1));
+      __m128i b8 = _mm_packs_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b,1));
+      __m128i rg, ba, lo, hi;
+      r8 = _mm_packus_epi16(r8,r8);
+      g8 = _mm_packus_epi16(g8,g8);
+      b8 = _mm_packus_epi16(b8,b8);
+      rg = _mm_unpacklo_epi8(r8,g8);
+      ba = _mm_unpacklo_epi8(b8,alpha);
+      lo = _mm_unpacklo_epi16(rg,ba);
+      hi = _mm_unpackhi_epi16(rg,ba);
+      if (step == 4) {
+         _mm_storeu_si128((__m128i *) (out+ 0), lo);
+         _mm_storeu_si128((__m128i *) (out+16), hi);
+      } else {
+         // exactly 24 bytes, never past the end of the row
+         lo = _mm_shuffle_epi8(lo, rgb);
+         hi = _mm_shuffle_epi8(hi, rgb);
+         _mm_storeu_si128((__m128i *) out, _mm_or_si128(lo, _mm_slli_si128(hi,12)));
+         _mm_storel_epi64((__m128i *) (out+16), _mm_srli_si128(hi,4));
+      }
+      out += 8*step;
+   }
+   YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif // STBI_SIMD_X86
+
+#ifdef STBI_SIMD_NEON
+static void YCbCr_to_RGB_neon(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step)
+{
+   int32x4_t bias = vdupq_n_s32(32768);
+   int i = 0;
+   for (; i+8 <= count; i += 8) {
+      int16x8_t y16  = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y+i)));
+      int16x8_t cb16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pcb+i))), vdupq_n_s16(128));
+      int16x8_t cr16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pcr+i))), vdupq_n_s16(128));
+      int32x4_t r[2],g[2],b[2];
+      uint8x8x4_t px;
+      int h;
+      for (h=0; h < 2; ++h) {
+         int32x4_t yv = vmovl_s16(h ? vget_high_s16(y16)  : vget_low_s16(y16));
+         int32x4_t cb = vmovl_s16(h ? vget_high_s16(cb16) : vget_low_s16(cb16));
+         int32x4_t cr = vmovl_s16(h ? vget_high_s16(cr16) : vget_low_s16(cr16));
+         int32x4_t y_fixed = vaddq_s32(vshlq_n_s32(yv,16), bias);
+         r[h] = vshrq_n_s32(vmlaq_n_s32(y_fixed, cr, float2fixed(1.40200f)), 16);
+         g[h] = vshrq_n_s32(vmlsq_n_s32(vmlsq_n_s32(y_fixed, cr, float2fixed(0.71414f)), cb, float2fixed(0.34414f)), 16);
+         b[h] = vshrq_n_s32(vmlaq_n_s32(y_fixed, cb, float2fixed(1.77200f)), 16);
+      }
+      px.val[0] = vqmovun_s16(vcombine_s16(vqmovn_s32(r[0]), vqmovn_s32(r[1])));
+      px.val[1] = vqmovun_s16(vcombine_s16(vqmovn_s32(g[0]), vqmovn_s32(g[1])));
+      px.val[2] = vqmovun_s16(vcombine_s16(vqmovn_s32(b[0]), vqmovn_s32(b[1])));
+      px.val[3] = vdup_n_u8(255);
+      if (step == 4) {
+         vst4_u8(out, px);
+      } else {
+         uint8x8x3_t px3;
+         px3.val[0] = px.val[0];
+         px3.val[1] = px.val[1];
+         px3.val[2] = px.val[2];
+         vst3_u8(out, px3);
+      }
+      out += 8*step;
+   }
+   YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif // STBI_SIMD_NEON
+
+static stbi_YCbCr_to_RGB_run stbi_YCbCr_select(void)
+{
+   #if defined(STBI_SIMD_X86)
+   int cpu = stbi_cpu_features();
+   if (cpu & STBI_CPU_AVX2) return YCbCr_to_RGB_avx2;
+   if (cpu & STBI_CPU_SSE2) return YCbCr_to_RGB_sse2;
+   #elif defined(STBI_SIMD_NEON)
+   return YCbCr_to_RGB_neon;
+   #endif
+   return YCbCr_to_RGB_row;
+}
+
+static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = stbi_YCbCr_select();
 
 void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 {
@@ -1781,11 +3155,11 @@ static void cleanup_jpeg(jpeg *j)
    int i;
    for (i=0; i < j->s->img_n; ++i) {
       if (j->img_comp[i].data) {
-         free(j->img_comp[i].raw_data);
+         stbi_free(j->img_comp[i].raw_data);
          j->img_comp[i].data = NULL;
       }
       if (j->img_comp[i].linebuf) {
-         free(j->img_comp[i].linebuf);
+         stbi_free(j->img_comp[i].linebuf);
          j->img_comp[i].linebuf = NULL;
       }
    }
@@ -1799,11 +3173,92 @@ typedef struct
    int w_lores; // horizontal pixels pre-expansion 
    int ystep;   // how far through vertical expansion we are
    int ypos;    // which pre-expansion row we're on
+   int ymax;    // pre-expansion rows this component has
+   int stride;
 } stbi_resample;
 
+// move on to the next output row
+stbi_inline static void resample_advance(stbi_resample *r)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < r->ymax)
+         r->line1 += r->stride;
+   }
+}
+
+// resampling and color conversion, split into bands of rows that can run
+// in parallel; each band has its own line buffers
+typedef struct
+{
+   jpeg *z;
+   stbi_resample res_comp[4]; // state at row 0
+   uint8 *output;
+   int n, decode_n;
+   uint img_x, img_y;
+   uint band_rows;
+} jpeg_color;
+
+static void color_band(void *context, int band)
+{
+   jpeg_color *c = (jpeg_color *) context;
+   jpeg *z = c->z;
+   stbi_resample res_comp[4];
+   uint8 *coutput[4];
+   uint i,j;
+   uint j0 = band * c->band_rows;
+   uint j1 = j0 + c->band_rows < c->img_y ? j0 + c->band_rows : c->img_y;
+   int k, n = c->n;
+
+   for (k=0; k < c->decode_n; ++k) {
+      res_comp[k] = c->res_comp[k];
+      for (j=0; j < j0; ++j)
+         resample_advance(&res_comp[k]);
+   }
+
+   for (j=j0; j < j1; ++j) {
+      uint8 *out = c->output + n * c->img_x * j;
+      for (k=0; k < c->decode_n; ++k) {
+         stbi_resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(z->img_comp[k].linebuf + band * (c->img_x + 3),
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         resample_advance(r);
+      }
+      if (n >= 3) {
+         uint8 *y = coutput[0];
+         if (z->s->img_n == 3) {
+            #ifdef STBI_SIMD
+            z->YCbCr(out, y, coutput[1], coutput[2], c->img_x, n);
+            #else
+            YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], c->img_x, n);
+            #endif
+         } else
+            for (i=0; i < c->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               if (n == 4) out[3] = 255;
+               out += n;
+            }
+      } else {
+         uint8 *y = coutput[0];
+         if (n == 1)
+            for (i=0; i < c->img_x; ++i) out[i] = y[i];
+         else
+            for (i=0; i < c->img_x; ++i) *out++ = y[i], *out++ = 255;
+      }
+   }
+}
+
+// don't bother splitting images smaller than this many rows per band
+#define STBI_JPEG_MIN_BAND_ROWS 32
+
 static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n;
+   uint img_x, img_y; // output size, after any downscale
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    z->s->img_n = 0;
@@ -1811,6 +3266,9 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { cleanup_jpeg(z); return NULL; }
 
+   img_x = (z->s->img_x + (1 << z->scale_shift) - 1) >> z->scale_shift;
+   img_y = (z->s->img_y + (1 << z->scale_shift) - 1) >> z->scale_shift;
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n;
 
@@ -1821,26 +3279,37 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
 
    // resample and color-convert
    {
-      int k;
-      uint i,j;
-      uint8 *output;
-      uint8 *coutput[4];
+      int k, num_bands = 1;
+      jpeg_color c;
 
-      stbi_resample res_comp[4];
+      if (z->s->parallel_for) {
+         num_bands = img_y / STBI_JPEG_MIN_BAND_ROWS;
+         if (num_bands > STBI_JPEG_MAX_TASKS) num_bands = STBI_JPEG_MAX_TASKS;
+         if (num_bands < 1) num_bands = 1;
+      }
+      c.z = z;
+      c.n = n;
+      c.decode_n = decode_n;
+      c.img_x = img_x;
+      c.img_y = img_y;
+      c.band_rows = (img_y + num_bands - 1) / num_bands;
+      num_bands = (img_y + c.band_rows - 1) / c.band_rows;
 
       for (k=0; k < decode_n; ++k) {
-         stbi_resample *r = &res_comp[k];
+         stbi_resample *r = &c.res_comp[k];
 
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (uint8 *) malloc(z->s->img_x + 3);
+         // allocate line buffers big enough for upsampling off the edges
+         // with upsample factor of 4, one per band
+         z->img_comp[k].linebuf = (uint8 *) stbi_malloc(num_bands * (img_x + 3));
          if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
 
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
          r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+         r->w_lores = (img_x + r->hs-1) / r->hs;
          r->ypos    = 0;
+         r->ymax    = (z->img_comp[k].y + (1 << z->scale_shift) - 1) >> z->scale_shift;
+         r->stride  = z->img_comp[k].w2;
          r->line0   = r->line1 = z->img_comp[k].data;
 
          if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
@@ -1851,53 +3320,20 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
       }
 
       // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s->img_x * z->s->img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+      c.output = (uint8 *) stbi_malloc(n * img_x * img_y + 1);
+      if (!c.output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         uint8 *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi_resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            uint8 *y = coutput[0];
-            if (z->s->img_n == 3) {
-               #ifdef STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #else
-               YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               #endif
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            uint8 *y = coutput[0];
-            if (n == 1)
-               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-            else
-               for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
-         }
-      }
+      if (num_bands > 1)
+         z->s->parallel_for(z->s->parallel_user, num_bands, color_band, &c);
+      else
+         color_band(&c, 0);
+
       cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
+      *out_x = img_x;
+      *out_y = img_y;
       if (comp) *comp  = z->s->img_n; // report original components, not output
-      return output;
+      return c.output;
    }
 }
 
@@ -1905,9 +3341,59 @@ static unsigned char *stbi_jpeg_load(stbi *s, int *x, int *y, int *comp, int req
 {
    jpeg j;
    j.s = s;
+   #ifdef STBI_SIMD
+   j.idct = stbi_idct_installed;
+   j.YCbCr = stbi_YCbCr_installed;
+   #endif
+   j.scale_shift = 0;
+   return load_jpeg_image(&j, x,y,comp,req_comp);
+}
+
+static unsigned char *stbi_jpeg_load_scaled_main(stbi *s, int scale, int *x, int *y, int *comp, int req_comp)
+{
+   jpeg j;
+   int shift;
+   for (shift=0; shift <= 3; ++shift)
+      if (scale == (1 << shift)) break;
+   if (shift > 3) return epuc("bad scale", "JPEG scale must be 1, 2, 4 or 8");
+   if (!stbi_jpeg_test(s)) return epuc("not JPEG", "Scaled decoding only supports JPEG");
+   j.s = s;
+   #ifdef STBI_SIMD
+   j.idct = stbi_idct_installed;
+   j.YCbCr = stbi_YCbCr_installed;
+   #endif
+   j.scale_shift = shift;
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
+unsigned char *stbi_jpeg_load_scaled_from_memory(stbi_uc const *buffer, int len, int scale, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_jpeg_load_scaled_main(&s,scale,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+unsigned char *stbi_jpeg_load_scaled(char const *filename, int scale, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   FILE *f;
+   unsigned char *result;
+   stbi_mapping m;
+   if (stbi_map_file(&m, filename)) {
+      result = stbi_jpeg_load_scaled_from_memory(m.data, m.len, scale, x,y,comp,req_comp);
+      stbi_unmap_file(&m);
+      return result;
+   }
+   f = fopen(filename, "rb");
+   if (!f) return epuc("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   result = stbi_jpeg_load_scaled_main(&s,scale,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+#endif
+
 static int stbi_jpeg_test(stbi *s)
 {
    int r;
@@ -1942,17 +3428,29 @@ static int stbi_jpeg_info(stbi *s, int *x, int *y, int *comp)
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - fast huffman, two literals per lookup where they fit
+//      - 64-bit bit buffer, refilled several bytes at a time
+//      - matches copied 8 or 16 bytes at a time
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  10 // accelerate all cases in default tables
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
 
+// fast table entries: 0 if the code is longer than ZFAST_BITS, otherwise
+//    bits  0.. 8  symbol
+//    bits  9..13  code length
+// and in the literal/length table, when a second literal's code also fits:
+//    bits 16..23  second literal
+//    bits 24..28  combined length of both codes
+#define ZFAST_VALUE(f)    ((f) & 511)
+#define ZFAST_SIZE(f)     (((f) >> 9) & 31)
+#define ZFAST_PAIR(f)     ((f) >> 24)
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   uint16 fast[1 << ZFAST_BITS];
+   uint32 fast[1 << ZFAST_BITS];
    uint16 firstcode[16];
    int maxcode[17];
    uint16 firstsymbol[16];
@@ -1984,12 +3482,12 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   memset(z->fast, 0, sizeof(z->fast));
    for (i=0; i < num; ++i) 
       ++sizes[sizelist[i]];
    sizes[0] = 0;
    for (i=1; i < 16; ++i)
-      assert(sizes[i] <= (1 << i));
+      if (sizes[i] > (1 << i)) return e("bad sizes","Corrupt PNG");
    code = 0;
    for (i=1; i < 16; ++i) {
       next_code[i] = code;
@@ -2011,8 +3509,9 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          z->value[c] = (uint16)i;
          if (s <= ZFAST_BITS) {
             int k = bit_reverse(next_code[s],s);
+            uint32 f = (s << 9) | i;
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               z->fast[k] = f;
                k += (1 << s);
             }
          }
@@ -2022,66 +3521,106 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
    return 1;
 }
 
+// for the literal/length table: wherever a literal is followed by another
+// literal whose code fits in the remaining fast bits, decode both at once.
+// Codes are prefix-free, so the bits past the second code don't matter.
+static void zbuild_pairs(zhuffman *z)
+{
+   int i;
+   for (i=0; i < (1 << ZFAST_BITS); ++i) {
+      uint32 f = z->fast[i], g;
+      int s;
+      if (!f || ZFAST_VALUE(f) >= 256) continue;
+      s = ZFAST_SIZE(f);
+      g = z->fast[i >> s];
+      if (g && ZFAST_VALUE(g) < 256 && s + ZFAST_SIZE(g) <= ZFAST_BITS)
+         z->fast[i] = f | (ZFAST_VALUE(g) << 16) | ((s + ZFAST_SIZE(g)) << 24);
+   }
+}
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
-typedef struct
+typedef struct zbuf_struct
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer;  // lsb first
+   int zpad;            // zero bytes supplied after the end of the input
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   partial;     // stop after the first 64KB, see stbi_png_partial
+
+   // streaming inflate (see png_stream): refill replaces an exhausted input
+   // buffer and returns 0 at the real end; flush takes the output so far
+   // and makes room. NULL when everything is in memory.
+   int (*refill)(struct zbuf_struct *z);
+   int (*flush)(struct zbuf_struct *z);
+   void *stream;
 
    zhuffman z_length, z_distance;
 } zbuf;
 
+// true at the end of the input, after asking for more if it's streamed
+stbi_inline static int zeof(zbuf *z)
+{
+   return z->zbuffer >= z->zbuffer_end && !(z->refill && z->refill(z));
+}
+
 stbi_inline static int zget8(zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (zeof(z)) return 0;
    return *z->zbuffer++;
 }
 
+// fill the bit buffer to more than 56 bits. Reads whole little-endian
+// words while at least 8 bytes of input are left, then bytewise, padding
+// with zeros past the end of the input.
 static void fill_bits(zbuf *z)
 {
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      uint8 *p = z->zbuffer;
+      int n = (63 - z->num_bits) >> 3; // whole bytes that fit
+      uint64 w = (uint64) p[0]       | ((uint64) p[1] <<  8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24) |
+                ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+      assert(z->code_buffer < ((uint64) 1 << z->num_bits));
+      z->code_buffer |= (w & (((uint64) 1 << (8*n)) - 1)) << z->num_bits;
+      z->num_bits += 8*n;
+      z->zbuffer += n;
+      return;
+   }
    do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
+      assert(z->code_buffer < ((uint64) 1 << z->num_bits));
+      if (zeof(z))
+         ++z->zpad;
+      else
+         z->code_buffer |= (uint64) *z->zbuffer++ << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 stbi_inline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;   
 }
 
-stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
+static int zhuffman_decode_slowpath(zbuf *a, zhuffman *z)
 {
    int b,s,k;
-   if (a->num_bits < 16) fill_bits(a);
-   b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return z->value[b];
-   }
-
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -2094,16 +3633,32 @@ stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
    return z->value[b];
 }
 
+stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
+{
+   uint32 f;
+   int s;
+   if (a->num_bits < 16) fill_bits(a);
+   f = z->fast[a->code_buffer & ZFAST_MASK];
+   if (f) {
+      s = ZFAST_SIZE(f);
+      a->code_buffer >>= s;
+      a->num_bits -= s;
+      return ZFAST_VALUE(f);
+   }
+   return zhuffman_decode_slowpath(a, z);
+}
+
 static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
    int cur, limit;
+   if (z->flush) return z->flush(z);
    if (!z->z_expandable) return e("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) realloc(z->zout_start, limit);
+   q = (char *) stbi_realloc(z->zout_start, limit);
    if (q == NULL) return e("outofmem", "Out of memory");
    z->zout_start = q;
    z->zout       = q + cur;
@@ -2127,16 +3682,42 @@ static int dist_extra[32] =
 
 static int parse_huffman_block(zbuf *a)
 {
+   char *zout = a->zout;
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
+      int z;
+      uint32 f;
+      if (a->num_bits < 16) {
+         fill_bits(a);
+         // the buffer never looks more than 8 bytes ahead, so beyond that
+         // we're decoding padding; zeros could make symbols forever
+         if (a->zpad > 16) return e("unexpected end","Corrupt PNG");
+      }
+      f = a->z_length.fast[a->code_buffer & ZFAST_MASK];
+      if (ZFAST_PAIR(f) && a->zout_end - zout >= 2) {
+         // two literals in one go
+         zout[0] = (char) ZFAST_VALUE(f);
+         zout[1] = (char) (f >> 16);
+         zout += 2;
+         a->code_buffer >>= ZFAST_PAIR(f);
+         a->num_bits -= ZFAST_PAIR(f);
+         continue;
+      }
+      z = zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+         if (zout >= a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, 1)) return 0;
+            zout = a->zout;
+         }
+         *zout++ = (char) z;
       } else {
          uint8 *p;
          int len,dist;
-         if (z == 256) return 1;
+         if (z == 256) {
+            a->zout = zout;
+            return 1;
+         }
          z -= 257;
          len = length_base[z];
          if (length_extra[z]) len += zreceive(a, length_extra[z]);
@@ -2144,11 +3725,31 @@ static int parse_huffman_block(zbuf *a)
          if (z < 0) return e("bad huffman code","Corrupt PNG");
          dist = dist_base[z];
          if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
-         while (len--)
-            *a->zout++ = *p++;
+         if (a->zpad > 16) return e("unexpected end","Corrupt PNG");
+         if (zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+         if (zout + len > a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, len)) return 0;
+            zout = a->zout;
+         }
+         p = (uint8 *) (zout - dist);
+         if (dist >= 8 && a->zout_end - zout >= len + 16) {
+            // copy in whole words; they never overlap themselves, and may
+            // run up to 15 bytes past the match into space that's free
+            char *end = zout + len;
+            if (dist >= 16)
+               do { memcpy(zout, p, 16); zout += 16; p += 16; } while (zout < end);
+            else
+               do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+            zout = end;
+         } else if (dist == 1) {
+            // run of one byte
+            memset(zout, *p, len);
+            zout += len;
+         } else {
+            while (len--)
+               *zout++ = *p++;
+         }
       }
    }
 }
@@ -2175,10 +3776,11 @@ static int compute_huffman_codes(zbuf *a)
    n = 0;
    while (n < hlit + hdist) {
       int c = zhuffman_decode(a, &z_codelength);
-      assert(c >= 0 && c < 19);
+      if (c < 0 || c >= 19) return e("bad codelengths","Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (uint8) c;
       else if (c == 16) {
+         if (n == 0) return e("bad codelengths","Corrupt PNG");
          c = zreceive(a,2)+3;
          memset(lencodes+n, lencodes[n-1], c);
          n += c;
@@ -2207,11 +3809,20 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
+   // give back whatever else the bit buffer read ahead, except the zeros
+   // that were made up past the end of the input
+   if (a->num_bits > 0) {
+      int real = (a->num_bits >> 3) - (a->zpad < (a->num_bits >> 3) ? a->zpad : (a->num_bits >> 3));
+      a->zbuffer -= real;
+      a->zpad = 0;
+      a->code_buffer = 0;
+      a->num_bits = 0;
+   }
    assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
@@ -2219,12 +3830,19 @@ static int parse_uncompressed_block(zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!expand(a, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   // in pieces, since a streamed input or output may not hold all of it
+   while (len > 0) {
+      int n = len;
+      if (zeof(a)) return e("read past buffer","Corrupt PNG");
+      if (a->zout >= a->zout_end)
+         if (!expand(a, len)) return 0;
+      if (n > a->zbuffer_end - a->zbuffer) n = (int) (a->zbuffer_end - a->zbuffer);
+      if (n > a->zout_end - a->zout) n = (int) (a->zout_end - a->zout);
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      len -= n;
+   }
    return 1;
 }
 
@@ -2237,24 +3855,30 @@ static int parse_zlib_header(zbuf *a)
    if ((cmf*256+flg) % 31 != 0) return e("bad zlib header","Corrupt PNG"); // zlib spec
    if (flg & 32) return e("no preset dict","Corrupt PNG"); // preset dictionary not allowed in png
    if (cm != 8) return e("bad compression","Corrupt PNG"); // DEFLATE required for png
-   // window = 1 << (8 + cinfo)... but who cares, we fully buffer output
+   // window = 1 << (8 + cinfo)... but who cares, we either fully buffer
+   // output or keep the largest window (png_stream)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// statically initialized (rather than filled on first use) so that several
+// threads can inflate at once
+static uint8 default_length[288] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static uint8 default_distance[32] =
+{
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
-int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... I should implement real streaming support instead
 static int parse_zlib(zbuf *a, int parse_header)
 {
    int final, type;
@@ -2262,6 +3886,7 @@ static int parse_zlib(zbuf *a, int parse_header)
       if (!parse_zlib_header(a)) return 0;
    a->num_bits = 0;
    a->code_buffer = 0;
+   a->zpad = 0;
    do {
       final = zreceive(a,1);
       type = zreceive(a,2);
@@ -2272,26 +3897,29 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
             if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
             if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
          } else {
             if (!compute_huffman_codes(a)) return 0;
          }
+         zbuild_pairs(&a->z_length);
          if (!parse_huffman_block(a)) return 0;
       }
-      if (stbi_png_partial && a->zout - a->zout_start > 65536)
+      if (a->partial && a->zout - a->zout_start > 65536)
          break;
    } while (!final);
    return 1;
 }
 
-static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
+static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header, int partial)
 {
    a->zout_start = obuf;
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->partial = partial;
+   a->refill = NULL;
+   a->flush = NULL;
 
    return parse_zlib(a, parse_header);
 }
@@ -2299,15 +3927,15 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
 char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    zbuf a;
-   char *p = (char *) malloc(initial_size);
+   char *p = (char *) stbi_malloc(initial_size);
    if (p == NULL) return NULL;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer + len;
-   if (do_zlib(&a, p, initial_size, 1, 1)) {
+   if (do_zlib(&a, p, initial_size, 1, 1, 0)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      stbi_free(a.zout_start);
       return NULL;
    }
 }
@@ -2317,28 +3945,33 @@ char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
    return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
 }
 
-char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+static char *zlib_decode_malloc_partial(const char *buffer, int len, int initial_size, int *outlen, int parse_header, int partial)
 {
    zbuf a;
-   char *p = (char *) malloc(initial_size);
+   char *p = (char *) stbi_malloc(initial_size);
    if (p == NULL) return NULL;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer + len;
-   if (do_zlib(&a, p, initial_size, 1, parse_header)) {
+   if (do_zlib(&a, p, initial_size, 1, parse_header, partial)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      stbi_free(a.zout_start);
       return NULL;
    }
 }
 
+char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+{
+   return zlib_decode_malloc_partial(buffer, len, initial_size, outlen, parse_header, 0);
+}
+
 int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
 {
    zbuf a;
    a.zbuffer = (uint8 *) ibuffer;
    a.zbuffer_end = (uint8 *) ibuffer + ilen;
-   if (do_zlib(&a, obuffer, olen, 0, 1))
+   if (do_zlib(&a, obuffer, olen, 0, 1, 0))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
@@ -2347,15 +3980,15 @@ int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int il
 char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
 {
    zbuf a;
-   char *p = (char *) malloc(16384);
+   char *p = (char *) stbi_malloc(16384);
    if (p == NULL) return NULL;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer+len;
-   if (do_zlib(&a, p, 16384, 1, 0)) {
+   if (do_zlib(&a, p, 16384, 1, 0, 0)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      stbi_free(a.zout_start);
       return NULL;
    }
 }
@@ -2365,7 +3998,7 @@ int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffe
    zbuf a;
    a.zbuffer = (uint8 *) ibuffer;
    a.zbuffer_end = (uint8 *) ibuffer + ilen;
-   if (do_zlib(&a, obuffer, olen, 0, 0))
+   if (do_zlib(&a, obuffer, olen, 0, 0, 0))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
@@ -2407,124 +4040,312 @@ static int check_png_header(stbi *s)
    return 1;
 }
 
-typedef struct
+typedef struct
+{
+   stbi *s;
+   uint8 *idata, *expanded, *out;
+   struct png_stream *stream; // set when decoding row by row
+} png;
+
+
+enum {
+   F_none=0, F_sub=1, F_up=2, F_avg=3, F_paeth=4,
+   F_avg_first, F_paeth_first
+};
+
+static uint8 first_row_filter[5] =
+{
+   F_none, F_sub, F_none, F_avg_first, F_paeth_first
+};
+
+static int paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p-a);
+   int pb = abs(p-b);
+   int pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+#ifdef STBI_SIMD_X86
+// SIMD unfiltering of 3 and 4 channel rows. Sub, Average and Paeth depend on
+// the pixel to the left, so pixels are still done one after the other, but
+// with all channels of a pixel in the low four bytes of one register and no
+// per-byte branches. Up and None on rows without added alpha run 16 bytes at
+// a time. The last pixel of a row is loaded and stored with its exact size,
+// so three channel rows never touch memory past their end.
+STBI_TARGET("sse2") static stbi_inline __m128i png_load_pixel(const uint8 *p, int n, int last)
+{
+   int v = 0;
+   if (last) memcpy(&v, p, n); else memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+STBI_TARGET("sse2") static stbi_inline void png_store_pixel(uint8 *p, __m128i v, int n, int last)
+{
+   int w = _mm_cvtsi128_si32(v);
+   if (last) memcpy(p, &w, n); else memcpy(p, &w, 4);
+}
+
+// picks a, b or c in 16-bit lanes; pa, pb and pc are the absolute distances
+STBI_TARGET("sse2") static stbi_inline __m128i png_paeth_pick(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+   __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa,pb), _mm_cmpgt_epi16(pa,pc));
+   __m128i use_c = _mm_cmpgt_epi16(pb,pc);
+   __m128i bc = _mm_or_si128(_mm_andnot_si128(use_c,b), _mm_and_si128(use_c,c));
+   return _mm_or_si128(_mm_andnot_si128(not_a,a), _mm_and_si128(not_a,bc));
+}
+
+// p = a+b-c, so p-a = b-c, p-b = a-c and p-c = (b-c)+(a-c)
+STBI_TARGET("sse2") static void png_paeth_sse2(uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int img_n, int out_n, __m128i alpha)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero;
+   uint32 i;
+   for (i=0; i < x; ++i, raw+=img_n, cur+=out_n, prior+=out_n) {
+      int last = i+1 == x;
+      __m128i b = _mm_unpacklo_epi8(png_load_pixel(prior, 4, 0), zero);
+      __m128i r = png_load_pixel(raw, img_n, last);
+      __m128i pa = _mm_sub_epi16(b,c);
+      __m128i pb = _mm_sub_epi16(a,c);
+      __m128i pc = _mm_add_epi16(pa,pb);
+      pa = _mm_max_epi16(pa, _mm_sub_epi16(zero,pa));
+      pb = _mm_max_epi16(pb, _mm_sub_epi16(zero,pb));
+      pc = _mm_max_epi16(pc, _mm_sub_epi16(zero,pc));
+      __m128i pred = png_paeth_pick(a,b,c,pa,pb,pc);
+      r = _mm_add_epi8(r, _mm_packus_epi16(pred,pred));
+      png_store_pixel(cur, _mm_or_si128(r,alpha), out_n, last);
+      a = _mm_unpacklo_epi8(r, zero);
+      c = b;
+   }
+}
+
+STBI_TARGET("ssse3") static void png_paeth_ssse3(uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int img_n, int out_n, __m128i alpha)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero;
+   uint32 i;
+   for (i=0; i < x; ++i, raw+=img_n, cur+=out_n, prior+=out_n) {
+      int last = i+1 == x;
+      __m128i b = _mm_unpacklo_epi8(png_load_pixel(prior, 4, 0), zero);
+      __m128i r = png_load_pixel(raw, img_n, last);
+      __m128i pa = _mm_sub_epi16(b,c);
+      __m128i pb = _mm_sub_epi16(a,c);
+      __m128i pc = _mm_add_epi16(pa,pb);
+      __m128i pred = png_paeth_pick(a,b,c,_mm_abs_epi16(pa),_mm_abs_epi16(pb),_mm_abs_epi16(pc));
+      r = _mm_add_epi8(r, _mm_packus_epi16(pred,pred));
+      png_store_pixel(cur, _mm_or_si128(r,alpha), out_n, last);
+      a = _mm_unpacklo_epi8(r, zero);
+      c = b;
+   }
+}
+
+// undoes 'filter' (after first_row_filter) on one row of x pixels; raw has
+// img_n bytes per pixel, cur and prior out_n, with alpha 255 if out_n > img_n
+typedef void (*png_unfilter_run)(uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int filter, int img_n, int out_n);
+
+STBI_TARGET("sse2") static void png_unfilter_sse2(uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int filter, int img_n, int out_n)
+{
+   __m128i alpha = _mm_cvtsi32_si128(out_n > img_n ? (int) 0xff000000 : 0);
+   __m128i one = _mm_set1_epi8(1);
+   __m128i a = _mm_setzero_si128(), b;
+   uint32 i;
+   if (img_n == out_n && (filter == F_none || filter == F_up)) {
+      uint32 n = x*img_n;
+      if (filter == F_none) {
+         memcpy(cur, raw, n);
+         return;
+      }
+      for (i=0; i+16 <= n; i += 16)
+         _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw+i)),
+                                                            _mm_loadu_si128((const __m128i *) (prior+i))));
+      for (; i < n; ++i)
+         cur[i] = raw[i] + prior[i];
+      return;
+   }
+   if (filter == F_paeth) {
+      png_paeth_sse2(cur, prior, raw, x, img_n, out_n, alpha);
+      return;
+   }
+   // floor((a+b)/2) is the rounding-up average minus the dropped low bit
+   #define AVG(a,b)  _mm_sub_epi8(_mm_avg_epu8(a,b), _mm_and_si128(_mm_xor_si128(a,b), one))
+   #define CASE(f) \
+       case f:     \
+          for (i=0; i < x; ++i, raw+=img_n, cur+=out_n, prior+=out_n) { \
+             int last = i+1 == x;                                        \
+             __m128i r = png_load_pixel(raw, img_n, last);
+   #define END \
+             png_store_pixel(cur, _mm_or_si128(a,alpha), out_n, last);   \
+          }                                                              \
+          break;
+   switch (filter) {
+      CASE(F_none)         a = r; END
+      CASE(F_up)           a = _mm_add_epi8(r, png_load_pixel(prior, 4, 0)); END
+      // paeth(a,0,0) is always a
+      case F_paeth_first:
+      CASE(F_sub)          a = _mm_add_epi8(r, a); END
+      CASE(F_avg)          b = png_load_pixel(prior, 4, 0); a = _mm_add_epi8(r, AVG(a,b)); END
+      CASE(F_avg_first)    b = _mm_setzero_si128(); a = _mm_add_epi8(r, AVG(a,b)); END
+   }
+   #undef END
+   #undef CASE
+   #undef AVG
+}
+
+STBI_TARGET("ssse3") static void png_unfilter_ssse3(uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int filter, int img_n, int out_n)
 {
-   stbi *s;
-   uint8 *idata, *expanded, *out;
-} png;
-
-
-enum {
-   F_none=0, F_sub=1, F_up=2, F_avg=3, F_paeth=4,
-   F_avg_first, F_paeth_first
-};
+   if (filter == F_paeth)
+      png_paeth_ssse3(cur, prior, raw, x, img_n, out_n, _mm_cvtsi32_si128(out_n > img_n ? (int) 0xff000000 : 0));
+   else
+      png_unfilter_sse2(cur, prior, raw, x, filter, img_n, out_n);
+}
 
-static uint8 first_row_filter[5] =
+static png_unfilter_run png_unfilter_select(void)
 {
-   F_none, F_sub, F_none, F_avg_first, F_paeth_first
-};
+   int cpu = stbi_cpu_features();
+   if (cpu & STBI_CPU_SSSE3) return png_unfilter_ssse3;
+   if (cpu & STBI_CPU_SSE2) return png_unfilter_sse2;
+   return NULL;
+}
 
-static int paeth(int a, int b, int c)
+static png_unfilter_run png_unfilter_installed = png_unfilter_select();
+#endif // STBI_SIMD_X86
+
+// undo the filter of one row. cur and prior have out_n bytes per pixel, raw
+// img_n; 'filter' has been through first_row_filter for the first row, so
+// prior isn't read there
+static void png_unfilter_row(uint8 *cur, uint8 *prior, uint8 *raw, uint32 x, int filter, int img_n, int out_n)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   uint32 i;
+   int k;
+   #ifdef STBI_SIMD_X86
+   if (png_unfilter_installed && img_n >= 3) {
+      png_unfilter_installed(cur, prior, raw, x, filter, img_n, out_n);
+      return;
+   }
+   #endif
+   // handle first pixel explicitly
+   for (k=0; k < img_n; ++k) {
+      switch (filter) {
+         case F_none       : cur[k] = raw[k]; break;
+         case F_sub        : cur[k] = raw[k]; break;
+         case F_up         : cur[k] = raw[k] + prior[k]; break;
+         case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
+         case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
+         case F_avg_first  : cur[k] = raw[k]; break;
+         case F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
+   if (img_n != out_n) cur[img_n] = 255;
+   raw += img_n;
+   cur += out_n;
+   prior += out_n;
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (img_n == out_n) {
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
+                for (k=0; k < img_n; ++k)
+      switch (filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
+      }
+      #undef CASE
+   } else {
+      assert(img_n+1 == out_n);
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
+                for (k=0; k < img_n; ++k)
+      switch (filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
+      }
+      #undef CASE
+   }
 }
 
 // create the png data from post-deflated data
-static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
+// What happens to a row after unfiltering: color key, iPhone BGR, palette
+// and req_comp, in that order (see png_post_row)
+typedef struct
+{
+   int out_n;           // channels coming out of unfiltering
+   int pal_img_n;       // palette channels, 0 without a palette
+   int pal_n;           // channels after the palette lookup
+   int final_n;         // channels after all of it
+   int iphone, unpremultiply;
+   uint8 *palette, *tc; // tc is NULL without a tRNS color key
+} png_post;
+
+static uint8 *png_post_row(png_post *pp, uint8 *row, uint32 x, uint8 *pixels, uint8 *dest);
+
+// With 'post', the image is unfiltered into two rows that take turns as the
+// prior one, and each row is finished straight into a->out, final_n
+// channels per pixel; that saves a pass and a full-size buffer for every
+// step that changes the pixel format.
+static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y, png_post *post)
 {
    stbi *s = a->s;
-   uint32 i,j,stride = x*out_n;
-   int k;
+   uint32 j,stride = x*out_n;
    int img_n = s->img_n; // copy it into a local for later
+   uint8 *rows = NULL;
    assert(out_n == s->img_n || out_n == s->img_n+1);
-   if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
+   if (s->png_partial) y = 1;
+   a->out = (uint8 *) stbi_malloc(x * y * (post ? post->final_n : out_n));
    if (!a->out) return e("outofmem", "Out of memory");
-   if (!stbi_png_partial) {
+   if (!s->png_partial) {
       if (s->img_x == x && s->img_y == y) {
          if (raw_len != (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
       } else { // interlaced:
          if (raw_len < (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
       }
    }
+   if (post) {
+      rows = (uint8 *) stbi_malloc(x * 4 * 3);
+      if (!rows) return e("outofmem", "Out of memory");
+   }
    for (j=0; j < y; ++j) {
-      uint8 *cur = a->out + stride*j;
-      uint8 *prior = cur - stride;
+      uint8 *cur = post ? rows + (j & 1) * x * 4 : a->out + stride*j;
+      uint8 *prior = post ? rows + (~j & 1) * x * 4 : cur - stride;
       int filter = *raw++;
-      if (filter > 4) return e("invalid filter","Corrupt PNG");
+      if (filter > 4) { stbi_free(rows); return e("invalid filter","Corrupt PNG"); }
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
-      // handle first pixel explicitly
-      for (k=0; k < img_n; ++k) {
-         switch (filter) {
-            case F_none       : cur[k] = raw[k]; break;
-            case F_sub        : cur[k] = raw[k]; break;
-            case F_up         : cur[k] = raw[k] + prior[k]; break;
-            case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
-            case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
-            case F_avg_first  : cur[k] = raw[k]; break;
-            case F_paeth_first: cur[k] = raw[k]; break;
-         }
-      }
-      if (img_n != out_n) cur[img_n] = 255;
-      raw += img_n;
-      cur += out_n;
-      prior += out_n;
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (img_n == out_n) {
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
-         }
-         #undef CASE
-      } else {
-         assert(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
-         }
-         #undef CASE
-      }
+      png_unfilter_row(cur, prior, raw, x, filter, img_n, out_n);
+      if (post)
+         png_post_row(post, cur, x, rows + 2 * x * 4, a->out + j * x * post->final_n);
+      raw += x*img_n;
    }
+   stbi_free(rows);
    return 1;
 }
 
-static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
+// 'post' is only used for non-interlaced images
+static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced, png_post *post)
 {
    uint8 *final;
    int p;
    int save;
    if (!interlaced)
-      return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y);
-   save = stbi_png_partial;
-   stbi_png_partial = 0;
+      return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y, post);
+   save = a->s->png_partial;
+   a->s->png_partial = 0;
 
    // de-interlacing
-   final = (uint8 *) malloc(a->s->img_x * a->s->img_y * out_n);
+   final = (uint8 *) stbi_malloc(a->s->img_x * a->s->img_y * out_n);
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
@@ -2535,33 +4356,30 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
       x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
-         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y)) {
-            free(final);
+         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y, NULL)) {
+            stbi_free(final);
             return 0;
          }
          for (j=0; j < y; ++j)
             for (i=0; i < x; ++i)
                memcpy(final + (j*yspc[p]+yorig[p])*a->s->img_x*out_n + (i*xspc[p]+xorig[p])*out_n,
                       a->out + (j*x+i)*out_n, out_n);
-         free(a->out);
+         stbi_free(a->out);
          raw += (x*out_n+1)*y;
          raw_len -= (x*out_n+1)*y;
       }
    }
    a->out = final;
 
-   stbi_png_partial = save;
+   a->s->png_partial = save;
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+// compute color-based transparency, assuming we've
+// already got 255 as the alpha value in the output
+static void png_trans_pixels(uint8 *p, uint32 pixel_count, uint8 tc[3], int out_n)
 {
-   stbi *s = z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
-
-   // compute color-based transparency, assuming we've
-   // already got 255 as the alpha value in the output
+   uint32 i;
    assert(out_n == 2 || out_n == 4);
 
    if (out_n == 2) {
@@ -2576,20 +4394,17 @@ static int compute_transparency(png *z, uint8 tc[3], int out_n)
          p += 4;
       }
    }
-   return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+static int compute_transparency(png *z, uint8 tc[3], int out_n)
 {
-   uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   uint8 *p, *temp_out, *orig = a->out;
-
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
+   png_trans_pixels(z->out, z->s->img_x * z->s->img_y, tc, out_n);
+   return 1;
+}
 
+static void png_palette_pixels(uint8 *p, uint8 const *orig, uint32 pixel_count, uint8 *palette, int pal_img_n)
+{
+   uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2608,7 +4423,18 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
          p += 4;
       }
    }
-   free(a->out);
+}
+
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+{
+   uint32 pixel_count = a->s->img_x * a->s->img_y;
+   uint8 *temp_out;
+
+   temp_out = (uint8 *) stbi_malloc(pixel_count * pal_img_n);
+   if (temp_out == NULL) return e("outofmem", "Out of memory");
+
+   png_palette_pixels(temp_out, a->out, pixel_count, palette, pal_img_n);
+   stbi_free(a->out);
    a->out = temp_out;
 
    STBI_NOTUSED(len);
@@ -2616,9 +4442,6 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
    return 1;
 }
 
-static int stbi_unpremultiply_on_load = 0;
-static int stbi_de_iphone_flag = 0;
-
 void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
    stbi_unpremultiply_on_load = flag_true_if_should_unpremultiply;
@@ -2628,13 +4451,10 @@ void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
    stbi_de_iphone_flag = flag_true_if_should_convert;
 }
 
-static void stbi_de_iphone(png *z)
+static void de_iphone_pixels(uint8 *p, uint32 pixel_count, int out_n, int unpremultiply)
 {
-   stbi *s = z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
-
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   uint32 i;
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          uint8 t = p[0];
          p[0] = p[2];
@@ -2642,8 +4462,8 @@ static void stbi_de_iphone(png *z)
          p += 3;
       }
    } else {
-      assert(s->img_out_n == 4);
-      if (stbi_unpremultiply_on_load) {
+      assert(out_n == 4);
+      if (unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             uint8 a = p[3];
@@ -2670,6 +4490,234 @@ static void stbi_de_iphone(png *z)
    }
 }
 
+static void stbi_de_iphone(png *z)
+{
+   stbi *s = z->s;
+   de_iphone_pixels(z->out, s->img_x * s->img_y, s->img_out_n, s->unpremultiply_on_load);
+}
+
+static void png_post_init(png_post *pp, stbi *s, int out_n, int pal_img_n, uint8 *palette, uint8 *tc, int iphone, int req_comp)
+{
+   pp->out_n = out_n;
+   pp->pal_img_n = pal_img_n;
+   pp->pal_n = pal_img_n ? (req_comp >= 3 ? req_comp : pal_img_n) : out_n;
+   pp->final_n = req_comp ? req_comp : pp->pal_n;
+   pp->iphone = iphone && out_n > 2;
+   pp->unpremultiply = s->unpremultiply_on_load;
+   pp->palette = palette;
+   pp->tc = tc;
+}
+
+// finish one unfiltered row of x pixels. The color key only sets alpha,
+// which unfiltering the next row ignores; anything else leaves 'row' alone,
+// it's the next row's prior. Returns the finished pixels: 'row' itself if
+// nothing changed the format, otherwise 'dest' ('pixels' is scratch space).
+static uint8 *png_post_row(png_post *pp, uint8 *row, uint32 x, uint8 *pixels, uint8 *dest)
+{
+   uint8 *out = row;
+   int n = pp->out_n;
+   int convert = pp->final_n != pp->pal_n;
+   if (pp->tc)
+      png_trans_pixels(out, x, pp->tc, n);
+   if (pp->iphone) {
+      uint8 *t = convert ? pixels : dest;
+      memcpy(t, out, x*n);
+      out = t;
+      de_iphone_pixels(out, x, n, pp->unpremultiply);
+   }
+   if (pp->pal_img_n) {
+      uint8 *t = convert ? pixels : dest;
+      png_palette_pixels(t, out, x, pp->palette, pp->pal_n);
+      out = t;
+      n = pp->pal_n;
+   }
+   if (convert) {
+      convert_row(dest, out, n, pp->final_n, x);
+      out = dest;
+   }
+   return out;
+}
+
+// size of the filtered scanlines, so inflate can allocate its output once
+static uint32 png_raw_size(uint32 x, uint32 y, int img_n, int interlace)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   uint32 total = 0;
+   int p;
+   if (!interlace)
+      return (x*img_n + 1) * y;
+   for (p=0; p < 7; ++p) {
+      uint32 px = (x - xorig[p] + xspc[p]-1) / xspc[p];
+      uint32 py = (y - yorig[p] + yspc[p]-1) / yspc[p];
+      if (px && py)
+         total += (px*img_n + 1) * py;
+   }
+   return total;
+}
+
+// Row by row decoding for stbi_png_load_rows*. Instead of collecting all
+// IDATs and inflating into one buffer, inflate pulls IDAT data through a
+// small input buffer as it needs it (png_stream_refill) and writes into a
+// window that's passed on whenever it fills up (png_stream_flush). A row is
+// unfiltered as soon as it's complete, it only needs the one before it, so
+// memory use is the window plus a few rows whatever the image size.
+#define STBI_PNG_STREAM_WINDOW  32768   // longest deflate distance
+#define STBI_PNG_STREAM_OUTPUT  131072  // new output between flushes
+#define STBI_PNG_STREAM_INPUT   16384
+
+typedef struct png_stream
+{
+   stbi *s;
+   stbi_png_row_callbacks const *cb;
+   void *user;
+
+   zbuf z;
+   uint32 idat_left;   // bytes of the current IDAT not read yet
+   int idat_done;
+   uint32 consumed;    // bytes at the start of the window already used
+
+   uint32 y;           // next row to deliver
+   uint32 raw_len;     // filtered row, filter byte included
+   uint32 raw_have;    // bytes of it collected in 'raw'
+   png_post post;
+
+   uint8 *input, *window, *raw, *cur, *prior, *pixels, *converted;
+} png_stream;
+
+static int png_stream_refill(zbuf *z)
+{
+   png_stream *ps = (png_stream *) z->stream;
+   uint32 n;
+   int keep;
+   if (ps->idat_done) return 0;
+   // keep the last few bytes in front of the new ones, so that a stored
+   // block can give back what the bit buffer read ahead
+   keep = z->zbuffer_end - ps->input < 8 ? (int) (z->zbuffer_end - ps->input) : 8;
+   memmove(ps->input, z->zbuffer_end - keep, keep);
+   z->zbuffer = z->zbuffer_end = ps->input + keep;
+   while (ps->idat_left == 0) {
+      chunk c;
+      get32(ps->s); // CRC of the IDAT just finished
+      c = get_chunk_header(ps->s);
+      if (c.type != PNG_TYPE('I','D','A','T')) {
+         ps->idat_done = 1;
+         return 0;
+      }
+      ps->idat_left = c.length;
+   }
+   n = ps->idat_left < STBI_PNG_STREAM_INPUT ? ps->idat_left : STBI_PNG_STREAM_INPUT;
+   if (!getn(ps->s, z->zbuffer, n)) {
+      ps->idat_done = 1;
+      return 0;
+   }
+   ps->idat_left -= n;
+   z->zbuffer_end += n;
+   return 1;
+}
+
+// unfilter one row, do what parse_png_file does to the whole image after
+// that, and hand it to the caller
+static int png_stream_row(png_stream *ps, uint8 *raw)
+{
+   stbi *s = ps->s;
+   uint32 x = s->img_x;
+   uint8 *out, *t;
+   int filter = raw[0];
+   if (filter > 4) return e("invalid filter","Corrupt PNG");
+   if (ps->y == 0) filter = first_row_filter[filter];
+   png_unfilter_row(ps->cur, ps->prior, raw+1, x, filter, s->img_n, ps->post.out_n);
+   out = png_post_row(&ps->post, ps->cur, x, ps->pixels, ps->converted);
+   if (!ps->cb->row(ps->user, (int) ps->y, out)) return e("stopped","Stopped by row callback");
+   t = ps->prior; ps->prior = ps->cur; ps->cur = t;
+   ++ps->y;
+   return 1;
+}
+
+static int png_stream_flush(zbuf *z)
+{
+   png_stream *ps = (png_stream *) z->stream;
+   uint8 *p = (uint8 *) z->zout_start + ps->consumed;
+   uint8 *end = (uint8 *) z->zout;
+   uint32 keep;
+   // whatever follows the last row is ignored
+   while (p < end && ps->y < ps->s->img_y) {
+      if (ps->raw_have == 0 && (uint32) (end - p) >= ps->raw_len) {
+         // the whole row is in the window, no need to copy it
+         if (!png_stream_row(ps, p)) return 0;
+         p += ps->raw_len;
+      } else {
+         uint32 n = ps->raw_len - ps->raw_have;
+         if (n > (uint32) (end - p)) n = (uint32) (end - p);
+         memcpy(ps->raw + ps->raw_have, p, n);
+         ps->raw_have += n;
+         p += n;
+         if (ps->raw_have == ps->raw_len) {
+            if (!png_stream_row(ps, ps->raw)) return 0;
+            ps->raw_have = 0;
+         }
+      }
+   }
+   // slide the window down, keeping what later matches may copy from
+   keep = (uint32) (z->zout - z->zout_start);
+   if (keep > STBI_PNG_STREAM_WINDOW) keep = STBI_PNG_STREAM_WINDOW;
+   memmove(z->zout_start, z->zout - keep, keep);
+   z->zout = z->zout_start + keep;
+   ps->consumed = keep;
+   return 1;
+}
+
+// called at the first IDAT, of length idat_len, with the header chunks parsed
+static int png_stream_image(png *z, uint32 idat_len, uint8 *palette, int pal_img_n, uint8 *tc, int iphone, int req_comp)
+{
+   stbi *s = z->s;
+   png_stream *ps = z->stream;
+   uint32 row = s->img_x * 4;
+   uint8 *block;
+   int ok;
+
+   // same output layout as the IEND case below
+   png_post_init(&ps->post, s, (req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || tc ? s->img_n+1 : s->img_n,
+                 pal_img_n, palette, tc, iphone, req_comp);
+   // a color key counts as alpha here, unlike stbi_load's *comp, so that it
+   // always says what the rows hold with req_comp 0
+   if (ps->cb->begin && !ps->cb->begin(ps->user, s->img_x, s->img_y, pal_img_n ? pal_img_n : tc ? s->img_n+1 : s->img_n))
+      return e("stopped","Stopped by row callback");
+
+   ps->raw_len = s->img_x * s->img_n + 1;
+   block = (uint8 *) stbi_malloc(8 + STBI_PNG_STREAM_INPUT + STBI_PNG_STREAM_WINDOW + STBI_PNG_STREAM_OUTPUT + ps->raw_len + 4*row);
+   if (block == NULL) return e("outofmem", "Out of memory");
+   ps->input     = block;
+   ps->window    = ps->input + 8 + STBI_PNG_STREAM_INPUT;
+   ps->raw       = ps->window + STBI_PNG_STREAM_WINDOW + STBI_PNG_STREAM_OUTPUT;
+   ps->cur       = ps->raw + ps->raw_len;
+   ps->prior     = ps->cur + row;
+   ps->pixels    = ps->prior + row;
+   ps->converted = ps->pixels + row;
+
+   ps->s = s;
+   ps->idat_left = idat_len;
+   ps->idat_done = 0;
+   ps->consumed = 0;
+   ps->y = 0;
+   ps->raw_have = 0;
+   ps->z.zbuffer = ps->z.zbuffer_end = ps->input;
+   ps->z.zout_start = ps->z.zout = (char *) ps->window;
+   ps->z.zout_end = ps->z.zout_start + STBI_PNG_STREAM_WINDOW + STBI_PNG_STREAM_OUTPUT;
+   ps->z.z_expandable = 0;
+   ps->z.partial = 0;
+   ps->z.refill = png_stream_refill;
+   ps->z.flush = png_stream_flush;
+   ps->z.stream = ps;
+
+   ok = parse_zlib(&ps->z, !iphone) && png_stream_flush(&ps->z);
+   if (ok && ps->y != s->img_y) ok = e("not enough pixels","Corrupt PNG");
+   stbi_free(block);
+   return ok;
+}
+
 static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
@@ -2690,7 +4738,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
       chunk c = get_chunk_header(s);
       switch (c.type) {
          case PNG_TYPE('C','g','B','I'):
-            iphone = stbi_de_iphone_flag;
+            iphone = s->de_iphone_flag;
             skip(s, c.length);
             break;
          case PNG_TYPE('I','H','D','R'): {
@@ -2759,32 +4807,49 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return e("no PLTE","Corrupt PNG");
             if (scan == SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (z->stream) {
+               // png_stream_refill reads the rest of the IDATs
+               if (interlace) return e("interlaced","PNG not supported: interlaced rows can't be streamed");
+               return png_stream_image(z, c.length, palette, pal_img_n, has_trans ? tc : NULL, iphone, req_comp);
+            }
             if (ioff + c.length > idata_limit) {
                uint8 *p;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
-               p = (uint8 *) realloc(z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
+               p = (uint8 *) stbi_realloc(z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
                z->idata = p;
             }
-            if (!getn(s, z->idata+ioff,c.length)) return e("outofdata","Corrupt PNG");
+            if (c.length && !getn(s, z->idata+ioff,c.length)) return e("outofdata","Corrupt PNG");
             ioff += c.length;
             break;
          }
 
          case PNG_TYPE('I','E','N','D'): {
             uint32 raw_len;
+            png_post post;
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
+            // the header tells us exactly how much inflate will produce
+            raw_len = png_raw_size(s->img_x, s->img_y, s->img_n, interlace);
+            z->expanded = (uint8 *) zlib_decode_malloc_partial((char *) z->idata, ioff, raw_len > 0 ? raw_len : 1, (int *) &raw_len, !iphone, s->png_partial);
             if (z->expanded == NULL) return 0; // zlib should set error
-            free(z->idata); z->idata = NULL;
+            stbi_free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
+            png_post_init(&post, s, s->img_out_n, pal_img_n, palette, has_trans ? tc : NULL, iphone, req_comp);
+            if (!interlace && post.final_n != s->img_out_n) {
+               // the format changes, so finish every row as it's unfiltered
+               if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace, &post)) return 0;
+               if (pal_img_n) s->img_n = pal_img_n; // record the actual colors we had
+               s->img_out_n = post.final_n;
+               stbi_free(z->expanded); z->expanded = NULL;
+               return 1;
+            }
+            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace, NULL)) return 0;
             if (has_trans)
                if (!compute_transparency(z, tc, s->img_out_n)) return 0;
             if (iphone && s->img_out_n > 2)
@@ -2797,7 +4862,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (!expand_palette(z, palette, pal_len, s->img_out_n))
                   return 0;
             }
-            free(z->expanded); z->expanded = NULL;
+            stbi_free(z->expanded); z->expanded = NULL;
             return 1;
          }
 
@@ -2806,8 +4871,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (first) return e("first not IHDR", "Corrupt PNG");
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
-               // not threadsafe
-               static char invalid_chunk[] = "XXXX chunk not known";
+               static STBI_THREAD_LOCAL char invalid_chunk[] = "XXXX chunk not known";
                invalid_chunk[0] = (uint8) (c.type >> 24);
                invalid_chunk[1] = (uint8) (c.type >> 16);
                invalid_chunk[2] = (uint8) (c.type >>  8);
@@ -2839,9 +4903,9 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   free(p->out);      p->out      = NULL;
-   free(p->expanded); p->expanded = NULL;
-   free(p->idata);    p->idata    = NULL;
+   stbi_free(p->out);      p->out      = NULL;
+   stbi_free(p->expanded); p->expanded = NULL;
+   stbi_free(p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -2850,6 +4914,7 @@ static unsigned char *stbi_png_load(stbi *s, int *x, int *y, int *comp, int req_
 {
    png p;
    p.s = s;
+   p.stream = NULL;
    return do_png(&p, x,y,comp,req_comp);
 }
 
@@ -2877,9 +4942,63 @@ static int      stbi_png_info(stbi *s, int *x, int *y, int *comp)
 {
    png p;
    p.s = s;
+   p.stream = NULL;
    return stbi_png_info_raw(&p, x, y, comp);
 }
 
+static int stbi_png_load_rows_main(stbi *s, stbi_png_row_callbacks const *rows, void *user, int req_comp)
+{
+   png p;
+   png_stream ps;
+   int r;
+   if (req_comp < 0 || req_comp > 4) return e("bad req_comp", "Internal error");
+   if (!stbi_png_test(s)) return e("not PNG", "Row by row decoding only supports PNG");
+   ps.cb = rows;
+   ps.user = user;
+   p.s = s;
+   p.stream = &ps;
+   r = parse_png_file(&p, SCAN_load, req_comp);
+   stbi_free(p.out);
+   stbi_free(p.expanded);
+   stbi_free(p.idata);
+   return r;
+}
+
+int stbi_png_load_rows_from_memory(stbi_uc const *buffer, int len, stbi_png_row_callbacks const *rows, void *user, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_png_load_rows_main(&s,rows,user,req_comp);
+}
+
+int stbi_png_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *clbk_user, stbi_png_row_callbacks const *rows, void *user, int req_comp)
+{
+   stbi s;
+   start_callbacks(&s, (stbi_io_callbacks *) clbk, clbk_user);
+   return stbi_png_load_rows_main(&s,rows,user,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_png_load_rows(char const *filename, stbi_png_row_callbacks const *rows, void *user, int req_comp)
+{
+   stbi s;
+   FILE *f;
+   int result;
+   stbi_mapping m;
+   if (stbi_map_file(&m, filename)) {
+      result = stbi_png_load_rows_from_memory(m.data, m.len, rows, user, req_comp);
+      stbi_unmap_file(&m);
+      return result;
+   }
+   f = fopen(filename, "rb");
+   if (!f) return e("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   result = stbi_png_load_rows_main(&s,rows,user,req_comp);
+   fclose(f);
+   return result;
+}
+#endif
+
 // Microsoft/Windows BMP image
 
 static int bmp_test(stbi *s)
@@ -2969,7 +5088,10 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    bpp = get16le(s);
    if (bpp == 1) return epuc("monochrome", "BMP type not supported: 1-bit");
    flip_vertically = ((int) s->img_y) > 0;
-   s->img_y = abs((int) s->img_y);
+   if ((int) s->img_y < 0) s->img_y = 0u - s->img_y; // top-down
+   // a negative width, or a size that overflows the buffer math below
+   if ((int) s->img_x <= 0 || (int) s->img_y <= 0 || (1 << 28) / s->img_x < s->img_y)
+      return epuc("too large", "Corrupt BMP");
    if (hsz == 12) {
       if (bpp < 24)
          psize = (offset - 14 - 24) / 3;
@@ -3032,11 +5154,11 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       target = req_comp;
    else
       target = s->img_n; // if they want monochrome, we'll post-convert
-   out = (stbi_uc *) malloc(target * s->img_x * s->img_y);
+   out = (stbi_uc *) stbi_malloc(target * s->img_x * s->img_y);
    if (!out) return epuc("outofmem", "Out of memory");
    if (bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { free(out); return epuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi_free(out); return epuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = get8u(s);
          pal[i][1] = get8u(s);
@@ -3047,7 +5169,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       skip(s, offset - 14 - hsz - psize * (hsz == 12 ? 3 : 4));
       if (bpp == 4) width = (s->img_x + 1) >> 1;
       else if (bpp == 8) width = s->img_x;
-      else { free(out); return epuc("bad bpp", "Corrupt BMP"); }
+      else { stbi_free(out); return epuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       for (j=0; j < (int) s->img_y; ++j) {
          for (i=0; i < (int) s->img_x; i += 2) {
@@ -3085,7 +5207,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { free(out); return epuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi_free(out); return epuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = high_bit(mr)-7; rcount = bitcount(mr);
          gshift = high_bit(mg)-7; gcount = bitcount(mr);
@@ -3282,7 +5404,7 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       //   force a new number of components
       *comp = tga_bits_per_pixel/8;
    }
-   tga_data = (unsigned char*)malloc( tga_width * tga_height * req_comp );
+   tga_data = (unsigned char*)stbi_malloc( tga_width * tga_height * req_comp );
    if (!tga_data) return epuc("outofmem", "Out of memory");
 
    //   skip to the data's starting position (offset usually = 0)
@@ -3293,11 +5415,11 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       //   any data to skip? (offset usually = 0)
       skip(s, tga_palette_start );
       //   load the palette
-      tga_palette = (unsigned char*)malloc( tga_palette_len * tga_palette_bits / 8 );
+      tga_palette = (unsigned char*)stbi_malloc( tga_palette_len * tga_palette_bits / 8 );
       if (!tga_palette) return epuc("outofmem", "Out of memory");
       if (!getn(s, tga_palette, tga_palette_len * tga_palette_bits / 8 )) {
-         free(tga_data);
-         free(tga_palette);
+         stbi_free(tga_data);
+         stbi_free(tga_palette);
          return epuc("bad palette", "Corrupt TGA");
       }
    }
@@ -3433,7 +5555,7 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    //   clear my palette, if I had one
    if ( tga_palette != NULL )
    {
-      free( tga_palette );
+      stbi_free( tga_palette );
    }
    //   the things I do to get rid of an error message, and yet keep
    //   Microsoft's C compilers happy... [8^(
@@ -3528,7 +5650,7 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       return epuc("bad compression", "PSD has an unknown compression format");
 
    // Create the destination image.
-   out = (stbi_uc *) malloc(4 * w*h);
+   out = (stbi_uc *) stbi_malloc(4 * w*h);
    if (!out) return epuc("outofmem", "Out of memory");
    pixelCount = w*h;
 
@@ -3818,11 +5940,11 @@ static stbi_uc *pic_load(stbi *s,int *px,int *py,int *comp,int req_comp)
    get16(s); //skip `pad'
 
    // intermediate buffer is RGBA
-   result = (stbi_uc *) malloc(x*y*4);
+   result = (stbi_uc *) stbi_malloc(x*y*4);
    memset(result, 0xff, x*y*4);
 
    if (!pic_load2(s,x,y,comp, result)) {
-      free(result);
+      stbi_free(result);
       result=0;
    }
    *px = x;
@@ -3868,6 +5990,9 @@ typedef struct stbi_gif_struct
    int max_x, max_y;
    int cur_x, cur_y;
    int line_size;
+   int delay;                    // of the frame last decoded, in 1/100s
+   int dispose;                  // what to do with its rectangle before the next one
+   uint8 *previous;              // the canvas under it, for dispose 3 (restore previous)
 } stbi_gif;
 
 static int gif_test(stbi *s)
@@ -3894,7 +6019,7 @@ static void stbi_gif_parse_colortable(stbi *s, uint8 pal[256][4], int num_entrie
       pal[i][2] = get8u(s);
       pal[i][1] = get8u(s);
       pal[i][0] = get8u(s);
-      pal[i][3] = transp ? 0 : 255;
+      pal[i][3] = i == transp ? 0 : 255;
    }   
 }
 
@@ -3981,6 +6106,7 @@ static uint8 *stbi_process_gif_raster(stbi *s, stbi_gif *g)
    stbi_gif_lzw *p;
 
    lzw_cs = get8u(s);
+   if (lzw_cs > 12) return epuc("bad code size", "Corrupt GIF");
    clear = 1 << lzw_cs;
    first = 1;
    codesize = lzw_cs + 1;
@@ -4051,41 +6177,62 @@ static uint8 *stbi_process_gif_raster(stbi *s, stbi_gif *g)
    }
 }
 
-static void stbi_fill_gif_background(stbi_gif *g)
+// x0,x1 are byte offsets in a row, y0,y1 of rows, like start_x/max_x and
+// start_y/max_y. The background is transparent, as browsers show it.
+static void stbi_fill_gif_background(stbi_gif *g, int x0, int y0, int x1, int y1)
 {
-   int i;
+   int x, y;
    uint8 *c = g->pal[g->bgindex];
-   // @OPTIMIZE: write a dword at a time
-   for (i = 0; i < g->w * g->h * 4; i += 4) {
-      uint8 *p  = &g->out[i];
-      p[0] = c[2];
-      p[1] = c[1];
-      p[2] = c[0];
-      p[3] = c[3];
+   for (y = y0; y < y1; y += g->w * 4) {
+      for (x = x0; x < x1; x += 4) {
+         uint8 *p = &g->out[y + x];
+         p[0] = c[2];
+         p[1] = c[1];
+         p[2] = c[0];
+         p[3] = 0;
+      }
    }
 }
 
-// this function is designed to support animated gifs, although stb_image doesn't support it
-static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
+// copy the rectangle x0..x1, y0..y1 (offsets as above) from one canvas to another
+static void stbi_copy_gif_rect(stbi_gif *g, uint8 *dest, uint8 const *src, int x0, int y0, int x1, int y1)
+{
+   int y;
+   for (y = y0; y < y1; y += g->w * 4)
+      memcpy(dest + y + x0, src + y + x0, x1 - x0);
+}
+
+// read the header and clear the canvas, which every frame is drawn onto
+// (allocated unless it's already there from a previous pass)
+static int stbi_gif_start(stbi *s, stbi_gif *g, int *comp)
+{
+   if (!stbi_gif_header(s, g, comp,0))     return 0; // failure_reason set by stbi_gif_header
+   if (g->w <= 0 || g->h <= 0 || (1 << 28) / g->w < g->h)
+                                          return e("bad size", "Corrupt GIF");
+   if (g->out == 0)
+      g->out = (uint8 *) stbi_malloc(4 * g->w * g->h);
+   if (g->out == 0)                       return e("outofmem", "Out of memory");
+   stbi_fill_gif_background(g, 0, 0, g->w * 4, g->w * g->h * 4);
+   g->dispose = 0;
+   return 1;
+}
+
+// composite the next frame onto g->out and return it, (uint8 *) 1 if
+// there are no more frames, NULL on error. The last frame's disposal is
+// applied first; it and a Graphic Control Extension only apply to one frame.
+static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g)
 {
    int i;
-   uint8 *old_out = 0;
 
-   if (g->out == 0) {
-      if (!stbi_gif_header(s, g, comp,0))     return 0; // failure_reason set by stbi_gif_header
-      g->out = (uint8 *) malloc(4 * g->w * g->h);
-      if (g->out == 0)                      return epuc("outofmem", "Out of memory");
-      stbi_fill_gif_background(g);
-   } else {
-      // animated-gif-only path
-      if (((g->eflags & 0x1C) >> 2) == 3) {
-         old_out = g->out;
-         g->out = (uint8 *) malloc(4 * g->w * g->h);
-         if (g->out == 0)                   return epuc("outofmem", "Out of memory");
-         memcpy(g->out, old_out, g->w*g->h*4);
-      }
-   }
-    
+   if (g->dispose == 2)
+      stbi_fill_gif_background(g, g->start_x, g->start_y, g->max_x, g->max_y);
+   else if (g->dispose == 3 && g->previous)
+      stbi_copy_gif_rect(g, g->out, g->previous, g->start_x, g->start_y, g->max_x, g->max_y);
+   g->dispose = 0;
+   g->eflags = 0;
+   g->transparent = -1;
+   g->delay = 0;
+
    for (;;) {
       switch (get8(s)) {
          case 0x2C: /* Image Descriptor */
@@ -4129,12 +6276,19 @@ static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
                g->color_table = (uint8 *) g->pal;
             } else
                return epuc("missing color table", "Corrupt GIF");
+
+            // keep what this frame covers if it's to be restored afterwards
+            if (((g->eflags & 0x1C) >> 2) == 3) {
+               if (g->previous == 0) {
+                  g->previous = (uint8 *) stbi_malloc(4 * g->w * g->h);
+                  if (g->previous == 0) return epuc("outofmem", "Out of memory");
+               }
+               stbi_copy_gif_rect(g, g->previous, g->out, g->start_x, g->start_y, g->max_x, g->max_y);
+            }
    
             o = stbi_process_gif_raster(s, g);
             if (o == NULL) return NULL;
-
-            if (req_comp && req_comp != 4)
-               o = convert_format(o, 4, req_comp, g->w, g->h);
+            g->dispose = (g->eflags & 0x1C) >> 2;
             return o;
          }
 
@@ -4145,7 +6299,7 @@ static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
                len = get8(s);
                if (len == 4) {
                   g->eflags = get8(s);
-                  get16le(s); // delay
+                  g->delay = get16le(s);
                   g->transparent = get8(s);
                } else {
                   skip(s, len);
@@ -4171,16 +6325,106 @@ static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    uint8 *u = 0;
    stbi_gif g={0};
 
-   u = stbi_gif_load_next(s, &g, comp, req_comp);
-   if (u == (void *) 1) u = 0;  // end of animated gif marker
-   if (u) {
-      *x = g.w;
-      *y = g.h;
+   if (!stbi_gif_start(s, &g, comp)) {
+      stbi_free(g.out);
+      return NULL;
    }
-
+   u = stbi_gif_load_next(s, &g);
+   stbi_free(g.previous);
+   if (u == NULL || u == (void *) 1) {  // error, or no frame at all
+      if (u) e("no frames", "Corrupt GIF");
+      stbi_free(g.out);
+      return NULL;
+   }
+   if (req_comp && req_comp != 4) {
+      u = convert_format(u, 4, req_comp, g.w, g.h);
+      if (u == NULL) return NULL;
+   }
+   *x = g.w;
+   *y = g.h;
    return u;
 }
 
+struct stbi_gif_frames
+{
+   stbi s;
+   stbi_gif g;
+   int req_comp;
+   int done;
+   stbi_uc *converted;   // the canvas in req_comp channels, when that isn't 4
+};
+
+stbi_gif_frames *stbi_gif_frames_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int req_comp)
+{
+   stbi_gif_frames *f;
+   int comp;
+   if (req_comp < 0 || req_comp > 4) { e("bad req_comp", "Internal error"); return NULL; }
+   f = (stbi_gif_frames *) stbi_malloc(sizeof(*f));
+   if (f == NULL) { e("outofmem", "Out of memory"); return NULL; }
+   memset(f, 0, sizeof(*f));
+   start_mem(&f->s, buffer, len);
+   f->req_comp = req_comp ? req_comp : 4;
+   if (!stbi_gif_test(&f->s)) {
+      stbi_free(f);
+      e("not GIF", "Image is not a GIF");
+      return NULL;
+   }
+   if (!stbi_gif_start(&f->s, &f->g, &comp)) {
+      stbi_gif_frames_close(f);
+      return NULL;
+   }
+   if (f->req_comp != 4) {
+      f->converted = (stbi_uc *) stbi_malloc(f->req_comp * f->g.w * f->g.h);
+      if (f->converted == NULL) {
+         stbi_gif_frames_close(f);
+         e("outofmem", "Out of memory");
+         return NULL;
+      }
+   }
+   *x = f->g.w;
+   *y = f->g.h;
+   return f;
+}
+
+int stbi_gif_frames_next(stbi_gif_frames *f, stbi_uc const **pixels, int *delay_ms)
+{
+   uint8 *u;
+   if (f->done) return 0;
+   u = stbi_gif_load_next(&f->s, &f->g);
+   if (u == NULL || u == (void *) 1) {
+      f->done = 1;
+      return u ? 0 : -1;
+   }
+   if (f->converted) {
+      convert_row(f->converted, u, 4, f->req_comp, f->g.w * f->g.h);
+      u = f->converted;
+   }
+   *pixels = u;
+   if (delay_ms) *delay_ms = f->g.delay * 10;
+   return 1;
+}
+
+int stbi_gif_frames_rewind(stbi_gif_frames *f)
+{
+   int comp;
+   stbi_rewind(&f->s);
+   f->done = 0;
+   if (!stbi_gif_start(&f->s, &f->g, &comp)) {
+      f->done = 1;
+      return 0;
+   }
+   return 1;
+}
+
+void stbi_gif_frames_close(stbi_gif_frames *f)
+{
+   if (f == NULL) return;
+   stbi_free(f->g.out);
+   stbi_free(f->g.previous);
+   stbi_free(f->converted);
+   stbi_free(f);
+}
+
 static int stbi_gif_info(stbi *s, int *x, int *y, int *comp)
 {
    return stbi_gif_info_raw(s,x,y,comp);
@@ -4231,18 +6475,27 @@ static char *hdr_gettoken(stbi *z, char *buffer)
    return buffer;
 }
 
-static void hdr_convert(float *output, stbi_uc *input, int req_comp)
+// 2^(e-136), the scale of an RGBE pixel with exponent byte e (1..255), made
+// straight from the float bits. That's exactly what ldexp(1.0f, e-136)
+// gives, including the denormals below e = 10.
+static stbi_inline float hdr_scale(int e)
 {
-   if ( input[3] != 0 ) {
-      float f1;
-      // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+   uint32 bits = e >= 10 ? (uint32) (e - 9) << 23 : (uint32) 1 << (e + 13);
+   float f;
+   memcpy(&f, &bits, 4);
+   return f;
+}
+
+static void hdr_convert(float *output, int r, int g, int b, int e, int req_comp)
+{
+   if ( e != 0 ) {
+      float f1 = hdr_scale(e);
       if (req_comp <= 2)
-         output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
+         output[0] = (r + g + b) * f1 / 3;
       else {
-         output[0] = input[0] * f1;
-         output[1] = input[1] * f1;
-         output[2] = input[2] * f1;
+         output[0] = r * f1;
+         output[1] = g * f1;
+         output[2] = b * f1;
       }
       if (req_comp == 2) output[1] = 1;
       if (req_comp == 4) output[3] = 1;
@@ -4258,17 +6511,237 @@ static void hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
-static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
+// convert 'count' pixels of a planar scanline (R, G, B and E planes 'stride'
+// bytes apart) to req_comp floats per pixel
+static void hdr_convert_row(float *output, uint8 const *rgbe, int stride, int count, int req_comp)
+{
+   int i;
+   for (i=0; i < count; ++i, output += req_comp)
+      hdr_convert(output, rgbe[i], rgbe[stride+i], rgbe[2*stride+i], rgbe[3*stride+i], req_comp);
+}
+
+// float to IEEE half, rounding to nearest even, too large values become
+// infinity (after Fabian Giesen's float_to_half_fast3_rtne)
+static unsigned short float_to_half(float f)
+{
+   uint32 u, sign, o;
+   memcpy(&u, &f, 4);
+   sign = u & 0x80000000u;
+   u ^= sign;
+   if (u >= (127 + 16) << 23) {
+      o = u > (255u << 23) ? 0x7e00 : 0x7c00; // NaN or infinity
+   } else if (u < 113 << 23) {
+      // a half denormal or zero: adding this magic value aligns the 10
+      // mantissa bits at the bottom and lets the FPU do the rounding
+      uint32 magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+      float magic;
+      memcpy(&magic, &magic_bits, 4);
+      memcpy(&f, &u, 4);
+      f += magic;
+      memcpy(&o, &f, 4);
+      o -= magic_bits;
+   } else {
+      uint32 mant_odd = (u >> 13) & 1;
+      u += ((uint32) (15 - 127) << 23) + 0xfff + mant_odd;
+      o = u >> 13;
+   }
+   return (unsigned short) (o | (sign >> 16));
+}
+
+static void float_to_half_row(unsigned short *output, float const *input, int count)
+{
+   int i;
+   for (i=0; i < count; ++i)
+      output[i] = float_to_half(input[i]);
+}
+
+#ifdef STBI_SIMD_X86
+typedef void (*hdr_convert_run)(float *output, uint8 const *rgbe, int stride, int count, int req_comp);
+typedef void (*float_to_half_run)(unsigned short *output, float const *input, int count);
+
+STBI_TARGET("sse2") static stbi_inline __m128i hdr_load4(uint8 const *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128()), _mm_setzero_si128());
+}
+
+// four pixels per step: the exponents become scale factors with integer ops
+// on the float bits, the colors are converted and scaled together and then
+// transposed into pixels. Same results as hdr_convert, which does groups
+// with denormal scales (e < 10) and the leftovers.
+STBI_TARGET("sse2") static void hdr_convert_sse2(float *output, uint8 const *rgbe, int stride, int count, int req_comp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i nine = _mm_set1_epi32(9), ten = _mm_set1_epi32(10);
+   __m128 one = _mm_set1_ps(1.0f), three = _mm_set1_ps(3.0f);
+   // three channel pixels are stored four floats wide, so one float lands
+   // past each group; keep a pixel back for that
+   int last = req_comp == 3 ? count-1 : count;
+   int i = 0, k;
+   for (; i+4 <= last; i += 4, output += 4*req_comp) {
+      __m128i r = hdr_load4(rgbe+i);
+      __m128i g = hdr_load4(rgbe+stride+i);
+      __m128i b = hdr_load4(rgbe+2*stride+i);
+      __m128i e = hdr_load4(rgbe+3*stride+i);
+      __m128i e_zero = _mm_cmpeq_epi32(e, zero);
+      __m128 scale;
+      if (_mm_movemask_epi8(_mm_andnot_si128(e_zero, _mm_cmplt_epi32(e, ten)))) {
+         for (k=0; k < 4; ++k)
+            hdr_convert(output + k*req_comp, rgbe[i+k], rgbe[stride+i+k], rgbe[2*stride+i+k], rgbe[3*stride+i+k], req_comp);
+         continue;
+      }
+      scale = _mm_castsi128_ps(_mm_andnot_si128(e_zero, _mm_slli_epi32(_mm_sub_epi32(e, nine), 23)));
+      if (req_comp <= 2) {
+         __m128 y = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(r, g), b)), scale), three);
+         if (req_comp == 1)
+            _mm_storeu_ps(output, y);
+         else {
+            _mm_storeu_ps(output,   _mm_unpacklo_ps(y, one));
+            _mm_storeu_ps(output+4, _mm_unpackhi_ps(y, one));
+         }
+      } else {
+         __m128 p0 = _mm_mul_ps(_mm_cvtepi32_ps(r), scale);
+         __m128 p1 = _mm_mul_ps(_mm_cvtepi32_ps(g), scale);
+         __m128 p2 = _mm_mul_ps(_mm_cvtepi32_ps(b), scale);
+         __m128 p3 = one;
+         _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+         _mm_storeu_ps(output,             p0);
+         _mm_storeu_ps(output+req_comp,    p1);
+         _mm_storeu_ps(output+2*req_comp,  p2);
+         _mm_storeu_ps(output+3*req_comp,  p3);
+      }
+   }
+   hdr_convert_row(output, rgbe+i, stride, count-i, req_comp);
+}
+
+STBI_TARGET("avx,f16c") static void float_to_half_f16c(unsigned short *output, float const *input, int count)
+{
+   int i = 0;
+   for (; i+4 <= count; i += 4)
+      _mm_storel_epi64((__m128i *) (output+i), _mm_cvtps_ph(_mm_loadu_ps(input+i), _MM_FROUND_TO_NEAREST_INT));
+   float_to_half_row(output+i, input+i, count-i);
+}
+
+static hdr_convert_run hdr_convert_installed = (stbi_cpu_features() & STBI_CPU_SSE2) ? hdr_convert_sse2 : hdr_convert_row;
+static float_to_half_run float_to_half_installed = (stbi_cpu_features() & STBI_CPU_F16C) ? float_to_half_f16c : float_to_half_row;
+#endif // STBI_SIMD_X86
+
+// convert the planar scanline j into the output image, through 'tmp'
+// (width*req_comp floats) if that's halves
+static void hdr_store_row(void *output, int half, float *tmp, uint8 const *scanline, int width, int req_comp, int j)
+{
+   size_t offset = (size_t) j * width * req_comp;
+   float *f = half ? tmp : (float *) output + offset;
+   #ifdef STBI_SIMD_X86
+   hdr_convert_installed(f, scanline, width, width, req_comp);
+   if (half) float_to_half_installed((unsigned short *) output + offset, tmp, width*req_comp);
+   #else
+   hdr_convert_row(f, scanline, width, width, req_comp);
+   if (half) float_to_half_row((unsigned short *) output + offset, tmp, width*req_comp);
+   #endif
+}
+
+// decode the new-style RLE scanline at p into four planes of 'width' bytes,
+// or only find its end if scanline is NULL. Returns the byte after it, or
+// NULL if it isn't one or it's corrupt.
+static uint8 *hdr_rle_scanline(uint8 *scanline, int width, uint8 *p, uint8 *end)
+{
+   int i, k, count;
+   if (end - p < 4 || p[0] != 2 || p[1] != 2 || (p[2] & 0x80) || (p[2] << 8 | p[3]) != width) return NULL;
+   p += 4;
+   for (k=0; k < 4; ++k) {
+      for (i=0; i < width; i += count) {
+         if (p >= end) return NULL;
+         count = *p++;
+         if (count > 128) {
+            // Run
+            count -= 128;
+            if (count > width - i || p >= end) return NULL;
+            if (scanline) memset(scanline + k*width + i, *p, count);
+            ++p;
+         } else {
+            // Dump
+            if (count == 0 || count > width - i || count > end - p) return NULL;
+            if (scanline) memcpy(scanline + k*width + i, p, count);
+            p += count;
+         }
+      }
+   }
+   return p;
+}
+
+// With a parallel_for installed and the file in memory, a quick pass finds
+// where the scanlines start (only counts are read, dumps are skipped), then
+// bands of them are decoded and converted on different threads.
+#define STBI_HDR_MAX_TASKS      64
+#define STBI_HDR_MIN_BAND_ROWS  16
+
+typedef struct
+{
+   int width, height, req_comp, half;
+   void *output;
+   uint8 *end;
+   int band_rows;
+   uint8 *band_start[STBI_HDR_MAX_TASKS];
+   int ok[STBI_HDR_MAX_TASKS];
+} hdr_parallel;
+
+static void hdr_decode_band(void *context, int band)
+{
+   hdr_parallel *h = (hdr_parallel *) context;
+   int j = band * h->band_rows, j1 = j + h->band_rows;
+   uint8 *p = h->band_start[band];
+   uint8 *scanline = (uint8 *) stbi_malloc(h->width * 4 + (h->half ? h->width * h->req_comp * sizeof(float) : 0));
+   h->ok[band] = scanline != NULL;
+   if (!scanline) return;
+   if (j1 > h->height) j1 = h->height;
+   for (; j < j1; ++j) {
+      p = hdr_rle_scanline(scanline, h->width, p, h->end); // can't fail, the prescan checked them
+      hdr_store_row(h->output, h->half, (float *) (scanline + h->width * 4), scanline, h->width, h->req_comp, j);
+   }
+   stbi_free(scanline);
+}
+
+static int hdr_decode_parallel(stbi *s, void *output, int width, int height, int req_comp, int half)
+{
+   hdr_parallel h;
+   uint8 *p = s->img_buffer;
+   int j, num_bands = height / STBI_HDR_MIN_BAND_ROWS;
+   if (num_bands > STBI_HDR_MAX_TASKS) num_bands = STBI_HDR_MAX_TASKS;
+   if (num_bands < 2) return 0;
+   h.band_rows = (height + num_bands - 1) / num_bands;
+   num_bands = (height + h.band_rows - 1) / h.band_rows;
+   for (j=0; j < height; ++j) {
+      if (j % h.band_rows == 0) h.band_start[j / h.band_rows] = p;
+      p = hdr_rle_scanline(NULL, width, p, s->img_buffer_end);
+      if (!p) return 0; // flat or corrupt, let the serial decoder deal with it
+   }
+   h.width = width;
+   h.height = height;
+   h.req_comp = req_comp;
+   h.half = half;
+   h.output = output;
+   h.end = p;
+   s->parallel_for(s->parallel_user, num_bands, hdr_decode_band, &h);
+   for (j=0; j < num_bands; ++j)
+      if (!h.ok[j]) return 0;
+   s->img_buffer = p;
+   return 1;
+}
+
+// returns floats, or halves (unsigned short) if 'half'
+static void *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp, int half)
 {
    char buffer[HDR_BUFLEN];
    char *token;
    int valid = 0;
    int width, height;
    stbi_uc *scanline;
-   float *hdr_data;
-   int len;
-   unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   void *hdr_data;
+   float *tmp;
+   int len, flat;
+   int i, j, k, c1,c2, count;
 
 
    // Check identifier
@@ -4294,6 +6767,7 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    if (strncmp(token, "+X ", 3))  return epf("unsupported data layout", "Unsupported HDR format");
    token += 3;
    width = strtol(token, NULL, 10);
+   if (width <= 0 || height <= 0 || (1 << 28) / width < height) return epf("too large", "Very large image (corrupt?)");
 
    *x = width;
    *y = height;
@@ -4302,76 +6776,92 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    if (req_comp == 0) req_comp = 3;
 
    // Read data
-   hdr_data = (float *) malloc(height * width * req_comp * sizeof(float));
-
-   // Load image data
-   // image data is stored as some number of sca
-   if ( width < 8 || width >= 32768) {
-      // Read flat data
-      for (j=0; j < height; ++j) {
-         for (i=0; i < width; ++i) {
-            stbi_uc rgbe[4];
-           main_decode_loop:
-            getn(s, rgbe, 4);
-            hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
-         }
-      }
-   } else {
-      // Read RLE-encoded data
-      scanline = NULL;
-
-      for (j = 0; j < height; ++j) {
+   hdr_data = stbi_malloc((size_t) height * width * req_comp * (half ? sizeof(unsigned short) : sizeof(float)));
+   if (hdr_data == NULL) return epf("outofmem", "Out of memory");
+
+   // image data is stored as some number of scanlines, RLE-encoded unless
+   // they're too short or long for that (or the writer just didn't)
+   flat = width < 8 || width >= 32768;
+   if (!flat && s->parallel_for && !s->io.read)
+      if (hdr_decode_parallel(s, hdr_data, width, height, req_comp, half))
+         return hdr_data;
+
+   // one planar scanline, then room for a row of floats when making halves
+   scanline = (stbi_uc *) stbi_malloc(width * 4 + (half ? width * req_comp * sizeof(float) : 0));
+   if (scanline == NULL) { stbi_free(hdr_data); return epf("outofmem", "Out of memory"); }
+   tmp = (float *) (scanline + width * 4);
+
+   for (j=0; j < height; ++j) {
+      i = 0;
+      if (!flat) {
          c1 = get8(s);
          c2 = get8(s);
          len = get8(s);
          if (c1 != 2 || c2 != 2 || (len & 0x80)) {
             // not run-length encoded, so we have to actually use THIS data as a decoded
-            // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-            uint8 rgbe[4];
-            rgbe[0] = (uint8) c1;
-            rgbe[1] = (uint8) c2;
-            rgbe[2] = (uint8) len;
-            rgbe[3] = (uint8) get8u(s);
-            hdr_convert(hdr_data, rgbe, req_comp);
+            // pixel (note this can't be a valid pixel--one of RGB must be >= 128);
+            // the rest of the file is read flat from here
+            scanline[0] = (uint8) c1;
+            scanline[width] = (uint8) c2;
+            scanline[2*width] = (uint8) len;
+            scanline[3*width] = get8u(s);
             i = 1;
-            j = 0;
-            free(scanline);
-            goto main_decode_loop; // yes, this makes no sense
-         }
-         len <<= 8;
-         len |= get8(s);
-         if (len != width) { free(hdr_data); free(scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
-         if (scanline == NULL) scanline = (stbi_uc *) malloc(width * 4);
-            
-         for (k = 0; k < 4; ++k) {
-            i = 0;
-            while (i < width) {
-               count = get8u(s);
-               if (count > 128) {
-                  // Run
-                  value = get8u(s);
-                  count -= 128;
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
-               } else {
-                  // Dump
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = get8u(s);
+            flat = 1;
+         } else {
+            len <<= 8;
+            len |= get8(s);
+            if (len != width) { stbi_free(hdr_data); stbi_free(scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
+            for (k = 0; k < 4; ++k) {
+               uint8 *plane = scanline + k*width;
+               for (i = 0; i < width; i += count) {
+                  count = get8u(s);
+                  if (count > 128) {
+                     // Run
+                     count -= 128;
+                     if (count > width - i) break;
+                     memset(plane + i, get8u(s), count);
+                  } else {
+                     // Dump
+                     if (count == 0 || count > width - i || !getn(s, plane + i, count)) break;
+                  }
                }
+               if (i < width) { stbi_free(hdr_data); stbi_free(scanline); return epf("bad RLE data", "corrupt HDR"); }
             }
          }
-         for (i=0; i < width; ++i)
-            hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
       }
-      free(scanline);
+      if (flat) {
+         // plain RGBE pixels
+         for (; i < width; ++i) {
+            scanline[i]         = get8u(s);
+            scanline[width+i]   = get8u(s);
+            scanline[2*width+i] = get8u(s);
+            scanline[3*width+i] = get8u(s);
+         }
+      }
+      hdr_store_row(hdr_data, half, tmp, scanline, width, req_comp, j);
    }
+   stbi_free(scanline);
 
    return hdr_data;
 }
 
 static float *stbi_hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
-   return hdr_load(s,x,y,comp,req_comp);
+   return (float *) hdr_load(s,x,y,comp,req_comp,0);
+}
+
+static unsigned short *stbi_hdr_load_half(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   return (unsigned short *) hdr_load(s,x,y,comp,req_comp,1);
+}
+
+static void stbi_float_to_half(unsigned short *output, float const *input, int count)
+{
+   #ifdef STBI_SIMD_X86
+   float_to_half_installed(output, input, count);
+   #else
+   float_to_half_row(output, input, count);
+   #endif
 }
 
 static int stbi_hdr_info(stbi *s, int *x, int *y, int *comp)
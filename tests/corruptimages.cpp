@@ -0,0 +1,47 @@
+/// Feeds every file given on the command line to each stb_image loader and
+/// checks that all of them refuse it cleanly.
+///
+/// Usage: corruptimages image...
+///
+/// The files in tests/corrupt are malformed images that once crashed a
+/// loader or read out of bounds; build this with sanitizers (make test) so
+/// a regression shows up as an error report rather than a lucky pass.
+#include "common.hpp"
+
+#define STBI_HEADER_FILE_ONLY
+#include "stb_image.cpp"
+
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[])
+{
+    int failures = 0;
+    for (int i = 1; i < argc; i++) {
+        const MappedFile file(argv[i]);
+        if (!file.isOpen()) {
+            std::cout << argv[i] << ": can't open file!" << std::endl;
+            failures++;
+            continue;
+        }
+
+        // Every requested channel count goes through its own conversion
+        for (int comp = 0; comp <= 4; comp++) {
+            int x, y, n;
+            const std::string what = std::string(argv[i]) + " (" + std::to_string(comp) + " channels)";
+            stbi_uc* ldr = stbi_load_from_memory(file.data(), file.size(), &x, &y, &n, comp);
+            float* hdr = stbi_loadf_from_memory(file.data(), file.size(), &x, &y, &n, comp);
+            unsigned short* half = stbi_loadh_from_memory(file.data(), file.size(), &x, &y, &n, comp);
+            if (ldr != nullptr || hdr != nullptr || half != nullptr) {
+                std::cout << what << ": loaded, expected an error" << std::endl;
+                failures++;
+            }
+            stbi_image_free(ldr);
+            stbi_image_free(hdr);
+            stbi_image_free(half);
+        }
+        std::cout << argv[i] << ": " << stbi_failure_reason() << std::endl;
+    }
+    std::cout << (failures == 0 ? "All corrupt images rejected" : "Some corrupt images were not rejected!") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
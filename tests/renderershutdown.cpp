@@ -0,0 +1,43 @@
+/// Destroys a Renderer that still holds resources stb_image allocated.
+///
+/// Usage: renderershutdown animated.gif
+///
+/// An animated texture keeps its GIF frame iterator, allocated through the
+/// Renderer's decode arena, until the Renderer goes. Build this with
+/// sanitizers (make test): freeing it after the arena allocator has been
+/// uninstalled shows up as a bad free.
+#include "common.hpp"
+#include "renderer.hpp"
+
+#include <GL/glew.h>
+#include <GL/glfw.h>
+
+#include <iostream>
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        std::cout << "Usage: renderershutdown animated.gif" << std::endl;
+        return 1;
+    }
+    if (glfwInit() != GL_TRUE) {
+        std::cout << "Failed to init glfw!" << std::endl;
+        return 1;
+    }
+    if (glfwOpenWindow(64,64, 8,8,8,0, 0,0,GLFW_WINDOW) != GL_TRUE) {
+        std::cout << "Failed to open a window!" << std::endl;
+        glfwTerminate();
+        return 2;
+    }
+    glewInit();
+
+    Renderer* renderer = new Renderer;
+    renderer->addAnimatedTexture(argv[1]);
+    // Decode a frame past the first, so the iterator holds state of its own
+    renderer->updateAnimations(1.0f);
+    delete renderer;
+
+    glfwTerminate();
+    std::cout << "Renderer shut down cleanly" << std::endl;
+    return 0;
+}
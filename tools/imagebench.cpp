@@ -0,0 +1,95 @@
+/// Decode throughput of stb_image over a set of files.
+///
+/// Usage: imagebench [-n iterations] [-s jpeg scale] [-j threads] image...
+///
+/// Every file is decoded from memory, so only the decoder is timed. Build it
+/// from two revisions and run both over the same images to compare changes.
+/// With -s 2, 4 or 8 JPEGs are decoded downscaled. -j hands stb_image a
+/// worker pool with that many threads (plus the caller) to split decodes.
+#include "common.hpp"
+#include "workers.hpp"
+
+#define STBI_HEADER_FILE_ONLY
+#include "stb_image.cpp"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+
+static void parallelFor(void* user, int count, void (*body)(void*, int), void* context)
+{
+    static_cast<WorkerPool*>(user)->parallelFor(count, [body, context](int i) { body(context, i); });
+}
+
+int main(int argc, char* argv[])
+{
+    int iterations = 10;
+    int scale = 1;
+    int threads = -1;
+    std::vector<std::string> filenames;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "-n" && i + 1 < argc)
+            iterations = std::atoi(argv[++i]);
+        else if (std::string(argv[i]) == "-s" && i + 1 < argc)
+            scale = std::atoi(argv[++i]);
+        else if (std::string(argv[i]) == "-j" && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.empty() || iterations <= 0) {
+        std::cout << "Usage: imagebench [-n iterations] [-s jpeg scale] [-j threads] image..." << std::endl;
+        return 1;
+    }
+
+    WorkerPool* workers = nullptr;
+    if (threads >= 0) {
+        workers = new WorkerPool(threads);
+        stbi_install_parallel_for(parallelFor, workers);
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    double totalSeconds = 0.0;
+    std::uint64_t totalPixels = 0, totalBytes = 0;
+    for (const std::string& filename: filenames) {
+        MappedFile file(filename);
+        if (!file.isOpen()) {
+            std::cout << "Failed to read " << filename << "!" << std::endl;
+            return 2;
+        }
+
+        int width = 0, height = 0, channels = 0;
+        double best = 1e30;
+        for (int i = 0; i < iterations; i++) {
+            const Clock::time_point start = Clock::now();
+            u8* pixels = scale == 1 ?
+                stbi_load_from_memory(file.data(), file.size(), &width, &height, &channels, 0) :
+                stbi_jpeg_load_scaled_from_memory(file.data(), file.size(), scale, &width, &height, &channels, 0);
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            if (pixels == nullptr) {
+                std::cout << "Failed to decode " << filename << ": " << stbi_failure_reason() << "!" << std::endl;
+                return 2;
+            }
+            stbi_image_free(pixels);
+            totalSeconds += seconds;
+            if (seconds < best)
+                best = seconds;
+        }
+        totalPixels += static_cast<std::uint64_t>(width)*height*iterations;
+        totalBytes += static_cast<std::uint64_t>(file.size())*iterations;
+
+        std::cout << filename << ": " << width << "x" << height << "x" << channels
+                  << ", best " << best*1000.0 << " ms, "
+                  << width*height / best / 1e6 << " Mpixel/s" << std::endl;
+    }
+
+    std::cout << "Total: " << totalSeconds*1000.0 << " ms, "
+              << totalPixels / totalSeconds / 1e6 << " Mpixel/s, "
+              << totalBytes / totalSeconds / 1e6 << " MB/s compressed" << std::endl;
+
+    stbi_install_parallel_for(nullptr, nullptr);
+    delete workers;
+    return 0;
+}
@@ -0,0 +1,261 @@
+/// Converts version 1 mesh files to the chunked, compressed version 2 layout
+/// (see renderer.hpp).
+///
+/// Usage: meshpack input.mesh output.mesh [chunk size in KiB, default 256]
+#include "common.hpp"
+#include "renderer.hpp"
+#include "workers.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+// Minimal zlib (RFC 1950/1951) encoder: greedy LZ77 over hash chains, coded
+// with the fixed Huffman tables. Not as tight as real zlib, but it's plenty
+// for vertex data and any inflate (stbi_zlib_decode_buffer included) reads it.
+class ZlibWriter {
+public:
+    explicit ZlibWriter(std::vector<u8>& out): out(out) {}
+
+    void compress(const u8* data, int size)
+    {
+        // CMF: deflate, 32K window. FLG: check bits, no dictionary.
+        out.push_back(0x78);
+        out.push_back(0x01);
+        putBits(1, 1); // final block
+        putBits(1, 2); // fixed Huffman codes
+
+        const int HASH_BITS = 15;
+        const int WINDOW = 32768;
+        const int MAX_CHAIN = 32;
+        std::vector<int> head(1 << HASH_BITS, -1);
+        std::vector<int> prev(size > 0 ? size : 1, -1);
+        auto hash = [data](int i) {
+            const u32 v = data[i] | (data[i+1] << 8) | (data[i+2] << 16);
+            return static_cast<int>((v * 2654435761u) >> (32 - HASH_BITS));
+        };
+        auto insert = [&](int i) {
+            if (i + 2 < size) {
+                const int h = hash(i);
+                prev[i] = head[h];
+                head[h] = i;
+            }
+        };
+
+        int i = 0;
+        while (i < size) {
+            int bestLen = 0, bestDist = 0;
+            if (i + 2 < size) {
+                const int maxLen = std::min(258, size - i);
+                int chain = MAX_CHAIN;
+                for (int j = head[hash(i)]; j >= 0 && i - j <= WINDOW && chain > 0; j = prev[j], chain--) {
+                    int len = 0;
+                    while (len < maxLen && data[j+len] == data[i+len])
+                        len++;
+                    if (len > bestLen) {
+                        bestLen = len;
+                        bestDist = i - j;
+                        if (len == maxLen)
+                            break;
+                    }
+                }
+            }
+            if (bestLen >= 3) {
+                putLength(bestLen);
+                putDistance(bestDist);
+                for (int k = 0; k < bestLen; k++)
+                    insert(i+k);
+                i += bestLen;
+            }
+            else {
+                putSymbol(data[i]);
+                insert(i);
+                i++;
+            }
+        }
+        putSymbol(256);
+        flushBits();
+
+        // Adler-32 of the uncompressed data, big-endian
+        u32 a = 1, b = 0;
+        for (int k = 0; k < size; k++) {
+            a = (a + data[k]) % 65521;
+            b = (b + a) % 65521;
+        }
+        const u32 adler = (b << 16) | a;
+        out.push_back(adler >> 24);
+        out.push_back(adler >> 16);
+        out.push_back(adler >> 8);
+        out.push_back(adler);
+    }
+
+private:
+    void putBits(u32 value, int count)
+    {
+        bitBuffer |= value << bitCount;
+        bitCount += count;
+        while (bitCount >= 8) {
+            out.push_back(bitBuffer & 0xff);
+            bitBuffer >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    void flushBits()
+    {
+        if (bitCount > 0)
+            out.push_back(bitBuffer & 0xff);
+        bitBuffer = 0;
+        bitCount = 0;
+    }
+
+    // Huffman codes are stored most significant bit first
+    void putCode(u32 code, int length)
+    {
+        u32 reversed = 0;
+        for (int k = 0; k < length; k++)
+            reversed |= ((code >> k) & 1) << (length-1-k);
+        putBits(reversed, length);
+    }
+
+    void putSymbol(int symbol)
+    {
+        if (symbol <= 143)      putCode(0x30  + symbol,       8);
+        else if (symbol <= 255) putCode(0x190 + symbol - 144, 9);
+        else if (symbol <= 279) putCode(        symbol - 256, 7);
+        else                    putCode(0xc0  + symbol - 280, 8);
+    }
+
+    void putLength(int length)
+    {
+        static const int base[29]  = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+        static const int extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        int code = 28;
+        while (base[code] > length)
+            code--;
+        putSymbol(257 + code);
+        if (extra[code])
+            putBits(length - base[code], extra[code]);
+    }
+
+    void putDistance(int distance)
+    {
+        static const int base[30]  = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+                                      1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+        static const int extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+        int code = 29;
+        while (base[code] > distance)
+            code--;
+        putCode(code, 5);
+        if (extra[code])
+            putBits(distance - base[code], extra[code]);
+    }
+
+    std::vector<u8>& out;
+    u32 bitBuffer = 0;
+    int bitCount = 0;
+};
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        std::cout << "Usage: meshpack input.mesh output.mesh [chunk size in KiB]" << std::endl;
+        return 1;
+    }
+    const u32 chunkSize = (argc > 3 ? std::atoi(argv[3]) : 256) * 1024;
+    if (chunkSize == 0) {
+        std::cout << "Invalid chunk size!" << std::endl;
+        return 1;
+    }
+
+    MappedFile input(argv[1]);
+    if (!input.isOpen() || input.size() < 2*sizeof(int)) {
+        std::cout << "Failed to read " << argv[1] << "!" << std::endl;
+        return 2;
+    }
+    int numVertices, numIndices;
+    std::memcpy(&numVertices, input.data(),               sizeof(int));
+    std::memcpy(&numIndices,  input.data() + sizeof(int), sizeof(int));
+    if (static_cast<u32>(numVertices) == MESH_FILE_MAGIC) {
+        std::cout << argv[1] << " is already a version 2 mesh!" << std::endl;
+        return 2;
+    }
+    const std::uint64_t streamSize[2] = {
+        static_cast<std::uint64_t>(numVertices)*sizeof(Vertex),
+        static_cast<std::uint64_t>(numIndices)*sizeof(Index)
+    };
+    if (numVertices < 0 || numIndices < 0 ||
+        2*sizeof(int) + streamSize[0] + streamSize[1] > input.size() ||
+        streamSize[0] + streamSize[1] > 0x7fffffff) {
+        std::cout << "Corrupt mesh " << argv[1] << "!" << std::endl;
+        return 2;
+    }
+
+    // Chunks never straddle the two streams
+    std::vector<MeshChunk> chunks;
+    for (u32 stream = 0; stream < 2; stream++) {
+        for (std::uint64_t offset = 0; offset < streamSize[stream]; offset += chunkSize) {
+            MeshChunk chunk;
+            chunk.stream = stream;
+            chunk.codec = MESH_CODEC_ZLIB;
+            chunk.rawOffset = offset;
+            chunk.rawSize = std::min<std::uint64_t>(chunkSize, streamSize[stream] - offset);
+            chunks.push_back(chunk);
+        }
+    }
+
+    const u8* streams[2] = {
+        input.data() + 2*sizeof(int),
+        input.data() + 2*sizeof(int) + streamSize[0]
+    };
+    std::vector<std::vector<u8>> payloads(chunks.size());
+    WorkerPool workers;
+    workers.parallelFor(chunks.size(), [&](int i) {
+        MeshChunk& chunk = chunks[i];
+        ZlibWriter(payloads[i]).compress(streams[chunk.stream] + chunk.rawOffset, chunk.rawSize);
+        // Incompressible chunks are cheaper to store than to inflate
+        if (payloads[i].size() >= chunk.rawSize) {
+            chunk.codec = MESH_CODEC_STORED;
+            payloads[i].assign(streams[chunk.stream] + chunk.rawOffset,
+                               streams[chunk.stream] + chunk.rawOffset + chunk.rawSize);
+        }
+    });
+
+    MeshFileHeader header;
+    header.magic = MESH_FILE_MAGIC;
+    header.version = MESH_FILE_VERSION;
+    header.numVertices = numVertices;
+    header.numIndices = numIndices;
+    header.numChunks = chunks.size();
+    std::uint64_t offset = sizeof(header) + chunks.size()*sizeof(MeshChunk);
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+        chunks[i].fileOffset = offset;
+        chunks[i].fileSize = payloads[i].size();
+        offset += payloads[i].size();
+    }
+    if (offset > 0xffffffffu) {
+        std::cout << "Output would exceed 4 GiB!" << std::endl;
+        return 3;
+    }
+
+    std::ofstream of(argv[2], std::ofstream::out | std::ofstream::binary);
+    if (!of.is_open()) {
+        std::cout << "Failed to write " << argv[2] << "!" << std::endl;
+        return 3;
+    }
+    of.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!chunks.empty())
+        of.write(reinterpret_cast<const char*>(&chunks[0]), chunks.size()*sizeof(MeshChunk));
+    for (const std::vector<u8>& payload: payloads) {
+        if (!payload.empty())
+            of.write(reinterpret_cast<const char*>(&payload[0]), payload.size());
+    }
+    of.close();
+
+    std::cout << argv[1] << ": " << input.size() << " -> " << offset << " bytes in "
+              << chunks.size() << " chunks" << std::endl;
+    return 0;
+}
@@ -0,0 +1,688 @@
+/// Compresses an image to the block formats Renderer::addCompressedTexture
+/// loads, as KTX files (see renderer.hpp).
+///
+/// Usage: texcompress [-f dxt|etc1|etc2] [-m box|kaiser] [-s] [-j threads] input output_basename
+///
+/// Writes output_basename.dxt.ktx (DXT1, DXT5 when the image has alpha),
+/// output_basename.etc2.ktx (ETC2 RGB8, RGBA8 with EAC alpha) and, for
+/// opaque images, output_basename.etc1.ktx; -f writes just one of them.
+/// -m stores a full mip chain built with that filter, -s filters colors in
+/// linear light. Rows of blocks are encoded in parallel on a pool of -j
+/// threads plus the caller (default: one per hardware thread).
+#include "common.hpp"
+#include "renderer.hpp"
+#include "workers.hpp"
+#include "mipmaps.hpp"
+
+#define STBI_HEADER_FILE_ONLY
+#include "stb_image.cpp"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+// 4x4 RGBA pixels, row by row; pixel (x, y) is at [y*4 + x]
+struct Block {
+    u8 pixels[16][4];
+};
+
+static int clampByte(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static int colorError(const int color[3], const u8* pixel)
+{
+    const int r = color[0] - pixel[0], g = color[1] - pixel[1], b = color[2] - pixel[2];
+    return r*r + g*g + b*b;
+}
+
+// --- DXT1 / DXT5 ---
+
+// Expanded the way decoders do it, the top bits repeat into the bottom ones
+static void unpack565(u16 c, int rgb[3])
+{
+    const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+static u16 pack565(const float rgb[3])
+{
+    const int r = static_cast<int>(std::min(std::max(rgb[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    const int g = static_cast<int>(std::min(std::max(rgb[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+    const int b = static_cast<int>(std::min(std::max(rgb[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    return static_cast<u16>((r << 11) | (g << 5) | b);
+}
+
+// Best endpoint pair (5 or 6 bits) for a solid channel value v, when the
+// block uses the 2/3 c0 + 1/3 c1 color: an exact 565 color is often further
+// off than a mix of two
+struct SolidColorTables {
+    u8 match5[256][2];
+    u8 match6[256][2];
+
+    SolidColorTables()
+    {
+        build(match5, 5);
+        build(match6, 6);
+    }
+
+    static void build(u8 table[256][2], int bits)
+    {
+        const int size = 1 << bits;
+        for (int v = 0; v < 256; v++) {
+            int bestError = 1 << 30;
+            for (int e0 = 0; e0 < size; e0++) {
+                for (int e1 = 0; e1 < size; e1++) {
+                    const int x0 = bits == 5 ? (e0 << 3) | (e0 >> 2) : (e0 << 2) | (e0 >> 4);
+                    const int x1 = bits == 5 ? (e1 << 3) | (e1 >> 2) : (e1 << 2) | (e1 >> 4);
+                    const int error = std::abs((2*x0 + x1) / 3 - v);
+                    if (error < bestError) {
+                        bestError = error;
+                        table[v][0] = e0;
+                        table[v][1] = e1;
+                    }
+                }
+            }
+        }
+    }
+};
+static const SolidColorTables solidColors;
+
+// Picks the nearest of the four colors for every pixel, returns the total error
+static int assignColorIndices(const Block& block, u16 c0, u16 c1, u8 indices[16])
+{
+    int palette[4][3];
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+    }
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestError = colorError(palette[0], block.pixels[i]);
+        for (int j = 1; j < 4; j++) {
+            const int error = colorError(palette[j], block.pixels[i]);
+            if (error < bestError) {
+                bestError = error;
+                best = j;
+            }
+        }
+        indices[i] = best;
+        total += bestError;
+    }
+    return total;
+}
+
+// Least-squares endpoints for the given indices, false if they're degenerate
+static bool fitEndpoints(const Block& block, const u8 indices[16], float e0[3], float e1[3])
+{
+    static const float weights[4] = {1.0f, 0.0f, 2.0f/3.0f, 1.0f/3.0f};
+    float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax[3] = {0.0f, 0.0f, 0.0f}, bx[3] = {0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 16; i++) {
+        const float a = weights[indices[i]], b = 1.0f - a;
+        aa += a*a;
+        bb += b*b;
+        ab += a*b;
+        for (int c = 0; c < 3; c++) {
+            ax[c] += a*block.pixels[i][c];
+            bx[c] += b*block.pixels[i][c];
+        }
+    }
+    const float det = aa*bb - ab*ab;
+    if (std::fabs(det) < 1e-6f)
+        return false;
+    for (int c = 0; c < 3; c++) {
+        e0[c] = (ax[c]*bb - bx[c]*ab) / det;
+        e1[c] = (bx[c]*aa - ax[c]*ab) / det;
+    }
+    return true;
+}
+
+// 8 bytes: c0 and c1 as little-endian RGB565, then 2 bits per pixel from
+// bit 0. c0 > c1 selects the four color mode, the only one used here (and
+// the only one DXT5 has).
+static void encodeColorBlock(const Block& block, u8* out)
+{
+    u16 c0, c1;
+    u8 indices[16];
+
+    bool solid = true;
+    for (int i = 1; i < 16 && solid; i++)
+        solid = std::memcmp(block.pixels[i], block.pixels[0], 3) == 0;
+    if (solid) {
+        const u8* p = block.pixels[0];
+        c0 = (solidColors.match5[p[0]][0] << 11) | (solidColors.match6[p[1]][0] << 5) | solidColors.match5[p[2]][0];
+        c1 = (solidColors.match5[p[0]][1] << 11) | (solidColors.match6[p[1]][1] << 5) | solidColors.match5[p[2]][1];
+        std::memset(indices, 2, sizeof(indices));
+    } else {
+        // Endpoints start at the extremes along the principal axis of the
+        // colors, then alternate between picking indices and refitting
+        float mean[3] = {0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++) {
+            for (int c = 0; c < 3; c++)
+                mean[c] += block.pixels[i][c] / 16.0f;
+        }
+        float cov[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++) {
+            const float r = block.pixels[i][0] - mean[0], g = block.pixels[i][1] - mean[1], b = block.pixels[i][2] - mean[2];
+            cov[0] += r*r; cov[1] += r*g; cov[2] += r*b;
+            cov[3] += g*g; cov[4] += g*b; cov[5] += b*b;
+        }
+        float axis[3] = {1.0f, 1.0f, 1.0f};
+        for (int iteration = 0; iteration < 8; iteration++) {
+            const float x = axis[0]*cov[0] + axis[1]*cov[1] + axis[2]*cov[2];
+            const float y = axis[0]*cov[1] + axis[1]*cov[3] + axis[2]*cov[4];
+            const float z = axis[0]*cov[2] + axis[1]*cov[4] + axis[2]*cov[5];
+            const float length = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+            if (length < 1e-6f)
+                break;
+            axis[0] = x / length;
+            axis[1] = y / length;
+            axis[2] = z / length;
+        }
+        int lo = 0, hi = 0;
+        float loDot = 1e30f, hiDot = -1e30f;
+        for (int i = 0; i < 16; i++) {
+            const float dot = block.pixels[i][0]*axis[0] + block.pixels[i][1]*axis[1] + block.pixels[i][2]*axis[2];
+            if (dot < loDot) { loDot = dot; lo = i; }
+            if (dot > hiDot) { hiDot = dot; hi = i; }
+        }
+        float e0[3], e1[3];
+        for (int c = 0; c < 3; c++) {
+            e0[c] = block.pixels[hi][c];
+            e1[c] = block.pixels[lo][c];
+        }
+        c0 = pack565(e0);
+        c1 = pack565(e1);
+        int bestError = assignColorIndices(block, c0, c1, indices);
+        for (int iteration = 0; iteration < 2 && bestError > 0; iteration++) {
+            if (!fitEndpoints(block, indices, e0, e1))
+                break;
+            const u16 n0 = pack565(e0), n1 = pack565(e1);
+            u8 newIndices[16];
+            const int error = assignColorIndices(block, n0, n1, newIndices);
+            if (error >= bestError)
+                break;
+            bestError = error;
+            c0 = n0;
+            c1 = n1;
+            std::memcpy(indices, newIndices, sizeof(indices));
+        }
+    }
+
+    // c0 <= c1 would mean the three color mode: swap into four color order.
+    // Equal endpoints can't be, so every pixel takes c0.
+    if (c0 < c1) {
+        std::swap(c0, c1);
+        for (int i = 0; i < 16; i++)
+            indices[i] ^= 1;
+    } else if (c0 == c1)
+        std::memset(indices, 0, sizeof(indices));
+
+    u32 bits = 0;
+    for (int i = 0; i < 16; i++)
+        bits |= static_cast<u32>(indices[i]) << (2*i);
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (bits >> (8*i)) & 0xff;
+}
+
+// Fills the eight alpha values a0 and a1 select, returns the total error of
+// the best index for every pixel
+static int assignAlphaIndices(const Block& block, int a0, int a1, u8 indices[16])
+{
+    int palette[8] = {a0, a1};
+    if (a0 > a1) {
+        for (int i = 2; i < 8; i++)
+            palette[i] = ((8 - i)*a0 + (i - 1)*a1) / 7;
+    } else {
+        for (int i = 2; i < 6; i++)
+            palette[i] = ((6 - i)*a0 + (i - 1)*a1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+        const int alpha = block.pixels[i][3];
+        int best = 0, bestError = std::abs(palette[0] - alpha);
+        for (int j = 1; j < 8; j++) {
+            const int error = std::abs(palette[j] - alpha);
+            if (error < bestError) {
+                bestError = error;
+                best = j;
+            }
+        }
+        indices[i] = best;
+        total += bestError*bestError;
+    }
+    return total;
+}
+
+// 8 bytes: a0, a1, then 3 bits per pixel from bit 0 (little-endian). a0 > a1
+// interpolates eight values; otherwise six, plus 0 and 255, which suits
+// blocks with cut-out edges.
+static void encodeAlphaBlock(const Block& block, u8* out)
+{
+    int lo = 255, hi = 0, innerLo = 255, innerHi = 0;
+    for (int i = 0; i < 16; i++) {
+        const int alpha = block.pixels[i][3];
+        lo = std::min(lo, alpha);
+        hi = std::max(hi, alpha);
+        if (alpha != 0 && alpha != 255) {
+            innerLo = std::min(innerLo, alpha);
+            innerHi = std::max(innerHi, alpha);
+        }
+    }
+
+    int a0 = hi, a1 = lo;
+    u8 indices[16];
+    const int error = assignAlphaIndices(block, a0, a1, indices);
+    if (error > 0 && (lo == 0 || hi == 255)) {
+        if (innerLo > innerHi)
+            innerLo = innerHi = 0;
+        u8 sixIndices[16];
+        if (assignAlphaIndices(block, innerLo, innerHi, sixIndices) < error) {
+            a0 = innerLo;
+            a1 = innerHi;
+            std::memcpy(indices, sixIndices, sizeof(indices));
+        }
+    }
+
+    u64 bits = 0;
+    for (int i = 0; i < 16; i++)
+        bits |= static_cast<u64>(indices[i]) << (3*i);
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (bits >> (8*i)) & 0xff;
+}
+
+static void encodeDxt1(const Block& block, u8* out)
+{
+    encodeColorBlock(block, out);
+}
+
+static void encodeDxt5(const Block& block, u8* out)
+{
+    encodeAlphaBlock(block, out);
+    encodeColorBlock(block, out + 8);
+}
+
+// --- ETC1 / ETC2 ---
+
+// Intensity modifiers, in the order of the 2-bit pixel indices
+static const int ETC_MODIFIERS[8][4] = {
+    {2, 8, -2, -8}, {5, 17, -5, -17}, {9, 29, -9, -29}, {13, 42, -13, -42},
+    {18, 60, -18, -60}, {24, 80, -24, -80}, {33, 106, -33, -106}, {47, 183, -47, -183}
+};
+
+struct EtcSubblock {
+    int error;
+    int table;
+    u8 indices[8];
+};
+
+// Pixels of subblock half (0 or 1) as (x, y): side by side 2x4 halves, or
+// with flip, 4x2 halves on top of each other
+static void subblockPixel(bool flip, int half, int i, int& x, int& y)
+{
+    if (flip) {
+        x = i & 3;
+        y = half*2 + (i >> 2);
+    } else {
+        x = half*2 + (i >> 2);
+        y = i & 3;
+    }
+}
+
+// Best modifier table and indices for a subblock around color
+static EtcSubblock fitSubblock(const Block& block, bool flip, int half, const int color[3])
+{
+    EtcSubblock best;
+    best.error = 1 << 30;
+    for (int table = 0; table < 8; table++) {
+        EtcSubblock candidate;
+        candidate.error = 0;
+        candidate.table = table;
+        for (int i = 0; i < 8 && candidate.error < best.error; i++) {
+            int x, y;
+            subblockPixel(flip, half, i, x, y);
+            const u8* pixel = block.pixels[y*4 + x];
+            int bestIndex = 0, bestError = 1 << 30;
+            for (int j = 0; j < 4; j++) {
+                const int modifier = ETC_MODIFIERS[table][j];
+                const int shifted[3] = {clampByte(color[0] + modifier), clampByte(color[1] + modifier), clampByte(color[2] + modifier)};
+                const int error = colorError(shifted, pixel);
+                if (error < bestError) {
+                    bestError = error;
+                    bestIndex = j;
+                }
+            }
+            candidate.indices[i] = bestIndex;
+            candidate.error += bestError;
+        }
+        if (candidate.error < best.error)
+            best = candidate;
+    }
+    return best;
+}
+
+// 8 bytes, one big-endian 64-bit word: base colors (two 4:4:4, or 5:5:5 and
+// a 3-bit signed delta), the two modifier tables, the diff and flip bits,
+// then the pixels' index high bits and low bits, both column by column.
+// Differential colors are kept in range, so ETC2 decoders read the block as
+// plain ETC1.
+static void encodeEtc1(const Block& block, u8* out)
+{
+    u64 bestBits = 0;
+    int bestError = 1 << 30;
+    for (int flip = 0; flip < 2; flip++) {
+        float average[2][3] = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+        for (int half = 0; half < 2; half++) {
+            for (int i = 0; i < 8; i++) {
+                int x, y;
+                subblockPixel(flip != 0, half, i, x, y);
+                for (int c = 0; c < 3; c++)
+                    average[half][c] += block.pixels[y*4 + x][c] / 8.0f;
+            }
+        }
+
+        for (int diff = 0; diff < 2; diff++) {
+            int base[2][3], color[2][3];
+            for (int c = 0; c < 3; c++) {
+                if (diff) {
+                    base[0][c] = static_cast<int>(average[0][c] * 31.0f / 255.0f + 0.5f);
+                    base[1][c] = static_cast<int>(average[1][c] * 31.0f / 255.0f + 0.5f);
+                    base[1][c] = base[0][c] + std::min(std::max(base[1][c] - base[0][c], -4), 3);
+                    color[0][c] = (base[0][c] << 3) | (base[0][c] >> 2);
+                    color[1][c] = (base[1][c] << 3) | (base[1][c] >> 2);
+                } else {
+                    base[0][c] = static_cast<int>(average[0][c] * 15.0f / 255.0f + 0.5f);
+                    base[1][c] = static_cast<int>(average[1][c] * 15.0f / 255.0f + 0.5f);
+                    color[0][c] = base[0][c] * 17;
+                    color[1][c] = base[1][c] * 17;
+                }
+            }
+            const EtcSubblock halves[2] = {
+                fitSubblock(block, flip != 0, 0, color[0]),
+                fitSubblock(block, flip != 0, 1, color[1])
+            };
+            const int error = halves[0].error + halves[1].error;
+            if (error >= bestError)
+                continue;
+
+            u64 bits = 0;
+            for (int c = 0; c < 3; c++) {
+                const int shift = 59 - 8*c;
+                if (diff) {
+                    bits |= static_cast<u64>(base[0][c]) << shift;
+                    bits |= static_cast<u64>((base[1][c] - base[0][c]) & 7) << (shift - 3);
+                } else {
+                    bits |= static_cast<u64>(base[0][c]) << (shift + 1);
+                    bits |= static_cast<u64>(base[1][c]) << (shift - 3);
+                }
+            }
+            bits |= static_cast<u64>(halves[0].table) << 37;
+            bits |= static_cast<u64>(halves[1].table) << 34;
+            bits |= static_cast<u64>(diff) << 33;
+            bits |= static_cast<u64>(flip) << 32;
+            for (int half = 0; half < 2; half++) {
+                for (int i = 0; i < 8; i++) {
+                    int x, y;
+                    subblockPixel(flip != 0, half, i, x, y);
+                    const int index = halves[half].indices[i];
+                    bits |= static_cast<u64>(index >> 1) << (16 + x*4 + y);
+                    bits |= static_cast<u64>(index & 1) << (x*4 + y);
+                }
+            }
+            bestError = error;
+            bestBits = bits;
+        }
+    }
+    for (int i = 0; i < 8; i++)
+        out[i] = (bestBits >> (56 - 8*i)) & 0xff;
+}
+
+static const int EAC_MODIFIERS[16][8] = {
+    {-3, -6, -9, -15, 2, 5, 8, 14}, {-3, -7, -10, -13, 2, 6, 9, 12},
+    {-2, -5, -8, -13, 1, 4, 7, 12}, {-2, -4, -6, -13, 1, 3, 5, 12},
+    {-3, -6, -8, -12, 2, 5, 7, 11}, {-3, -7, -9, -11, 2, 6, 8, 10},
+    {-4, -7, -8, -11, 3, 6, 7, 10}, {-3, -5, -8, -11, 2, 4, 7, 10},
+    {-2, -6, -8, -10, 1, 5, 7, 9},  {-2, -5, -8, -10, 1, 4, 7, 9},
+    {-2, -4, -8, -10, 1, 3, 7, 9},  {-2, -5, -7, -10, 1, 4, 6, 9},
+    {-3, -4, -7, -10, 2, 3, 6, 9},  {-1, -2, -3, -10, 0, 1, 2, 9},
+    {-4, -6, -8, -9, 3, 5, 7, 8},   {-3, -5, -7, -9, 2, 4, 6, 8}
+};
+
+// 8 bytes, one big-endian 64-bit word: base value, multiplier, modifier
+// table, then 3-bit indices column by column from the top bits. Each pixel
+// is base + modifier*multiplier. Tables and multipliers are searched around
+// the ones that span the block's range.
+static void encodeEacAlpha(const Block& block, u8* out)
+{
+    int lo = 255, hi = 0;
+    for (int i = 0; i < 16; i++) {
+        lo = std::min<int>(lo, block.pixels[i][3]);
+        hi = std::max<int>(hi, block.pixels[i][3]);
+    }
+
+    int bestError = 1 << 30, bestBase = lo, bestMultiplier = 1, bestTable = 13;
+    u8 bestIndices[16];
+    // Table 13 has a zero modifier, exact for flat blocks
+    std::memset(bestIndices, 4, sizeof(bestIndices));
+    if (lo != hi) {
+        for (int table = 0; table < 16 && bestError > 0; table++) {
+            const int tableLo = EAC_MODIFIERS[table][3], tableHi = EAC_MODIFIERS[table][7];
+            const int spanMultiplier = (hi - lo + (tableHi - tableLo) - 1) / (tableHi - tableLo);
+            for (int multiplier = spanMultiplier - 1; multiplier <= spanMultiplier + 1; multiplier++) {
+                if (multiplier < 1 || multiplier > 15)
+                    continue;
+                const int center = static_cast<int>(std::floor((lo + hi - (tableLo + tableHi)*multiplier) / 2.0f + 0.5f));
+                for (int base = center - 1; base <= center + 1; base++) {
+                    if (base < 0 || base > 255)
+                        continue;
+                    int values[8];
+                    for (int j = 0; j < 8; j++)
+                        values[j] = clampByte(base + EAC_MODIFIERS[table][j]*multiplier);
+                    int error = 0;
+                    u8 indices[16];
+                    for (int i = 0; i < 16 && error < bestError; i++) {
+                        const int alpha = block.pixels[i][3];
+                        int best = 0, bestPixelError = std::abs(values[0] - alpha);
+                        for (int j = 1; j < 8; j++) {
+                            const int pixelError = std::abs(values[j] - alpha);
+                            if (pixelError < bestPixelError) {
+                                bestPixelError = pixelError;
+                                best = j;
+                            }
+                        }
+                        indices[i] = best;
+                        error += bestPixelError*bestPixelError;
+                    }
+                    if (error < bestError) {
+                        bestError = error;
+                        bestBase = base;
+                        bestMultiplier = multiplier;
+                        bestTable = table;
+                        std::memcpy(bestIndices, indices, sizeof(bestIndices));
+                    }
+                }
+            }
+        }
+    }
+
+    u64 bits = static_cast<u64>(bestBase) << 56 | static_cast<u64>(bestMultiplier) << 52 | static_cast<u64>(bestTable) << 48;
+    for (int x = 0; x < 4; x++) {
+        for (int y = 0; y < 4; y++)
+            bits |= static_cast<u64>(bestIndices[y*4 + x]) << (45 - 3*(x*4 + y));
+    }
+    for (int i = 0; i < 8; i++)
+        out[i] = (bits >> (56 - 8*i)) & 0xff;
+}
+
+static void encodeEtc2Rgba(const Block& block, u8* out)
+{
+    encodeEacAlpha(block, out);
+    encodeEtc1(block, out + 8);
+}
+
+// --- Output ---
+
+struct OutputFormat {
+    const char* suffix;
+    u32 glInternalFormat;
+    u32 glBaseInternalFormat;
+    int blockBytes;
+    void (*encode)(const Block& block, u8* out);
+};
+
+static const u32 GL_RGB_BASE  = 0x1907;
+static const u32 GL_RGBA_BASE = 0x1908;
+
+// Blocks of a width x height RGBA image, rows of blocks from the top. Edge
+// blocks repeat the last row and column.
+static void encodeLevel(const u8* pixels, int width, int height, const OutputFormat& format,
+                        WorkerPool& workers, std::vector<u8>& out)
+{
+    const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    out.resize(static_cast<std::size_t>(blocksX)*blocksY*format.blockBytes);
+    workers.parallelFor(blocksY, [&](int by) {
+        Block block;
+        for (int bx = 0; bx < blocksX; bx++) {
+            for (int y = 0; y < 4; y++) {
+                const int sy = std::min(by*4 + y, height - 1);
+                for (int x = 0; x < 4; x++) {
+                    const int sx = std::min(bx*4 + x, width - 1);
+                    std::memcpy(block.pixels[y*4 + x], pixels + (static_cast<std::size_t>(sy)*width + sx)*4, 4);
+                }
+            }
+            format.encode(block, &out[(static_cast<std::size_t>(by)*blocksX + bx)*format.blockBytes]);
+        }
+    });
+}
+
+static bool writeKtx(const std::string& filename, const u8* chain, int width, int height, int levels,
+                     const OutputFormat& format, WorkerPool& workers)
+{
+    KtxHeader header;
+    std::memcpy(header.identifier, KTX_IDENTIFIER, sizeof(header.identifier));
+    header.endianness = KTX_ENDIANNESS;
+    header.glType = 0;
+    header.glTypeSize = 1;
+    header.glFormat = 0;
+    header.glInternalFormat = format.glInternalFormat;
+    header.glBaseInternalFormat = format.glBaseInternalFormat;
+    header.pixelWidth = width;
+    header.pixelHeight = height;
+    header.pixelDepth = 0;
+    header.numberOfArrayElements = 0;
+    header.numberOfFaces = 1;
+    header.numberOfMipmapLevels = levels;
+    header.bytesOfKeyValueData = 0;
+
+    std::ofstream of(filename, std::ofstream::out | std::ofstream::binary);
+    if (!of.is_open())
+        return false;
+    of.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::vector<u8> blocks;
+    std::size_t total = sizeof(header);
+    for (int level = 0; level < levels; level++) {
+        encodeLevel(chain + mipLevelOffset(width, height, 4, level), std::max(1, width >> level), std::max(1, height >> level),
+                    format, workers, blocks);
+        // Levels are whole blocks of 8 or 16 bytes, so never need KTX's 4-byte padding
+        const u32 size = blocks.size();
+        of.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        of.write(reinterpret_cast<const char*>(&blocks[0]), size);
+        total += sizeof(size) + size;
+    }
+    of.close();
+    std::cout << filename << ": " << width << "x" << height << ", " << levels << " levels, " << total << " bytes" << std::endl;
+    return of.good();
+}
+
+int main(int argc, char* argv[])
+{
+    std::string only;
+    MipOptions mips;
+    bool buildMips = false;
+    int threads = 0;
+    std::vector<std::string> arguments;
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        if (argument == "-f" && i + 1 < argc)
+            only = argv[++i];
+        else if (argument == "-m" && i + 1 < argc) {
+            const std::string filter = argv[++i];
+            buildMips = true;
+            mips.filter = filter == "kaiser" ? MipFilter::Kaiser : MipFilter::Box;
+        } else if (argument == "-s")
+            mips.srgb = true;
+        else if (argument == "-j" && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else
+            arguments.push_back(argument);
+    }
+    if (arguments.size() != 2 || (!only.empty() && only != "dxt" && only != "etc1" && only != "etc2")) {
+        std::cout << "Usage: texcompress [-f dxt|etc1|etc2] [-m box|kaiser] [-s] [-j threads] input output_basename" << std::endl;
+        return 1;
+    }
+
+    int width, height, channels;
+    u8* pixels = stbi_load(arguments[0].c_str(), &width, &height, &channels, 4);
+    if (pixels == nullptr) {
+        std::cout << "Failed to read " << arguments[0] << ": " << stbi_failure_reason() << "!" << std::endl;
+        return 2;
+    }
+    bool hasAlpha = false;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(width)*height && !hasAlpha; i++)
+        hasAlpha = pixels[i*4 + 3] != 255;
+    if (width % 4 != 0 || height % 4 != 0)
+        std::cout << "Warning: WebGL only takes DXT textures whose size is a multiple of 4" << std::endl;
+
+    WorkerPool workers(threads);
+    const int levels = buildMips ? mipLevelCount(width, height) : 1;
+    std::vector<u8> chain(buildMips ? mipChainSize(width, height, 4) : static_cast<std::size_t>(width)*height*4);
+    std::memcpy(&chain[0], pixels, static_cast<std::size_t>(width)*height*4);
+    stbi_image_free(pixels);
+    if (buildMips)
+        buildMipChain(&chain[0], width, height, 4, mips, &workers);
+
+    const OutputFormat dxt = hasAlpha ?
+        OutputFormat{".dxt.ktx", KTX_FORMAT_DXT5, GL_RGBA_BASE, 16, encodeDxt5} :
+        OutputFormat{".dxt.ktx", KTX_FORMAT_DXT1, GL_RGB_BASE, 8, encodeDxt1};
+    const OutputFormat etc2 = hasAlpha ?
+        OutputFormat{".etc2.ktx", KTX_FORMAT_ETC2_RGBA, GL_RGBA_BASE, 16, encodeEtc2Rgba} :
+        OutputFormat{".etc2.ktx", KTX_FORMAT_ETC2_RGB, GL_RGB_BASE, 8, encodeEtc1};
+    const OutputFormat etc1 = {".etc1.ktx", KTX_FORMAT_ETC1, GL_RGB_BASE, 8, encodeEtc1};
+
+    std::vector<OutputFormat> outputs;
+    if (only.empty() || only == "dxt")
+        outputs.push_back(dxt);
+    if (only.empty() || only == "etc2")
+        outputs.push_back(etc2);
+    if (only == "etc1" || (only.empty() && !hasAlpha))
+        outputs.push_back(etc1);
+    if (only == "etc1" && hasAlpha)
+        std::cout << "Warning: ETC1 has no alpha, it is dropped" << std::endl;
+
+    for (const OutputFormat& format: outputs) {
+        const std::string filename = arguments[1] + format.suffix;
+        if (!writeKtx(filename, &chain[0], width, height, levels, format, workers)) {
+            std::cout << "Failed to write " << filename << "!" << std::endl;
+            return 3;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "workers.hpp"
+
+#include <algorithm>
+#include <memory>
+
+#ifndef EMSCRIPTEN
+#include <atomic>
+
+WorkerPool::WorkerPool(int numThreads)
+{
+    if (numThreads <= 0) {
+        const int hw = static_cast<int>(std::thread::hardware_concurrency());
+        numThreads = (hw > 1) ? hw-1 : 0;
+    }
+    for (int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread(&WorkerPool::workerMain, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& thread: threads) {
+        thread.join();
+    }
+}
+
+int WorkerPool::numThreads() const
+{
+    return static_cast<int>(threads.size());
+}
+
+void WorkerPool::submit(std::function<void()> job)
+{
+    if (threads.empty()) {
+        job();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    wakeup.notify_one();
+}
+
+void WorkerPool::workerMain()
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+            // Drain the queue before quitting, submitted jobs may hold resources
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int)>& body)
+{
+    if (count <= 0)
+        return;
+    if (threads.empty() || count == 1) {
+        for (int i = 0; i < count; i++)
+            body(i);
+        return;
+    }
+
+    // Iterations are handed out through a shared counter. Helper jobs that
+    // start late find nothing left to do, so the state must outlive this call.
+    struct Loop {
+        std::atomic<int> next;
+        std::atomic<int> done;
+        int count;
+        const std::function<void(int)>* body;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+    loop->next = 0;
+    loop->done = 0;
+    loop->count = count;
+    loop->body = &body;
+
+    auto work = [loop]() {
+        int completed = 0;
+        for (int i = loop->next++; i < loop->count; i = loop->next++) {
+            (*loop->body)(i);
+            completed++;
+        }
+        if (completed > 0 && (loop->done += completed) == loop->count) {
+            std::lock_guard<std::mutex> lock(loop->mutex);
+            loop->finished.notify_all();
+        }
+    };
+
+    const int helpers = std::min(count-1, numThreads());
+    for (int i = 0; i < helpers; i++) {
+        submit(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->finished.wait(lock, [&loop] { return loop->done == loop->count; });
+}
+
+#else
+
+WorkerPool::WorkerPool(int numThreads) {}
+
+WorkerPool::~WorkerPool() {}
+
+int WorkerPool::numThreads() const
+{
+    return 0;
+}
+
+void WorkerPool::submit(std::function<void()> job)
+{
+    job();
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int)>& body)
+{
+    for (int i = 0; i < count; i++)
+        body(i);
+}
+
+#endif
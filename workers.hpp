@@ -0,0 +1,46 @@
+#ifndef __WORKERS_HPP__
+#define __WORKERS_HPP__
+
+#include <functional>
+#include <deque>
+#include <vector>
+
+#ifndef EMSCRIPTEN
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Fixed-size pool of worker threads. Under Emscripten there are no threads,
+// jobs simply run on the calling thread.
+class WorkerPool {
+public:
+    // numThreads == 0 picks one worker per hardware thread, minus the caller
+    explicit WorkerPool(int numThreads = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    int numThreads() const;
+
+    // Fire-and-forget, the job must do its own synchronization
+    void submit(std::function<void()> job);
+
+    // Runs body(0) .. body(count-1) and returns when all of them are done.
+    // The calling thread takes part, so it's safe to call from inside a job.
+    void parallelFor(int count, const std::function<void(int)>& body);
+
+private:
+#ifndef EMSCRIPTEN
+    void workerMain();
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+#endif
+};
+
+#endif